@@ -1,15 +1,259 @@
 // Программа генератор неструктурированных поверхностных прямоугольных сеток при помощи алгоритма Q-Morph для трехмерных B-rep моделей на языке программирования c++
 // На вход подается файл геометрии формата IGES
 // Выходной файл сетки имеет формат NEU
+// Сборка с -DQM_BENCHMARK добавляет функцию main с тестами производительности на синтетических моделях,
+// сборка с -DQM_BATCH - функцию main для пакетной обработки списка файлов IGES
 
 #include <iostream>
 #include <fstream>
+#include <iomanip>
+#include <string>
 #include <vector>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <array>
+#include <unordered_map>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <cmath>
 #include <algorithm>
+#include <numeric>
+#include <limits>
+#include <string_view>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <climits>
+#include <cerrno>
+#include <cassert>
+#include <cstdint>
+#include <atomic>
+#include <chrono>
+#include <random>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
+// Статистика работы программы: время этапов и счетчики операций
+// Сбор включается при сборке с -DQM_STATS; без него макросы QM_STAT_ADD и QM_STAT_TIMER не порождают кода, а все значения равны нулю
+// (аргумент QM_STAT_ADD при этом не вычисляется, но остается в sizeof, чтобы переменные, нужные только статистике, не считались неиспользуемыми)
+// Поля с окончанием _ns - суммарное время в наносекундах по всем потокам, остальные - количество
+#define QM_STATS_FIELDS(X) \
+  X(parse_ns)           /* Разбор параметров сущностей IGES */ \
+  X(surfaces)           /* Прочитанные поверхности */ \
+  X(tessellation_ns)    /* Выбор параметров узлов и разбиение поверхностей */ \
+  X(nodes)              /* Узлы, созданные при разбиении */ \
+  X(shared_sides)       /* Общие стороны соседних поверхностей */ \
+  X(merged_nodes)       /* Узлы общих сторон, объединенные с узлами соседних граней */ \
+  X(quads)              /* Четырехугольники, созданные при разбиении */ \
+  X(weld_ns)            /* Сварка близких узлов */ \
+  X(weld_pairs)         /* Найденные пары близких узлов */ \
+  X(welded_nodes)       /* Узлы, удаленные при сварке */ \
+  X(qmorph_ns)          /* Построение сеток граней продвижением фронта */ \
+  X(background_triangles) /* Треугольники фоновых сеток граней */ \
+  X(front_quads)        /* Четырехугольники, построенные на ребрах фронта */ \
+  X(seams)              /* Закрытые швы фронта */ \
+  X(triangle_swaps)     /* Повороты ребер фоновой сетки треугольников */ \
+  X(inserted_nodes)     /* Узлы, добавленные при восстановлении боковых ребер */ \
+  X(qmorph_failures)    /* Грани, сохранившие исходную сетку */ \
+  X(qmorph_rejected)    /* Грани, новая сетка которых хуже исходной и не принята */ \
+  X(adjacency_ns)       /* Построение таблиц смежности граней */ \
+  X(quality_ns)         /* Вычисление и обновление качества */ \
+  X(quality_updates)    /* Четырехугольники, качество которых проверено при перемещении узлов */ \
+  X(smoothing_ns)       /* Сглаживание, включая проверку положения узлов */ \
+  X(smoothing_sweeps)   /* Проходы сглаживания по всем узлам */ \
+  X(smoothing_moves)    /* Принятые перемещения узлов при сглаживании */ \
+  X(rejected_moves)     /* Отвергнутые перемещения */ \
+  X(surface_ns)         /* Проецирование на поверхность и проверка по иерархии поверхности */ \
+  X(projections)        /* Проецирования узлов на поверхность */ \
+  X(surface_checks)     /* Проверки точек по иерархии поверхности */ \
+  X(neighbour_searches) /* Поиски соседнего четырехугольника */ \
+  X(swap_ns)            /* Перестройка (поворот ребер) */ \
+  X(swap_attempts)      /* Пары четырехугольников, для которых проверялся поворот ребра */ \
+  X(edge_swaps)         /* Выполненные повороты ребер */ \
+  X(queue_pushes)       /* Добавления в очередь четырехугольников */ \
+  X(queue_pops)         /* Извлечения из очереди */ \
+  X(output_ns)          /* Системные вызовы записи файлов */ \
+  X(output_bytes)       /* Записанные байты */
+
+// Структура со значениями статистики
+struct MeshStats {
+  bool enabled = false; // Признак сборки со сбором статистики
+#define QM_STATS_MEMBER(name) long long name = 0;
+  QM_STATS_FIELDS(QM_STATS_MEMBER)
+#undef QM_STATS_MEMBER
+};
+
+// Структура счетчиков статистики, которые увеличиваются из разных потоков
+struct StatsCounters {
+#define QM_STATS_MEMBER(name) atomic<long long> name{0};
+  QM_STATS_FIELDS(QM_STATS_MEMBER)
+#undef QM_STATS_MEMBER
+};
+StatsCounters stats_counters; // Счетчики статистики программы
+
+// Структура для измерения времени от создания до уничтожения объекта с добавлением его к счетчику
+struct StatsTimer {
+  atomic<long long>& counter; // Счетчик времени в наносекундах
+  chrono::steady_clock::time_point start; // Момент начала измерения
+  StatsTimer(atomic<long long>& counter) : counter(counter), start(chrono::steady_clock::now()) {}
+  ~StatsTimer() {
+    counter.fetch_add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count(), memory_order_relaxed);
+  }
+};
+
+#ifdef QM_STATS
+#define QM_STAT_ADD(name, n) stats_counters.name.fetch_add((n), memory_order_relaxed)
+#define QM_STAT_TIMER(name) StatsTimer stats_timer_##name(stats_counters.name)
+#else
+#define QM_STAT_ADD(name, n) ((void)sizeof(n))
+#define QM_STAT_TIMER(name) ((void)0)
+#endif
+
+// Функция для получения текущих значений статистики
+MeshStats mesh_stats() {
+  MeshStats s;
+#ifdef QM_STATS
+  s.enabled = true;
+#endif
+#define QM_STATS_COPY(name) s.name = stats_counters.name.load(memory_order_relaxed);
+  QM_STATS_FIELDS(QM_STATS_COPY)
+#undef QM_STATS_COPY
+  return s;
+}
+
+// Функция для обнуления статистики
+void reset_mesh_stats() {
+#define QM_STATS_RESET(name) stats_counters.name.store(0, memory_order_relaxed);
+  QM_STATS_FIELDS(QM_STATS_RESET)
+#undef QM_STATS_RESET
+}
+
+// Функция для записи статистики в виде объекта JSON; время записывается в секундах под именем с окончанием _seconds
+string mesh_stats_json(const MeshStats& s) {
+  string json = string("{\"enabled\": ") + (s.enabled ? "true" : "false");
+  char buffer[128];
+  // Функция для добавления одного поля
+  auto add = [&](const char* name, long long value) {
+    size_t n = strlen(name);
+    if (n > 3 && strcmp(name + n - 3, "_ns") == 0) {
+      snprintf(buffer, sizeof(buffer), ", \"%.*s_seconds\": %.9f", (int)(n - 3), name, value / 1e9);
+    } else {
+      snprintf(buffer, sizeof(buffer), ", \"%s\": %lld", name, value);
+    }
+    json += buffer;
+  };
+#define QM_STATS_JSON(name) add(#name, s.name);
+  QM_STATS_FIELDS(QM_STATS_JSON)
+#undef QM_STATS_JSON
+  return json + "}";
+}
+
+// Структура арены: память выдается последовательно из больших блоков и возвращается только целиком
+// Освобождение отдельного участка ничего не делает, а блоки после отката сохраняются и используются повторно, поэтому задание
+// выполняет несколько больших выделений памяти вместо выделения на каждый массив. Арена не потокобезопасна
+struct Arena : pmr::memory_resource {
+  // Структура для хранения блока памяти
+  struct Block {
+    char* data;
+    size_t size;
+  };
+  // Структура для хранения положения арены, к которому можно откатиться
+  struct Mark {
+    int block;
+    size_t offset;
+  };
+  vector<Block> blocks; // Выделенные блоки в порядке заполнения
+  int current = 0; // Блок, из которого выдается память
+  size_t offset = 0; // Занятая часть текущего блока
+  size_t block_size; // Размер следующего нового блока; каждый новый блок вдвое больше предыдущего
+
+  Arena(size_t block_size = 1 << 20) : block_size(block_size) {}
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+  ~Arena() {
+    release();
+  }
+
+  // Функция для получения текущего положения арены
+  Mark mark() const {
+    return {current, offset};
+  }
+  // Функция для отката к положению m: вся память, выданная после него, считается свободной
+  void rewind(const Mark& m) {
+    current = m.block;
+    offset = m.offset;
+  }
+  // Функция для отката к началу: блоки остаются за ареной и заполняются заново
+  void reset() {
+    rewind({0, 0});
+  }
+  // Функция для возврата всех блоков системе
+  void release() {
+    for (const Block& b : blocks) ::operator delete(b.data);
+    blocks.clear();
+    current = 0;
+    offset = 0;
+  }
+  // Функция для подсчета общего размера блоков арены в байтах
+  size_t capacity() const {
+    size_t size = 0;
+    for (const Block& b : blocks) size += b.size;
+    return size;
+  }
+
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    // Ищем место в текущем и следующих блоках, а если его нет - добавляем новый блок
+    for (; current < (int)blocks.size(); current++, offset = 0) {
+      const Block& b = blocks[current];
+      uintptr_t start = (uintptr_t(b.data + offset) + alignment - 1) & ~uintptr_t(alignment - 1); // Выровненное начало участка
+      if (start + bytes <= uintptr_t(b.data + b.size)) {
+        offset = start + bytes - uintptr_t(b.data);
+        return (void*)start;
+      }
+    }
+    size_t size = max(block_size, bytes + alignment);
+    block_size *= 2;
+    blocks.push_back({(char*)::operator new(size), size});
+    offset = 0;
+    return do_allocate(bytes, alignment);
+  }
+  void do_deallocate(void*, size_t, size_t) override {}
+  bool do_is_equal(const pmr::memory_resource& other) const noexcept override {
+    return this == &other;
+  }
+};
+
+// Функция для получения арены временных массивов текущего потока
+// Функции берут из нее рабочие массивы внутри ScratchScope, поэтому в установившемся режиме память не выделяется вовсе
+Arena& scratch_arena() {
+  thread_local Arena arena;
+  return arena;
+}
+
+// Структура области временной памяти: при выходе из области арена откатывается к положению на входе
+// Все массивы, созданные внутри области, должны быть уничтожены до выхода, а массивы этой же арены, созданные до нее,
+// не должны расти внутри области
+struct ScratchScope {
+  Arena& arena; // Арена временных массивов
+  Arena::Mark start; // Положение арены на входе в область
+  ScratchScope(Arena& arena = scratch_arena()) : arena(arena), start(arena.mark()) {}
+  ~ScratchScope() {
+    arena.rewind(start);
+  }
+};
+
 // Структура для хранения точки в трехмерном пространстве
 struct Point {
   double x, y, z;
@@ -20,6 +264,8 @@ struct Point {
 struct Vector {
   double x, y, z;
   Vector(double x = 0, double y = 0, double z = 0) : x(x), y(y), z(z) {}
+  // Вектор из начала координат в точку
+  Vector(const Point& p) : x(p.x), y(p.y), z(p.z) {}
   // Длина вектора
   double length() const {
     return sqrt(x * x + y * y + z * z);
@@ -55,6 +301,31 @@ Point operator/(const Point& p, double k) {
   return Point(p.x / k, p.y / k, p.z / k);
 }
 
+// Оператор сравнения двух точек
+bool operator==(const Point& p1, const Point& p2) {
+  return p1.x == p2.x && p1.y == p2.y && p1.z == p2.z;
+}
+
+// Оператор смещения точки на вектор в обратном направлении
+Point operator-(const Point& p, const Vector& v) {
+  return Point(p.x - v.x, p.y - v.y, p.z - v.z);
+}
+
+// Оператор изменения направления вектора
+Vector operator-(const Vector& v) {
+  return Vector(-v.x, -v.y, -v.z);
+}
+
+// Оператор сложения двух векторов
+Vector operator+(const Vector& v1, const Vector& v2) {
+  return Vector(v1.x + v2.x, v1.y + v2.y, v1.z + v2.z);
+}
+
+// Оператор умножения вектора на число
+Vector operator*(const Vector& v, double k) {
+  return Vector(v.x * k, v.y * k, v.z * k);
+}
+
 // Оператор скалярного произведения двух векторов
 double operator*(const Vector& v1, const Vector& v2) {
   return v1.x * v2.x + v1.y * v2.y + v1.z * v2.z;
@@ -67,28 +338,161 @@ Vector operator^(const Vector& v1, const Vector& v2) {
                 v1.x * v2.y - v1.y * v2.x);
 }
 
+// Точные геометрические предикаты с адаптивной точностью: J. R. Shewchuk, Adaptive Precision Floating-Point Arithmetic
+// and Fast Robust Geometric Predicates. Определитель сначала вычисляется в обычной арифметике, и если он по модулю больше
+// оценки погрешности округления, его знак верен; иначе определитель вычисляется точно в виде разложения - суммы
+// неперекрывающихся чисел двойной точности. Знак не зависит от масштаба координат и одинаков при каждом запуске
+
+// Функция для точного сложения: a + b = x + y, где x - округленная сумма, y - ее погрешность
+inline void two_sum(double a, double b, double& x, double& y) {
+  x = a + b;
+  double bv = x - a;
+  double av = x - bv;
+  y = (a - av) + (b - bv);
+}
+
+// Функция для точного умножения: a * b = x + y, где x - округленное произведение, y - его погрешность
+inline void two_product(double a, double b, double& x, double& y) {
+  x = a * b;
+  y = fma(a, b, -x);
+}
+
+// Функция для прибавления числа b к разложению e из n компонент по возрастанию модуля
+// Результат записывается в h без нулевых компонент (h может совпадать с e), возвращает количество компонент
+int grow_expansion(int n, const double* e, double b, double* h) {
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    double y;
+    two_sum(b, e[i], b, y);
+    if (y != 0) h[k++] = y;
+  }
+  if (b != 0 || k == 0) h[k++] = b;
+  return k;
+}
+
+// Функция для точного вычисления a * d - b * c, где a, b, c, d - разности пар чисел, заданные разложениями из двух компонент
+// Возвращает старшую компоненту результата: ее знак равен знаку точного значения
+double exact_determinant2(const double a[2], const double b[2], const double c[2], const double d[2]) {
+  double h[16];
+  int n = 0;
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 2; j++) {
+      double x, y;
+      two_product(a[i], d[j], x, y);
+      n = grow_expansion(n, h, y, h);
+      n = grow_expansion(n, h, x, h);
+      two_product(-b[i], c[j], x, y);
+      n = grow_expansion(n, h, y, h);
+      n = grow_expansion(n, h, x, h);
+    }
+  }
+  return h[n - 1];
+}
+
+// Функция для вычисления удвоенной ориентированной площади треугольника (ax, ay) (bx, by) (cx, cy) с точным знаком
+// Площадь положительна, если вершины обходятся против часовой стрелки, и равна нулю только для точно вырожденного треугольника
+inline double orient2d(double ax, double ay, double bx, double by, double cx, double cy) {
+  const double eps = numeric_limits<double>::epsilon() / 2;
+  const double bound = (3 + 16 * eps) * eps; // Относительная оценка погрешности быстрого вычисления
+  double left = (ax - cx) * (by - cy), right = (ay - cy) * (bx - cx);
+  double det = left - right;
+  if (abs(det) > bound * (abs(left) + abs(right))) return det;
+  // Разности координат вычисляются точно в виде разложений из двух компонент
+  double acx[2], acy[2], bcx[2], bcy[2];
+  two_sum(ax, -cx, acx[1], acx[0]);
+  two_sum(ay, -cy, acy[1], acy[0]);
+  two_sum(bx, -cx, bcx[1], bcx[0]);
+  two_sum(by, -cy, bcy[1], bcy[0]);
+  return exact_determinant2(acx, acy, bcx, bcy);
+}
+
+// Функция для вычисления удвоенной ориентированной площади треугольника a b c на плоскости z = 0 с точным знаком
+inline double orient2d(const Point& a, const Point& b, const Point& c) {
+  return orient2d(a.x, a.y, b.x, b.y, c.x, c.y);
+}
+
+// Функция для выбора оси, вдоль которой проецируется плоская фигура с нормалью n: отбрасывается координата
+// с наибольшей по модулю составляющей нормали, поэтому проекция не вырождается (0 - x, 1 - y, 2 - z)
+inline int dominant_axis(const Vector& n) {
+  double x = abs(n.x), y = abs(n.y), z = abs(n.z);
+  return x > y && x > z ? 0 : (y > z ? 1 : 2);
+}
+
+// Функция для вычисления координат точки на координатной плоскости, перпендикулярной оси axis
+// Оставшиеся координаты берутся в циклическом порядке, поэтому обход против часовой стрелки на этой плоскости
+// соответствует взгляду со стороны положительного направления оси
+inline void axis_coordinates(const Point& p, int axis, double& u, double& v) {
+  u = axis == 0 ? p.y : (axis == 1 ? p.z : p.x);
+  v = axis == 0 ? p.z : (axis == 1 ? p.x : p.y);
+}
+
+// Функция для вычисления точного знака ориентации треугольника a b c в пространстве при взгляде со стороны нормали n
+// Треугольник проецируется вдоль оси dominant_axis(n); возвращает 1 при обходе против часовой стрелки, -1 - по часовой
+// и 0, если проекция вырождена
+int orientation(const Point& a, const Point& b, const Point& c, const Vector& n) {
+  int axis = dominant_axis(n);
+  double au, av, bu, bv, cu, cv;
+  axis_coordinates(a, axis, au, av);
+  axis_coordinates(b, axis, bu, bv);
+  axis_coordinates(c, axis, cu, cv);
+  double det = orient2d(au, av, bu, bv, cu, cv);
+  double sign = axis == 0 ? n.x : (axis == 1 ? n.y : n.z);
+  if (det == 0 || sign == 0) return 0;
+  return (det > 0) == (sign > 0) ? 1 : -1;
+}
+
+// Функция для проверки, лежит ли точка p внутри многоугольника из n вершин vertex(i) или на его границе
+// Многоугольник и точка проецируются вдоль оси dominant_axis(normal), и по точным знакам ориентации вычисляется
+// число оборотов границы вокруг точки; многоугольник может быть невыпуклым. Точка, лежащая вне плоскости
+// многоугольника, проецируется вдоль этой оси, поэтому ее нужно заранее спроецировать на плоскость
+template <class F>
+bool inside_polygon(const Point& p, int n, F vertex, const Vector& normal) {
+  int axis = dominant_axis(normal);
+  double pu, pv;
+  axis_coordinates(p, axis, pu, pv);
+  int winding = 0;
+  for (int i = 0; i < n; i++) {
+    double au, av, bu, bv;
+    axis_coordinates(vertex(i), axis, au, av);
+    axis_coordinates(vertex((i + 1) % n), axis, bu, bv);
+    double o = orient2d(au, av, bu, bv, pu, pv);
+    // Точка на ребре лежит на границе многоугольника
+    if (o == 0 && min(au, bu) <= pu && pu <= max(au, bu) && min(av, bv) <= pv && pv <= max(av, bv)) return true;
+    if (av <= pv) {
+      if (bv > pv && o > 0) winding++;
+    } else {
+      if (bv <= pv && o < 0) winding--;
+    }
+  }
+  return winding != 0;
+}
+
 // Структура для хранения уравнения плоскости в виде a*x + b*y + c*z + d = 0
 struct Plane {
   double a, b, c, d;
   Plane(double a = 0, double b = 0, double c = 0, double d = 0) : a(a), b(b), c(c), d(d) {}
 };
 
+// Функция для получения нормального вектора плоскости
+Vector normal(const Plane& pl) {
+  return Vector(pl.a, pl.b, pl.c);
+}
+
 // Функция для вычисления расстояния от точки до плоскости
 double distance(const Point& p, const Plane& pl) {
   return abs(pl.a * p.x + pl.b * p.y + pl.c * p.z + pl.d) / sqrt(pl.a * pl.a + pl.b * pl.b + pl.c * pl.c);
 }
 
-// Функция для вычисления проекции точки на плоскость
-Point project(const Point& p, const Plane& pl
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Функция для вычисления проекции точки на плоскость
 Point project(const Point& p, const Plane& pl) {
   // Находим нормальный вектор к плоскости
   Vector n(pl.a, pl.b, pl.c);
   // Нормализуем его
   n.normalize();
-  // Находим расстояние от точки до плоскости
-  double d = distance(p, pl);
+  // Находим расстояние от точки до плоскости со знаком: оно положительно со стороны нормали
+  double l = sqrt(pl.a * pl.a + pl.b * pl.b + pl.c * pl.c);
+  if (l == 0) return p;
+  double d = (pl.a * p.x + pl.b * p.y + pl.c * p.z + pl.d) / l;
   // Вычитаем из точки нормальный вектор, умноженный на расстояние
   return p - n * d;
 }
@@ -110,17 +514,10 @@ struct Triangle {
 };
 
 // Функция для проверки, лежит ли точка внутри треугольника или на его границе
+// Проекция точки на плоскость треугольника сравнивается с его ребрами по точным знакам ориентации
 bool inside(const Point& p, const Triangle& t) {
-  // Проецируем точку на плоскость треугольника
-  Point q = project(p, t.pl);
-  // Вычисляем площади треугольников, образованных вершинами треугольника и проекцией точки
-  double s1 = ((t.p1 - q) ^ (t.p2 - q)).length() / 2; // Площадь треугольника t.p1 t.p2 q
-  double s2 = ((t.p2 - q) ^ (t.p3 - q)).length() / 2; // Площадь треугольника t.p2 t.p3 q
-  double s3 = ((t.p3 - q) ^ (t.p1 - q)).length() / 2; // Площадь треугольника t.p3 t.p1 q
-  double s = ((t.p1 - t.p2) ^ (t.p3 - t.p2)).length() / 2; // Площадь исходного треугольника t.p1 t.p2 t.p3
-  // Если сумма площадей меньших треугольников равна площади исходного треугольника с некоторой погрешностью,
-  // то точка лежит внутри или на границе исходного треугольника
-  return abs(s1 + s2 + s3 - s) < 1e-6;
+  const Point* v[3] = {&t.p1, &t.p2, &t.p3};
+  return inside_polygon(project(p, t.pl), 3, [&](int i) -> const Point& { return *v[i]; }, normal(t.pl));
 }
 
 // Структура для хранения ребра в трехмерном пространстве
@@ -129,11 +526,9 @@ struct Edge {
   Edge(const Point& p1 = Point(), const Point& p2 = Point()) : p1(p1), p2(p2) {}
 };
 
-// Функция
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Функция для вычисления длины ребра
 double length(const Edge& e) {
-  return (e.p1 - e.p2).length();
+  return Vector(e.p1 - e.p2).length();
 }
 
 // Функция для вычисления угла между двумя ребрами
@@ -169,188 +564,503 @@ struct Quad {
 };
 
 // Функция для проверки, лежит ли точка внутри четырехугольника или на его границе
+// Проекция точки на плоскость четырехугольника проверяется по числу оборотов границы с точными знаками ориентации
+// в проекции вдоль нормали из произведения диагоналей (она не зависит от вогнутого угла); четырехугольник может быть невыпуклым
 bool inside(const Point& p, const Quad& q) {
-  // Проецируем точку на плоскость четырехугольника
-  Point r = project(p, q.pl);
-  // Вычисляем площади треугольников, образованных вершинами четырехугольника и проекцией точки
-  double s1 = ((q.p1 - r) ^ (q.p2 - r)).length() / 2; // Площадь треугольника q.p1 q.p2 r
-  double s2 = ((q.p2 - r) ^ (q.p3 - r)).length() / 2; // Площадь треугольника q.p2 q.p3 r
-  double s3 = ((q.p3 - r) ^ (q.p4 - r)).length() / 2; // Площадь треугольника q.p3 q.p4 r
-  double s4 = ((q.p4 - r) ^ (q.p1 - r)).length() / 2; // Площадь треугольника q.p4 q.p1 r
-  double s = ((q.p1 - q.p2) ^ (q.p3 - q.p2)).
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Вычисляем площади треугольников, образованных вершинами четырехугольника и проекцией точки
-  double s1 = ((q.p1 - r) ^ (q.p2 - r)).length() / 2; // Площадь треугольника q.p1 q.p2 r
-  double s2 = ((q.p2 - r) ^ (q.p3 - r)).length() / 2; // Площадь треугольника q.p2 q.p3 r
-  double s3 = ((q.p3 - r) ^ (q.p4 - r)).length() / 2; // Площадь треугольника q.p3 q.p4 r
-  double s4 = ((q.p4 - r) ^ (q.p1 - r)).length() / 2; // Площадь треугольника q.p4 q.p1 r
-  double s = ((q.p1 - q.p2) ^ (q.p3 - q.p2)).length() / 2 + ((q.p3 - q.p4) ^ (q.p1 - q.p4)).length() / 2; // Площадь исходного четырехугольника q.p1 q.p2 q.p3 q.p4
-  // Если сумма площадей меньших треугольников равна площади исходного четырехугольника с некоторой погрешностью,
-  // то точка лежит внутри или на границе исходного четырехугольника
-  return abs(s1 + s2 + s3 + s4 - s) < 1e-6;
+  const Point* v[4] = {&q.p1, &q.p2, &q.p3, &q.p4};
+  Vector n = Vector(q.p3 - q.p1) ^ Vector(q.p4 - q.p2);
+  return inside_polygon(project(p, q.pl), 4, [&](int i) -> const Point& { return *v[i]; }, n);
+}
+
+// Функция для вычисления четырех углов четырехугольника в радианах
+void angles(const Quad& q, double a[4]) {
+  // Берем четыре ребра четырехугольника
+  Edge e1(q.p1, q.p2);
+  Edge e2(q.p2, q.p3);
+  Edge e3(q.p3, q.p4);
+  Edge e4(q.p4, q.p1);
+  // Вычисляем углы при каждой из вершин
+  a[0] = angle(e1, e4);
+  a[1] = angle(e2, e1);
+  a[2] = angle(e3, e2);
+  a[3] = angle(e4, e3);
+}
+
+// Функция для вычисления качества четырехугольника по метрике углов
+// Метрика углов: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
+double quality(const double a[4]) {
+  return min(a[0], min(a[1], min(a[2], a[3]))) / max(a[0], max(a[1], max(a[2], a[3])));
+}
+
+// Структура для хранения индексированной четырехугольной сетки
+// Каждый узел хранится один раз, а четырехугольники ссылаются на узлы по индексам
+// Массивы размещаются в заданном источнике памяти (по умолчанию - в куче), например в арене задания
+struct Mesh {
+  pmr::vector<Point> nodes; // Узлы сетки
+  pmr::vector<array<int, 4>> quads; // Индексы вершин четырехугольников в порядке обхода против часовой стрелки
+  pmr::vector<int> owner; // Индекс грани (патча), которой принадлежит каждый четырехугольник
+  pmr::vector<array<double, 2>> uv; // Параметры (u, v) узлов на поверхности их грани (для узлов границы - на поверхности одной из граней); либо пуст, либо имеет размер nodes
+  Mesh(pmr::memory_resource* memory = pmr::get_default_resource()) : nodes(memory), quads(memory), owner(memory), uv(memory) {}
+};
+
+// Функция для добавления узла в сетку, возвращает индекс узла
+// Узел, добавленный без параметров, не связан с поверхностью: его параметры равны NAN
+int add_node(Mesh& mesh, const Point& p) {
+  mesh.nodes.push_back(p);
+  if (!mesh.uv.empty()) mesh.uv.push_back({NAN, NAN});
+  return mesh.nodes.size() - 1;
+}
+
+// Функция для добавления четырехугольника в сетку, возвращает индекс четырехугольника
+int add_quad(Mesh& mesh, int n1, int n2, int n3, int n4, int face) {
+  mesh.quads.push_back({n1, n2, n3, n4});
+  mesh.owner.push_back(face);
+  return mesh.quads.size() - 1;
+}
+
+// Функция для получения четырехугольника сетки по его индексу
+Quad make_quad(const Mesh& mesh, int i) {
+  const array<int, 4>& q = mesh.quads[i];
+  return Quad(mesh.nodes[q[0]], mesh.nodes[q[1]], mesh.nodes[q[2]], mesh.nodes[q[3]]);
+}
+
+// Функция для вычисления угла в радианах по его косинусу без вызова acos
+// Приближение 4.4.46 из справочника M. Abramowitz, I. Stegun: acos(x) = sqrt(1 - x) * P7(x) на [0, 1] с погрешностью не больше 2e-8;
+// отрицательные значения отражаются через acos(-x) = pi - acos(x). Ветвление сводится к выбору, поэтому цикл векторизуется
+inline double fast_acos(double c) {
+  double x = abs(c);
+  double p = -0.0012624911;
+  p = p * x + 0.0066700901;
+  p = p * x - 0.0170881256;
+  p = p * x + 0.0308918810;
+  p = p * x - 0.0501743046;
+  p = p * x + 0.0889789874;
+  p = p * x - 0.2145988016;
+  p = p * x + 1.5707963050;
+  double r = sqrt(max(0.0, 1 - x)) * p;
+  return c >= 0 ? r : M_PI - r;
+}
+
+// Функция для вычисления качества по косинусам четырех углов: наименьший угол соответствует наибольшему косинусу
+inline double quality_from_cosines(double c0, double c1, double c2, double c3) {
+  double a_min = fast_acos(max(max(c0, c1), max(c2, c3)));
+  double a_max = fast_acos(min(min(c0, c1), min(c2, c3)));
+  return a_max > 0 ? a_min / a_max : 0;
+}
+
+// Функция для вычисления косинуса угла при вершине b между ребрами a b и b c (как angle(Edge(b, c), Edge(a, b)))
+// Косинус получается из скалярного произведения ребер и их длин, без нормализации векторов
+inline double corner_cosine(const Point& a, const Point& b, const Point& c) {
+  double ux = c.x - b.x, uy = c.y - b.y, uz = c.z - b.z;
+  double vx = b.x - a.x, vy = b.y - a.y, vz = b.z - a.z;
+  double d = sqrt((ux * ux + uy * uy + uz * uz) * (vx * vx + vy * vy + vz * vz));
+  double dot = ux * vx + uy * vy + uz * vz;
+  return d > 0 ? max(-1.0, min(1.0, dot / d)) : 0;
+}
+
+// Функция для вычисления качества четырехугольника с вершинами q без вызова acos для каждого угла
+double quad_quality(const Mesh& mesh, const array<int, 4>& q) {
+  const Point& p1 = mesh.nodes[q[0]];
+  const Point& p2 = mesh.nodes[q[1]];
+  const Point& p3 = mesh.nodes[q[2]];
+  const Point& p4 = mesh.nodes[q[3]];
+  return quality_from_cosines(corner_cosine(p4, p1, p2), corner_cosine(p1, p2, p3), corner_cosine(p2, p3, p4), corner_cosine(p3, p4, p1));
+}
+
+// Функция для вычисления нормали четырехугольника с вершинами q по произведению диагоналей
+// Направление нормали не зависит от того, какой из углов четырехугольника вогнутый
+Vector quad_normal(const Mesh& mesh, const array<int, 4>& q) {
+  return Vector(mesh.nodes[q[2]] - mesh.nodes[q[0]]) ^ Vector(mesh.nodes[q[3]] - mesh.nodes[q[1]]);
+}
+
+// Функция для подсчета углов четырехугольника с вершинами q с положительной (pos) и отрицательной (neg) точной
+// ориентацией при взгляде со стороны нормали n; у выпуклого четырехугольника все углы ориентированы одинаково
+void corner_orientations(const Mesh& mesh, const array<int, 4>& q, const Vector& n, int& pos, int& neg) {
+  pos = neg = 0;
+  for (int k = 0; k < 4; k++) {
+    int o = orientation(mesh.nodes[q[(k + 3) % 4]], mesh.nodes[q[k]], mesh.nodes[q[(k + 1) % 4]], n);
+    pos += o > 0;
+    neg += o < 0;
+  }
+}
+
+// Функция для вычисления косинусов углов c[k][t] и качества q[t] четырехугольников first + t, t = 0..count-1
+// Координаты вершин блока четырехугольников сначала собираются в структуру массивов, а затем обрабатываются
+// циклом без обращений по индексам узлов, который компилятор векторизует; c или q могут быть nullptr
+void quality_kernel(const Mesh& mesh, int first, int count, double* const c[4], double* q) {
+  const int block = 256; // Количество четырехугольников в блоке
+  double x[4][block], y[4][block], z[4][block]; // Координаты вершин четырехугольников блока
+  double cs[4][block]; // Косинусы углов блока
+  for (int b = 0; b < count; b += block) {
+    int n = min(block, count - b);
+    for (int t = 0; t < n; t++) {
+      const array<int, 4>& v = mesh.quads[first + b + t];
+      for (int k = 0; k < 4; k++) {
+        const Point& p = mesh.nodes[v[k]];
+        x[k][t] = p.x;
+        y[k][t] = p.y;
+        z[k][t] = p.z;
+      }
+    }
+    for (int k = 0; k < 4; k++) {
+      const int kp = (k + 3) % 4, kn = (k + 1) % 4; // Предыдущая и следующая вершины
+      for (int t = 0; t < n; t++) {
+        double ux = x[kn][t] - x[k][t], uy = y[kn][t] - y[k][t], uz = z[kn][t] - z[k][t];
+        double vx = x[k][t] - x[kp][t], vy = y[k][t] - y[kp][t], vz = z[k][t] - z[kp][t];
+        double d = sqrt((ux * ux + uy * uy + uz * uz) * (vx * vx + vy * vy + vz * vz));
+        double dot = ux * vx + uy * vy + uz * vz;
+        cs[k][t] = d > 0 ? max(-1.0, min(1.0, dot / d)) : 0;
+      }
+    }
+    if (c) {
+      for (int k = 0; k < 4; k++) memcpy(c[k] + b, cs[k], n * sizeof(double));
+    }
+    if (q) {
+      for (int t = 0; t < n; t++) q[b + t] = quality_from_cosines(cs[0][t], cs[1][t], cs[2][t], cs[3][t]);
+    }
+  }
 }
 
 // Структура для хранения грани в трехмерном пространстве
+// Четырехугольники грани занимают непрерывный диапазон [first, first + count) в сетке тела
 struct Face {
-  vector<Point> points; // Вершины грани в порядке обхода против часовой стрелки
+  vector<int> contour; // Индексы узлов границы грани в порядке обхода против часовой стрелки
+  int first; // Индекс первого четырехугольника грани в сетке тела
+  int count; // Количество четырехугольников грани
   Plane pl; // Плоскость, на которой лежит грань
-  Face(const vector<Point>& points = vector<Point>()) : points(points) {
-    // Вычисляем коэффициенты уравнения плоскости по трем точкам
-    Vector v1 = points[1] - points[0]; // Вектор из первой вершины во вторую
-    Vector v2 = points[2] - points[0]; // Вектор из первой вершины в третью
-    Vector n = v1 ^ v2; // Нормальный вектор к плоскости - векторное произведение двух векторов
+  int surface = -1; // Индекс исходной поверхности грани в теле или -1, если грань не связана с поверхностью
+  vector<array<double, 2>> contour_uv; // Параметры узлов контура на поверхности грани или пустой массив, если они совпадают с параметрами узлов сетки
+  Face(const pmr::vector<Point>& nodes = pmr::vector<Point>(), vector<int> boundary = vector<int>(), int first = 0, int count = 0)
+      : contour(move(boundary)), first(first), count(count) {
+    // Вычисляем нормаль к плоскости по методу Ньюэлла, чтобы не зависеть от выбора трех точек контура
+    Vector n;
+    Point c;
+    int m = contour.size(); // Количество вершин контура
+    for (int i = 0; i < m; i++) {
+      const Point& a = nodes[contour[i]];
+      const Point& b = nodes[contour[(i + 1) % m]];
+      n.x += (a.y - b.y) * (a.z + b.z);
+      n.y += (a.z - b.z) * (a.x + b.x);
+      n.z += (a.x - b.x) * (a.y + b.y);
+      c = c + a;
+    }
+    if (m > 0) c = c / m; // Центр контура - точка, через которую проходит плоскость
     pl.a = n.x;
     pl.b = n.y;
     pl.c = n.z;
-    pl.d = -n * points[0]; // Скалярное произведение нормального вектора и любой точки на плоскости с обратным знаком
+    pl.d = -n * c; // Скалярное произведение нормального вектора и любой точки на плоскости с обратным знаком
   }
 };
 
-// Функция для проверки, лежит ли точка внутри грани или на его границе
-bool inside(const Point& p, const Face& f) {
-  // Проецируем точку на плоскость грани
-  Point q = project(p, f.pl);
-  // Для каждого ребра грани проверяем, с какой стороны от него лежит проекция точки
-  int n = f.points.size(); // Количество вершин грани
-  for (int i = 0; i < n; i++) {
-    // Берем ребро из i-й вершины в i+1-ю вершину (по модулю n)
-    Point a = f.points[i];
-    Point b = f.points[(i + 1) % n];
-    // Находим нормальный вектор к ребру, направленный внутрь грани
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Берем ребро из i-й вершины в i+1-ю вершину (по модулю n)
-    Point a = f.points[i];
-    Point b = f.points[(i + 1) % n];
-    // Находим нормальный вектор к ребру, направленный внутрь грани
-    Vector v = b - a; // Вектор, соответствующий ребру
-    Vector n = v ^ f.pl; // Векторное произведение вектора ребра и нормали к плоскости грани
-    n.normalize(); // Нормализуем нормальный вектор
-    // Вычисляем скалярное произведение нормального вектора и вектора из начала ребра в проекцию точки
-    double dot = n * (q - a);
-    // Если скалярное произведение отрицательно, то точка лежит снаружи грани
-    if (dot < 0) return false;
-  }
-  // Если точка лежит с внутренней стороны всех ребер грани, то она лежит внутри или на границе грани
-  return true;
+// Функция для проверки, лежит ли точка внутри грани или на ее границе
+// Проекция точки на плоскость грани проверяется по числу оборотов контура с точными знаками ориентации,
+// поэтому контур может быть невыпуклым
+bool inside(const Point& p, const Face& f, const Mesh& mesh) {
+  return inside_polygon(project(p, f.pl), f.contour.size(), [&](int i) -> const Point& { return mesh.nodes[f.contour[i]]; }, normal(f.pl));
 }
 
+// Структура для хранения B-spline поверхности (сущность IGES типа 128)
+// Узловые векторы и контрольная сеть размещаются в источнике памяти поверхности; при копировании в контейнер pmr
+// поверхность переносится в источник памяти контейнера
+struct BSplineSurface {
+  typedef pmr::polymorphic_allocator<char> allocator_type;
+  int k1 = 0, k2 = 0; // Степени B-spline базисных функций по двум направлениям
+  pmr::vector<double> u; // Узловой вектор по первому направлению
+  pmr::vector<double> v; // Узловой вектор по второму направлению
+  pmr::vector<pmr::vector<Point>> p; // Контрольные точки поверхности p[i][j], i - индекс по первому направлению
+  double u0 = 0, u1 = 0, v0 = 0, v1 = 0; // Область параметров, заданная в записи сущности
+  BSplineSurface(const allocator_type& a = allocator_type()) : u(a), v(a), p(a) {}
+  BSplineSurface(const BSplineSurface& s, const allocator_type& a = allocator_type())
+      : k1(s.k1), k2(s.k2), u(s.u, a), v(s.v, a), p(s.p, a), u0(s.u0), u1(s.u1), v0(s.v0), v1(s.v1) {}
+  BSplineSurface(BSplineSurface&& s, const allocator_type& a)
+      : k1(s.k1), k2(s.k2), u(move(s.u), a), v(move(s.v), a), p(move(s.p), a), u0(s.u0), u1(s.u1), v0(s.v0), v1(s.v1) {}
+  BSplineSurface(BSplineSurface&&) = default;
+  BSplineSurface& operator=(const BSplineSurface&) = default;
+  BSplineSurface& operator=(BSplineSurface&&) = default;
+};
+
 // Структура для хранения тела в трехмерном пространстве
+// Тело может владеть ареной задания: тогда сетка и поверхности размещены в ней и освобождаются вместе с телом
 struct Body {
+  shared_ptr<Arena> arena; // Арена задания или пустой указатель, если массивы тела размещены в куче
+  Mesh mesh; // Общая сетка всех граней тела
   vector<Face> faces; // Грани тела
-  Body(const vector<Face>& faces = vector<Face>()) : faces(faces) {}
+  pmr::vector<BSplineSurface> surfaces; // Исходные поверхности граней
+  Body(vector<Face> faces = vector<Face>()) : faces(move(faces)) {}
+  Body(shared_ptr<Arena> arena) : arena(arena), mesh(arena.get()), surfaces(arena.get()) {}
 };
 
-// Функция для чтения тела из файла формата IGES
-Body read_iges(const string& filename) {
-  // Открываем файл для чтения
-  ifstream fin(filename);
-  if (!fin) {
-    cerr << "Error: cannot open file " << filename << endl;
-    exit(1);
+// Функция для поиска ближайшей к p точки треугольника a b c
+// Алгоритм из книги C. Ericson "Real-Time Collision Detection", раздел 5.1.5: определяем область Вороного, в которую попадает точка
+Point closest_point(const Point& p, const Point& a, const Point& b, const Point& c) {
+  Vector ab = b - a, ac = c - a, ap = p - a;
+  double d1 = ab * ap, d2 = ac * ap;
+  if (d1 <= 0 && d2 <= 0) return a; // Область вершины a
+  Vector bp = p - b;
+  double d3 = ab * bp, d4 = ac * bp;
+  if (d3 >= 0 && d4 <= d3) return b; // Область вершины b
+  double vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + (b - a) * (d1 / (d1 - d3)); // Область ребра ab
+  Vector cp = p - c;
+  double d5 = ab * cp, d6 = ac * cp;
+  if (d6 >= 0 && d5 <= d6) return c; // Область вершины c
+  double vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + (c - a) * (d2 / (d2 - d6)); // Область ребра ac
+  double va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6))); // Область ребра bc
+  // Точка проецируется внутрь треугольника
+  double denom = 1 / (va + vb + vc);
+  return a + (b - a) * (vb * denom) + (c - a) * (vc * denom);
+}
+
+// Функция для вычисления квадрата расстояния между двумя точками
+double distance2(const Point& p, const Point& q) {
+  Vector d = p - q;
+  return d * d;
+}
+
+// Структура иерархии ограничивающих параллелепипедов (BVH) над треугольниками поверхности тела
+// Каждый четырехугольник сетки разбивается на два треугольника; координаты треугольников копируются при построении,
+// поэтому индекс описывает исходную поверхность и не меняется при перемещении узлов сетки
+// Запросы только читают индекс, поэтому их можно выполнять из нескольких потоков одновременно
+struct SurfaceBvh {
+  // Структура треугольника поверхности
+  struct Tri {
+    Point a, b, c; // Вершины треугольника
+    int quad; // Индекс четырехугольника сетки, из которого получен треугольник
+  };
+  // Структура узла иерархии
+  struct Node {
+    Point lo, hi; // Углы ограничивающего параллелепипеда
+    int left, right; // Потомки внутреннего узла, -1 для листа
+    int first, count; // Диапазон треугольников листа
+  };
+  // Наибольшая глубина иерархии: при обходе в стеке лежит не больше одного узла на уровень плюс корень
+  // Деление пополам по количеству дает глубину log2 числа треугольников независимо от их расположения,
+  // а build_bvh_node дополнительно превращает в лист любой узел на этой глубине
+  static const int max_depth = 64;
+  vector<Tri> tris; // Треугольники, упорядоченные по листьям
+  vector<Node> nodes; // Узлы иерархии, корень имеет индекс 0
+  double tolerance = 0; // Расстояние, на котором точка еще считается лежащей на поверхности
+
+  // Функция для вычисления квадрата расстояния от точки до параллелепипеда узла
+  static double box_distance2(const Point& p, const Node& n) {
+    double dx = max(0.0, max(n.lo.x - p.x, p.x - n.hi.x));
+    double dy = max(0.0, max(n.lo.y - p.y, p.y - n.hi.y));
+    double dz = max(0.0, max(n.lo.z - p.z, p.z - n.hi.z));
+    return dx * dx + dy * dy + dz * dz;
   }
-  // Создаем пустое тело
-  Body body;
-  // Читаем файл построчно
-  string line;
-  while (getline(fin, line)) {
-    // Если строка начинается с символа 'S', то это начало секции спецификации
-    if (line[0] == 'S') {
-      // Пропускаем эту секцию, так как она не содержит информации о геометрии тела
-      continue;
-    }
-    // Если строка начинается с символа 'G', то это начало секции глобальных параметров
-    if (line[0] == 'G') {
-      // Пропускаем эту секцию, так как она не содержит информации о геометрии тела
-      continue;
-    }
-    // Если строка начинается с символа 'D', то это начало секции каталога записей
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Пропускаем эту секцию, так как она не содержит информации о геометрии тела
-      continue;
-    }
-    // Если строка начинается с символа 'D', то это начало секции каталога записей
-    if (line[0] == 'D') {
-      // Пропускаем эту секцию, так как она не содержит информации о геометрии тела
-      continue;
-    }
-    // Если строка начинается с символа 'P', то это начало секции параметров
-    if (line[0] == 'P') {
-      // Читаем тип сущности из первых восьми символов строки
-      string type = line.substr(0, 8);
-      // Если тип сущности равен "128     ", то это B-spline поверхность
-      if (type == "128     ") {
-        // Читаем параметры поверхности из строки
-        int k1, k2; // Степени B-spline базисных функций по двум направлениям
-        int m1, m2; // Количество контрольных точек по двум направлениям
-        int n1, n2; // Количество узловых векторов по двум направлениям
-        int prop1, prop2, prop3, prop4; // Свойства поверхности (замкнутость, периодичность и т.д.)
-        vector<double> u; // Узловой вектор по первому направлению
-        vector<double> v; // Узловой вектор по второму направлению
-        vector<vector<Point>> p; // Контрольные точки поверхности
-        fin >> k1 >> k2 >> m1 >> m2 >> n1 >> n2 >> prop1 >> prop2 >> prop3 >> prop4;
-        u.resize(n1);
-        v.resize(n2);
-        p.resize(m1);
-        for (int i = 0; i < n1; i++) fin >> u[i];
-        for (int i = 0; i < n2; i++) fin >> v[i];
-        for (int i = 0; i < m1; i++) {
-          p[i].resize(m2);
-          for (int j = 0; j < m2; j++) {
-            double x, y, z, w; // Координаты и вес контрольной точки в однородном пространстве
-            fin >> x >> y >> z >> w;
-            p[i][j] = Point(x / w, y / w, z / w); // Переводим в неоднородное пространство
-          }
-        }
-        // Создаем пустую грань для хранения четырехугольников, аппроксимирующих поверхность
-        Face face;
-        // Задаем параметры разбиения поверхности на четырехугольники
-        int n = 10; // Количество четырехугольников по каждому направлению
-////////////////////////////////////////////////////////////////////////////////////////////////////////
-        Face face;
-        // Задаем параметры разбиения поверхности на четырехугольники
-        int n = 10; // Количество четырехугольников по каждому направлению
-        double du = 1.0 / n; // Шаг по первому параметру
-        double dv = 1.0 / n; // Шаг по второму параметру
-        // Перебираем четырехугольники по параметрам
-        for (int i = 0; i < n; i++) {
-          for (int j = 0; j < n; j++) {
-            // Вычисляем четыре вершины четырехугольника на поверхности по формуле B-spline
-            Point p1 = evaluate_b_spline_surface(p, u, v, k1, k2, i * du, j * dv); // Вершина с параметрами (i * du, j * dv)
-            Point p2 = evaluate_b_spline_surface(p, u, v, k1, k2, (i + 1) * du, j * dv); // Вершина с параметрами ((i + 1) * du, j * dv)
-            Point p3 = evaluate_b_spline_surface(p, u, v, k1, k2, (i + 1) * du, (j + 1) * dv); // Вершина с параметрами ((i + 1) * du, (j + 1) * dv)
-            Point p4 = evaluate_b_spline_surface(p, u, v, k1, k2, i * du, (j + 1) * dv); // Вершина с параметрами (i * du, (j + 1) * dv)
-            // Создаем четырехугольник из этих вершин и добавляем его к грани
-            Quad quad(p1, p2, p3, p4);
-            face.points.push_back(p1);
-            face.points.push_back(p2);
-            face.points.push_back(p3);
-            face.points.push_back(p4);
+
+  // Функция для поиска ближайшей точки поверхности среди точек, которые ближе чем sqrt(limit2)
+  // Возвращает квадрат расстояния до нее или limit2, если такой точки нет; quad и closest получают четырехугольник и точку
+  double nearest(const Point& p, double limit2, int* quad = nullptr, Point* closest = nullptr) const {
+    double best = limit2;
+    if (nodes.empty()) return best;
+    int stack[max_depth + 2]; // Глубина иерархии ограничена при построении
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+      const Node& n = nodes[stack[--top]];
+      if (box_distance2(p, n) >= best) continue;
+      if (n.left < 0) {
+        for (int i = n.first; i < n.first + n.count; i++) {
+          Point c = closest_point(p, tris[i].a, tris[i].b, tris[i].c);
+          double d = distance2(p, c);
+          if (d < best) {
+            best = d;
+            if (quad) *quad = tris[i].quad;
+            if (closest) *closest = c;
           }
         }
-        // Добавляем грань к телу
-        body.faces.push_back(face);
+      } else {
+        // Ближайший потомок кладем в стек последним, чтобы обойти его первым и быстрее уменьшить best
+        int l = n.left, r = n.right;
+        if (box_distance2(p, nodes[l]) < box_distance2(p, nodes[r])) swap(l, r);
+        assert(top + 2 <= max_depth + 2);
+        stack[top++] = l;
+        stack[top++] = r;
       }
-      // Если тип сущности не равен "128     ", то это не B-spline поверхность и мы ее игнорируем
-      else {
-        continue;
+    }
+    return best;
+  }
+
+  // Функция для проверки, лежит ли точка на поверхности тела с допуском tolerance
+  bool on_surface(const Point& p) const {
+    double t2 = tolerance * tolerance;
+    return nearest(p, t2) < t2;
+  }
+};
+
+// Функция для построения узла иерархии глубины depth над треугольниками [first, first + count), возвращает индекс узла
+int build_bvh_node(SurfaceBvh& bvh, int first, int count, int depth = 0) {
+  int k = bvh.nodes.size();
+  bvh.nodes.push_back(SurfaceBvh::Node());
+  // Вычисляем параллелепипед треугольников и параллелепипед их центров
+  Point lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+  Point clo = lo, chi = hi;
+  auto grow = [](Point& lo, Point& hi, const Point& p) {
+    lo = Point(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+    hi = Point(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+  };
+  for (int i = first; i < first + count; i++) {
+    const SurfaceBvh::Tri& t = bvh.tris[i];
+    grow(lo, hi, t.a);
+    grow(lo, hi, t.b);
+    grow(lo, hi, t.c);
+    grow(clo, chi, (t.a + t.b + t.c) / 3);
+  }
+  SurfaceBvh::Node n;
+  n.lo = lo;
+  n.hi = hi;
+  n.left = n.right = -1;
+  n.first = first;
+  n.count = count;
+  const int leaf = 4; // Наибольшее количество треугольников в листе
+  if (count > leaf && depth < SurfaceBvh::max_depth) {
+    // Делим треугольники пополам по медиане центров вдоль самой длинной оси
+    Point e = chi - clo;
+    int axis = e.x >= e.y && e.x >= e.z ? 0 : (e.y >= e.z ? 1 : 2);
+    auto center = [axis](const SurfaceBvh::Tri& t) {
+      Point c = t.a + t.b + t.c;
+      return axis == 0 ? c.x : (axis == 1 ? c.y : c.z);
+    };
+    int mid = first + count / 2;
+    nth_element(bvh.tris.begin() + first, bvh.tris.begin() + mid, bvh.tris.begin() + first + count,
+                [&](const SurfaceBvh::Tri& a, const SurfaceBvh::Tri& b) { return center(a) < center(b); });
+    n.left = build_bvh_node(bvh, first, mid - first, depth + 1);
+    n.right = build_bvh_node(bvh, mid, first + count - mid, depth + 1);
+  }
+  bvh.nodes[k] = n;
+  return k;
+}
+
+// Функция для построения иерархии над поверхностью сетки тела
+// Допуск на попадание на поверхность берется относительно размера тела
+SurfaceBvh build_surface_bvh(const Mesh& mesh) {
+  SurfaceBvh bvh;
+  bvh.tris.reserve(2 * mesh.quads.size());
+  for (int i = 0; i < (int)mesh.quads.size(); i++) {
+    const array<int, 4>& q = mesh.quads[i];
+    const Point& p1 = mesh.nodes[q[0]];
+    const Point& p2 = mesh.nodes[q[1]];
+    const Point& p3 = mesh.nodes[q[2]];
+    const Point& p4 = mesh.nodes[q[3]];
+    bvh.tris.push_back({p1, p2, p3, i});
+    bvh.tris.push_back({p1, p3, p4, i});
+  }
+  if (bvh.tris.empty()) return bvh;
+  bvh.nodes.reserve(bvh.tris.size());
+  build_bvh_node(bvh, 0, bvh.tris.size());
+  double size = Vector(bvh.nodes[0].hi - bvh.nodes[0].lo).length(); // Диагональ параллелепипеда тела
+  bvh.tolerance = 1e-6 * max(1.0, size);
+  return bvh;
+}
+
+// Функция для поиска интервала узлового вектора knots, содержащего параметр t, для B-spline степени k с m контрольными точками
+// Возвращает индекс s из диапазона [k, m - 1] такой, что knots[s] <= t < knots[s + 1]; правый конец области относится к последнему интервалу
+int find_span(const pmr::vector<double>& knots, int k, int m, double t) {
+  if (t >= knots[m]) return m - 1;
+  if (t <= knots[k]) return k;
+  // Двоичный поиск вместо линейного перебора узлов
+  int lo = k, hi = m;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (t < knots[mid]) hi = mid;
+    else lo = mid;
+  }
+  return lo;
+}
+
+// Функция для вычисления ненулевых базисных функций N[0..k] степени k на интервале s по рекуррентной формуле Кокса - де Бора
+// Алгоритм A2.2 из книги L. Piegl, W. Tiller "The NURBS Book"; work - рабочий массив размера не меньше 2 * (k + 1)
+void basis_functions(const pmr::vector<double>& knots, int k, int s, double t, double* N, double* work) {
+  double* left = work; // Разности t - knots[s + 1 - j]
+  double* right = work + k + 1; // Разности knots[s + j] - t
+  N[0] = 1;
+  for (int j = 1; j <= k; j++) {
+    left[j] = t - knots[s + 1 - j];
+    right[j] = knots[s + j] - t;
+    double saved = 0;
+    for (int r = 0; r < j; r++) {
+      double d = right[r + 1] + left[j - r];
+      double temp = (d != 0) ? N[r] / d : 0;
+      N[r] = saved + right[r + 1] * temp;
+      saved = left[j - r] * temp;
+    }
+    N[j] = saved;
+  }
+}
+
+// Ядро алгоритма де Бора для интервалов (i, j); q - рабочий массив из (k1 + 1) * (k2 + 1) точек
+// Если степени K1 и K2 заданы как параметры шаблона, размеры циклов известны при компиляции и циклы полностью разворачиваются,
+// при K1 = K2 = -1 используются степени k1 и k2, заданные при вызове; порядок арифметических операций в обоих случаях одинаков
+template <int K1, int K2>
+Point de_boor(const pmr::vector<pmr::vector<Point>>& p,
+              const pmr::vector<double>& u,
+              const pmr::vector<double>& v,
+              int k1,
+              int k2,
+              int i,
+              int j,
+              double u0,
+              double v0,
+              Point* q) {
+  const int d1 = (K1 >= 0) ? K1 : k1; // Степень по первому направлению
+  const int d2 = (K2 >= 0) ? K2 : k2; // Степень по второму направлению
+  // Копируем контрольные точки, влияющие на точку поверхности, в рабочий массив: q[a * (d2 + 1) + b] = p[i - d1 + a][j - d2 + b]
+  for (int a = 0; a <= d1; a++) {
+    for (int b = 0; b <= d2; b++) {
+      q[a * (d2 + 1) + b] = p[i - d1 + a][j - d2 + b];
+    }
+  }
+  // Выполняем алгоритм де Бора по второму параметру для каждой из d1 + 1 строк, результат строки a остается в q[a * (d2 + 1) + d2]
+  for (int a = 0; a <= d1; a++) {
+    Point* row = q + a * (d2 + 1);
+    for (int r = 1; r <= d2; r++) {
+      for (int b = d2; b >= r; b--) {
+        int c = j - d2 + b; // Индекс узла, с которого начинается носитель контрольной точки
+        // Вычисляем коэффициент альфа
+        double d = v[c + d2 - r + 1] - v[c];
+        double alpha = (d != 0) ? (v0 - v[c]) / d : 0;
+        // Обновляем точку в массиве
+        row[b] = row[b - 1] * (1 - alpha) + row[b] * alpha;
       }
     }
-    // Если строка начинается с символа 'T', то это начало секции завершения
-    if (line[0] == 'T') {
-      // Заканчиваем чтение файла
-      break;
+  }
+  // Выполняем алгоритм де Бора по первому параметру для полученных точек строк
+  for (int r = 1; r <= d1; r++) {
+    for (int a = d1; a >= r; a--) {
+      int c = i - d1 + a; // Индекс узла, с которого начинается носитель контрольной точки
+      // Вычисляем коэффициент бета
+      double d = u[c + d1 - r + 1] - u[c];
+      double beta = (d != 0) ? (u0 - u[c]) / d : 0;
+      // Обновляем точку в массиве
+      q[a * (d2 + 1) + d2] = q[(a - 1) * (d2 + 1) + d2] * (1 - beta) + q[a * (d2 + 1) + d2] * beta;
     }
   }
-  // Закрываем файл
-  fin.close();
-  // Возвращаем прочитанное тело
-  return body;
+  // Возвращаем конечную точку в массиве
+  return q[d1 * (d2 + 1) + d2];
 }
 
+// Специализация алгоритма де Бора для степеней K1, K2 с рабочим массивом фиксированного размера на стеке
+template <int K1, int K2>
+Point de_boor_fixed(const pmr::vector<pmr::vector<Point>>& p, const pmr::vector<double>& u, const pmr::vector<double>& v, int i, int j, double u0, double v0) {
+  Point q[(K1 + 1) * (K2 + 1)];
+  return de_boor<K1, K2>(p, u, v, K1, K2, i, j, u0, v0, q);
+}
+
+// Таблица специализаций алгоритма де Бора для степеней от 1 до 3 по каждому направлению
+typedef Point (*DeBoorKernel)(const pmr::vector<pmr::vector<Point>>&, const pmr::vector<double>&, const pmr::vector<double>&, int, int, double, double);
+const DeBoorKernel de_boor_kernels[3][3] = {
+  {de_boor_fixed<1, 1>, de_boor_fixed<1, 2>, de_boor_fixed<1, 3>},
+  {de_boor_fixed<2, 1>, de_boor_fixed<2, 2>, de_boor_fixed<2, 3>},
+  {de_boor_fixed<3, 1>, de_boor_fixed<3, 2>, de_boor_fixed<3, 3>},
+};
+
 // Функция для вычисления точки на B-spline поверхности по заданным параметрам
-Point evaluate_b_spline_surface(const vector<vector<Point>>& p,
-                                const vector<double>& u,
-                                const vector<double>& v,
+Point evaluate_b_spline_surface(const pmr::vector<pmr::vector<Point>>& p,
+                                const pmr::vector<double>& u,
+                                const pmr::vector<double>& v,
                                 int k1,
                                 int k2,
                                 double u0,
@@ -359,426 +1069,5248 @@ Point evaluate_b_spline_surface(const vector<vector<Point>>& p,
   // Алгоритм де Бора: https://en.wikipedia.org/wiki/De_Boor%27s_algorithm
   int m1 = p.size(); // Количество контрольных точек по первому направлению
   int m2 = p[0].size(); // Количество контрольных точек по второму направлению
-  int n1 = u.size(); // Количество узловых векторов по первому направлению
-  int n2 = v.size(); // Количество узловых векторов по второму направлению
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////
-  int m2 = p[0].size(); // Количество контрольных точек по второму направлению
-  int n1 = u.size(); // Количество узловых векторов по первому направлению
-  int n2 = v.size(); // Количество узловых векторов по второму направлению
   // Находим индекс i такой, что u[i] <= u0 < u[i+1]
-  int i = 0;
-  while (i < n1 - 1 && u[i + 1] <= u0) i++;
+  int i = find_span(u, k1, m1, u0);
   // Находим индекс j такой, что v[j] <= v0 < v[j+1]
-  int j = 0;
-  while (j < n2 - 1 && v[j + 1] <= v0) j++;
-  // Создаем вспомогательный массив для хранения промежуточных точек
-  vector<vector<Point>> q(k1 + 1);
-  for (int a = 0; a <= k1; a++) {
-    q[a].resize(k2 + 1);
-    for (int b = 0; b <= k2; b++) {
-      q[a][b] = p[i - k1 + a][j - k2 + b]; // Копируем соответствующие контрольные точки
-    }
-  }
-  // Выполняем k1 + 1 раз алгоритм де Бора по второму параметру
-  for (int a = 1; a <= k1 + 1; a++) {
-    for (int b = k2; b >= a; b--) {
-      for (int c = j - k2 + b; c <= j; c++) {
-        // Вычисляем коэффициент альфа
-        double alpha = (v0 - v[c]) / (v[c + k2 - a + 1] - v[c]);
-        // Обновляем точку в массиве
-        q[a][b] = q[a - 1][b] * (1 - alpha) + q[a - 1][b - 1] * alpha;
-      }
+  int j = find_span(v, k2, m2, v0);
+  // Для распространенных степеней используем специализированное ядро
+  if (k1 >= 1 && k1 <= 3 && k2 >= 1 && k2 <= 3) {
+    return de_boor_kernels[k1 - 1][k2 - 1](p, u, v, i, j, u0, v0);
+  }
+  // Для остальных степеней берем вспомогательный массив для хранения промежуточных точек из арены потока
+  ScratchScope scope;
+  pmr::vector<Point> q((k1 + 1) * (k2 + 1), &scope.arena);
+  return de_boor<-1, -1>(p, u, v, k1, k2, i, j, u0, v0, q.data());
+}
+
+// Ядро тензорных сумм для сетки параметров: su, sv - интервалы, Nu, Nv - базисные функции для каждого значения параметров
+// Как и в алгоритме де Бора, степени K1, K2 задаются параметрами шаблона, а при K1 = K2 = -1 берутся из k1 и k2
+template <int K1, int K2>
+void grid_kernel(const pmr::vector<pmr::vector<Point>>& p,
+                 int k1,
+                 int k2,
+                 const pmr::vector<int>& su,
+                 const pmr::vector<int>& sv,
+                 const pmr::vector<double>& Nu,
+                 const pmr::vector<double>& Nv,
+                 pmr::vector<Point>& row,
+                 pmr::vector<Point>& out) {
+  const int d1 = (K1 >= 0) ? K1 : k1; // Степень по первому направлению
+  const int d2 = (K2 >= 0) ? K2 : k2; // Степень по второму направлению
+  int nu = su.size(); // Количество значений первого параметра
+  int nv = sv.size(); // Количество значений второго параметра
+  for (int i = 0; i < nu; i++) {
+    const double* N = &Nu[i * (d1 + 1)];
+    int a0 = su[i] - d1; // Первая контрольная строка, влияющая на точку
+    // Сворачиваем только те столбцы, которые используются хотя бы одним значением vs
+    int c0 = sv[0] - d2, c1 = sv[nv - 1];
+    for (int c = c0; c <= c1; c++) {
+      Point s;
+      for (int a = 0; a <= d1; a++) s = s + p[a0 + a][c] * N[a];
+      row[c] = s;
+    }
+    for (int j = 0; j < nv; j++) {
+      const double* M = &Nv[j * (d2 + 1)];
+      int b0 = sv[j] - d2; // Первый контрольный столбец, влияющий на точку
+      Point s;
+      for (int b = 0; b <= d2; b++) s = s + row[b0 + b] * M[b];
+      out[i * nv + j] = s;
     }
   }
-  // Выполняем k2 + 1 раз алгоритм де Бора по первому параметру
-  for (int b = 1; b <= k2 + 1; b++) {
-    for (int a = k1; a >= b; a--) {
-      for (int c = i - k1 + a; c <= i; c++) {
-        // Вычисляем коэффициент бета
-        double beta = (u0 - u[c]) / (u[c + k1 - b + 1] - u[c]);
-        // Обновляем точку в массиве
-        q[a][b] = q[a][b - 1] * (1 - beta) + q[a - 1][b - 1] * beta;
+}
+
+// Таблица специализаций ядра тензорных сумм для степеней от 1 до 3 по каждому направлению
+typedef void (*GridKernel)(const pmr::vector<pmr::vector<Point>>&, int, int, const pmr::vector<int>&, const pmr::vector<int>&,
+                           const pmr::vector<double>&, const pmr::vector<double>&, pmr::vector<Point>&, pmr::vector<Point>&);
+const GridKernel grid_kernels[3][3] = {
+  {grid_kernel<1, 1>, grid_kernel<1, 2>, grid_kernel<1, 3>},
+  {grid_kernel<2, 1>, grid_kernel<2, 2>, grid_kernel<2, 3>},
+  {grid_kernel<3, 1>, grid_kernel<3, 2>, grid_kernel<3, 3>},
+};
+
+// Функция для вычисления точек B-spline поверхности на сетке параметров us x vs
+// Базисные функции вычисляются один раз для каждого значения us и vs, а точки - как тензорные суммы без выделения памяти на каждую точку
+// Точка с параметрами (us[i], vs[j]) записывается в out[i * vs.size() + j]
+void evaluate_b_spline_grid(const pmr::vector<pmr::vector<Point>>& p,
+                            const pmr::vector<double>& u,
+                            const pmr::vector<double>& v,
+                            int k1,
+                            int k2,
+                            const pmr::vector<double>& us,
+                            const pmr::vector<double>& vs,
+                            pmr::vector<Point>& out) {
+  int m1 = p.size(); // Количество контрольных точек по первому направлению
+  int m2 = p[0].size(); // Количество контрольных точек по второму направлению
+  int nu = us.size(); // Количество значений первого параметра
+  int nv = vs.size(); // Количество значений второго параметра
+  out.resize(nu * nv);
+  // Интервалы и базисные функции для каждого значения параметров (для соседних значений из одного интервала поиск не повторяется)
+  // Рабочие массивы берутся из арены потока после изменения размера out, чтобы out не вырос внутри области
+  ScratchScope scope;
+  pmr::vector<int> su(nu, &scope.arena), sv(nv, &scope.arena);
+  pmr::vector<double> Nu(nu * (k1 + 1), &scope.arena), Nv(nv * (k2 + 1), &scope.arena);
+  pmr::vector<double> work(2 * (max(k1, k2) + 1), &scope.arena);
+  for (int i = 0; i < nu; i++) {
+    su[i] = (i > 0 && us[i] >= u[su[i - 1]] && us[i] < u[su[i - 1] + 1]) ? su[i - 1] : find_span(u, k1, m1, us[i]);
+    basis_functions(u, k1, su[i], us[i], &Nu[i * (k1 + 1)], work.data());
+  }
+  for (int j = 0; j < nv; j++) {
+    sv[j] = (j > 0 && vs[j] >= v[sv[j - 1]] && vs[j] < v[sv[j - 1] + 1]) ? sv[j - 1] : find_span(v, k2, m2, vs[j]);
+    basis_functions(v, k2, sv[j], vs[j], &Nv[j * (k2 + 1)], work.data());
+  }
+  // Строка контрольной сетки, свернутая с базисными функциями первого параметра
+  pmr::vector<Point> row(m2, &scope.arena);
+  // Для распространенных степеней используем специализированное ядро
+  if (k1 >= 1 && k1 <= 3 && k2 >= 1 && k2 <= 3) {
+    grid_kernels[k1 - 1][k2 - 1](p, k1, k2, su, sv, Nu, Nv, row, out);
+  } else {
+    grid_kernel<-1, -1>(p, k1, k2, su, sv, Nu, Nv, row, out);
+  }
+}
+
+// Функция для вычисления ненулевых базисных функций N[0..k] степени k на интервале s и их первых производных dN[0..k]
+// Производные выражаются через базисные функции степени k - 1 на том же интервале; work - рабочий массив размера не меньше 2 * (k + 1)
+void basis_functions_derivs(const pmr::vector<double>& knots, int k, int s, double t, double* N, double* dN, double* work) {
+  basis_functions(knots, k, s, t, N, work);
+  if (k == 0) {
+    dN[0] = 0;
+    return;
+  }
+  // Базисные функции степени k - 1 с номерами s - k + 1 .. s записываем в dN[1..k], а затем заменяем производными
+  basis_functions(knots, k - 1, s, t, dN + 1, work);
+  double prev = 0; // Слагаемое от функции степени k - 1 с меньшим номером
+  for (int r = 0; r <= k; r++) {
+    int i = s - k + r; // Номер базисной функции степени k
+    double next = 0; // Слагаемое от функции степени k - 1 с номером i + 1
+    if (r < k) {
+      double d = knots[i + k + 1] - knots[i + 1];
+      next = (d != 0) ? dN[r + 1] / d : 0;
+    }
+    dN[r] = k * (prev - next);
+    prev = next;
+  }
+}
+
+// Функция для вычисления точки B-spline поверхности S и ее первых производных Su, Sv при параметрах (u0, v0)
+// work - рабочий массив размера не меньше 6 * (max(k1, k2) + 1)
+void evaluate_b_spline_derivs(const BSplineSurface& s, double u0, double v0, Point& S, Vector& Su, Vector& Sv, double* work) {
+  int m1 = s.p.size(), m2 = s.p[0].size();
+  int k = max(s.k1, s.k2) + 1;
+  double* Nu = work; // Базисные функции и производные по первому направлению
+  double* dNu = work + k;
+  double* Nv = work + 2 * k; // Базисные функции и производные по второму направлению
+  double* dNv = work + 3 * k;
+  int su = find_span(s.u, s.k1, m1, u0);
+  int sv = find_span(s.v, s.k2, m2, v0);
+  basis_functions_derivs(s.u, s.k1, su, u0, Nu, dNu, work + 4 * k);
+  basis_functions_derivs(s.v, s.k2, sv, v0, Nv, dNv, work + 4 * k);
+  S = Point();
+  Su = Sv = Vector();
+  for (int a = 0; a <= s.k1; a++) {
+    for (int b = 0; b <= s.k2; b++) {
+      const Point& c = s.p[su - s.k1 + a][sv - s.k2 + b]; // Контрольная точка
+      double w = Nu[a] * Nv[b], wu = dNu[a] * Nv[b], wv = Nu[a] * dNv[b];
+      S = S + c * w;
+      Su = Su + Vector(c * wu);
+      Sv = Sv + Vector(c * wv);
+    }
+  }
+}
+
+// Функция для проецирования точки p на B-spline поверхность методом Ньютона (в форме Гаусса - Ньютона) с начальным приближением (u, v)
+// Параметры узла после небольшого перемещения меняются мало, поэтому начальное приближение с прошлого положения узла
+// обычно сходится за две-три итерации. Параметры остаются в области определения поверхности
+// Возвращает false, если итерации не сошлись; иначе u, v - параметры ближайшей точки, q - сама точка
+// Точка p передается по значению, поэтому q может быть той же переменной, что и p
+bool project_to_surface(const BSplineSurface& s, Point p, double& u, double& v, Point& q) {
+  int m1 = s.p.size(), m2 = s.p[0].size();
+  double ua = s.u[s.k1], ub = s.u[m1]; // Область определения по первому параметру
+  double va = s.v[s.k2], vb = s.v[m2]; // Область определения по второму параметру
+  ScratchScope scope;
+  pmr::vector<double> work(6 * (max(s.k1, s.k2) + 1), &scope.arena);
+  const int iterations = 20; // Наибольшее количество итераций
+  for (int it = 0; it < iterations; it++) {
+    Vector Su, Sv;
+    evaluate_b_spline_derivs(s, u, v, q, Su, Sv, work.data());
+    Vector r = q - p; // Отклонение точки поверхности от проецируемой точки
+    // Решаем систему J^T J d = -J^T r, где столбцы матрицы Якоби J - производные Su и Sv
+    double a = Su * Su, b = Su * Sv, c = Sv * Sv;
+    double g1 = Su * r, g2 = Sv * r;
+    double det = a * c - b * b;
+    if (!(det > 1e-24 * a * c)) return false; // Вырожденная точка поверхности
+    double du = -(c * g1 - b * g2) / det;
+    double dv = -(a * g2 - b * g1) / det;
+    double un = max(ua, min(ub, u + du)), vn = max(va, min(vb, v + dv));
+    // Сходимость: шаг в пространстве стал пренебрежимо мал по сравнению с размером поверхности около точки
+    double step = abs(un - u) * sqrt(a) + abs(vn - v) * sqrt(c);
+    u = un;
+    v = vn;
+    if (step <= 1e-12 * (1 + Vector(q).length())) {
+      evaluate_b_spline_derivs(s, u, v, q, Su, Sv, work.data());
+      return true;
+    }
+  }
+  return false;
+}
+
+// Структура для хранения B-spline поверхности в виде структуры массивов для пакетного вычисления
+// Координаты контрольной точки (a, b) хранятся в x[a * m2 + b], y[a * m2 + b], z[a * m2 + b]; массивы размещаются в memory
+struct SurfaceSoA {
+  int k1, k2; // Степени B-spline базисных функций по двум направлениям
+  int m1, m2; // Количество контрольных точек по двум направлениям
+  pmr::vector<double> u, v; // Узловые векторы
+  pmr::vector<double> x, y, z; // Координаты контрольных точек
+  SurfaceSoA(const pmr::vector<pmr::vector<Point>>& p, const pmr::vector<double>& u, const pmr::vector<double>& v, int k1, int k2,
+             pmr::memory_resource* memory = pmr::get_default_resource())
+      : k1(k1), k2(k2), m1(p.size()), m2(p[0].size()), u(u, memory), v(v, memory), x(memory), y(memory), z(memory) {
+    x.resize(m1 * m2);
+    y.resize(m1 * m2);
+    z.resize(m1 * m2);
+    for (int a = 0; a < m1; a++) {
+      for (int b = 0; b < m2; b++) {
+        x[a * m2 + b] = p[a][b].x;
+        y[a * m2 + b] = p[a][b].y;
+        z[a * m2 + b] = p[a][b].z;
       }
     }
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Обновляем точку в массиве
-        q[a][b] = q[a][b - 1] * (1 - beta) + q[a - 1][b - 1] * beta;
+  }
+};
+
+// Структура для хранения результатов пакетного вычисления точек поверхности и первых производных (структура массивов)
+struct SurfaceSamples {
+  pmr::vector<double> x, y, z; // Точки поверхности
+  pmr::vector<double> ux, uy, uz; // Производные по первому параметру
+  pmr::vector<double> vx, vy, vz; // Производные по второму параметру
+  SurfaceSamples(pmr::memory_resource* memory = pmr::get_default_resource())
+      : x(memory), y(memory), z(memory), ux(memory), uy(memory), uz(memory), vx(memory), vy(memory), vz(memory) {}
+  void resize(int n) {
+    for (pmr::vector<double>* a : {&x, &y, &z, &ux, &uy, &uz, &vx, &vy, &vz}) a->resize(n);
+  }
+};
+
+// Структура для хранения базисных функций пакета точек: значение для функции a и точки t лежит в Nu[a * count + t]
+struct BatchBasis {
+  int count; // Количество точек в пакете
+  pmr::vector<int> idx; // Индекс первой влияющей контрольной точки (su - k1) * m2 + (sv - k2) для каждой точки
+  pmr::vector<double> Nu, dNu, Nv, dNv; // Базисные функции и их производные по двум направлениям
+  BatchBasis(pmr::memory_resource* memory) : idx(memory), Nu(memory), dNu(memory), Nv(memory), dNv(memory) {}
+};
+
+// Скалярное ядро пакетного вычисления для точек пакета с номерами [t0, t1), результаты записываются начиная с out[offset + t0]
+void batch_kernel_scalar(const SurfaceSoA& s, const BatchBasis& bb, int t0, int t1, SurfaceSamples& out, int offset) {
+  int n = bb.count;
+  for (int t = t0; t < t1; t++) {
+    double px = 0, py = 0, pz = 0, ux = 0, uy = 0, uz = 0, vx = 0, vy = 0, vz = 0;
+    for (int a = 0; a <= s.k1; a++) {
+      for (int b = 0; b <= s.k2; b++) {
+        int c = bb.idx[t] + a * s.m2 + b; // Индекс контрольной точки
+        double w = bb.Nu[a * n + t] * bb.Nv[b * n + t];
+        double wu = bb.dNu[a * n + t] * bb.Nv[b * n + t];
+        double wv = bb.Nu[a * n + t] * bb.dNv[b * n + t];
+        px += w * s.x[c];
+        py += w * s.y[c];
+        pz += w * s.z[c];
+        ux += wu * s.x[c];
+        uy += wu * s.y[c];
+        uz += wu * s.z[c];
+        vx += wv * s.x[c];
+        vy += wv * s.y[c];
+        vz += wv * s.z[c];
       }
     }
+    out.x[offset + t] = px;
+    out.y[offset + t] = py;
+    out.z[offset + t] = pz;
+    out.ux[offset + t] = ux;
+    out.uy[offset + t] = uy;
+    out.uz[offset + t] = uz;
+    out.vx[offset + t] = vx;
+    out.vy[offset + t] = vy;
+    out.vz[offset + t] = vz;
   }
-  // Возвращаем конечную точку в массиве
-  return q[k1][k2];
 }
 
-// Функция для записи тела в файл формата NEU
-void write_neu(const string& filename, const Body& body) {
-  // Открываем файл для записи
-  ofstream fout(filename);
-  if (!fout) {
-    cerr << "Error: cannot open file " << filename << endl;
-    exit(1);
+#if defined(__GNUC__) && defined(__x86_64__)
+// Ядро пакетного вычисления с инструкциями AVX2 и FMA: 4 точки за проход, контрольные точки собираются инструкцией gather
+// (в форме с маской и нулевым исходным значением, чтобы у инструкции не было неопределенного операнда)
+// Возвращает номер первой необработанной точки
+__attribute__((target("avx2,fma"))) int batch_kernel_avx2(const SurfaceSoA& s, const BatchBasis& bb, SurfaceSamples& out, int offset) {
+  int n = bb.count;
+  int t = 0;
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1)); // Маска, выбирающая все элементы
+  for (; t + 4 <= n; t += 4) {
+    __m128i base = _mm_loadu_si128((const __m128i*)&bb.idx[t]);
+    __m256d px = _mm256_setzero_pd(), py = px, pz = px, ux = px, uy = px, uz = px, vx = px, vy = px, vz = px;
+    for (int a = 0; a <= s.k1; a++) {
+      __m256d Nu = _mm256_loadu_pd(&bb.Nu[a * n + t]);
+      __m256d dNu = _mm256_loadu_pd(&bb.dNu[a * n + t]);
+      for (int b = 0; b <= s.k2; b++) {
+        __m256d Nv = _mm256_loadu_pd(&bb.Nv[b * n + t]);
+        __m256d dNv = _mm256_loadu_pd(&bb.dNv[b * n + t]);
+        __m128i c = _mm_add_epi32(base, _mm_set1_epi32(a * s.m2 + b));
+        __m256d cx = _mm256_mask_i32gather_pd(zero, s.x.data(), c, all, 8);
+        __m256d cy = _mm256_mask_i32gather_pd(zero, s.y.data(), c, all, 8);
+        __m256d cz = _mm256_mask_i32gather_pd(zero, s.z.data(), c, all, 8);
+        __m256d w = _mm256_mul_pd(Nu, Nv);
+        __m256d wu = _mm256_mul_pd(dNu, Nv);
+        __m256d wv = _mm256_mul_pd(Nu, dNv);
+        px = _mm256_fmadd_pd(w, cx, px);
+        py = _mm256_fmadd_pd(w, cy, py);
+        pz = _mm256_fmadd_pd(w, cz, pz);
+        ux = _mm256_fmadd_pd(wu, cx, ux);
+        uy = _mm256_fmadd_pd(wu, cy, uy);
+        uz = _mm256_fmadd_pd(wu, cz, uz);
+        vx = _mm256_fmadd_pd(wv, cx, vx);
+        vy = _mm256_fmadd_pd(wv, cy, vy);
+        vz = _mm256_fmadd_pd(wv, cz, vz);
+      }
+    }
+    _mm256_storeu_pd(&out.x[offset + t], px);
+    _mm256_storeu_pd(&out.y[offset + t], py);
+    _mm256_storeu_pd(&out.z[offset + t], pz);
+    _mm256_storeu_pd(&out.ux[offset + t], ux);
+    _mm256_storeu_pd(&out.uy[offset + t], uy);
+    _mm256_storeu_pd(&out.uz[offset + t], uz);
+    _mm256_storeu_pd(&out.vx[offset + t], vx);
+    _mm256_storeu_pd(&out.vy[offset + t], vy);
+    _mm256_storeu_pd(&out.vz[offset + t], vz);
   }
-  // Записываем заголовок файла
-  fout << "        CONTROL INFO\n";
-  fout << "** GAMBIT NEUTRAL FILE\n";
-  fout << "PROGRAM:                Bing\n";
-  fout << "VERSION:                1.0\n";
-  fout << "Written by Bing on " << __DATE__ << " at " << __TIME__ << "\n";
-  fout << "     NUMNP     NELEM     NGRPS    NBSETS     NDFCD     NDFVL\n";
-  // Подсчитываем количество узлов и элементов в теле
-  int numnp = 0; // Количество узлов
-  int nelem = 0; // Количество элементов
-  for (const Face& face : body.faces) {
-    numnp += face.points.size(); // Каждая вершина грани - узел
-    nelem += face.points.size() / 4; // Каждые четыре вершины грани - четырехугольный элемент
+  return t;
+}
+
+// Ядро пакетного вычисления с инструкциями AVX-512: 8 точек за проход
+// Возвращает номер первой необработанной точки
+__attribute__((target("avx512f"))) int batch_kernel_avx512(const SurfaceSoA& s, const BatchBasis& bb, SurfaceSamples& out, int offset) {
+  int n = bb.count;
+  int t = 0;
+  const __m512d zero = _mm512_setzero_pd();
+  for (; t + 8 <= n; t += 8) {
+    __m256i base = _mm256_loadu_si256((const __m256i*)&bb.idx[t]);
+    __m512d px = _mm512_setzero_pd(), py = px, pz = px, ux = px, uy = px, uz = px, vx = px, vy = px, vz = px;
+    for (int a = 0; a <= s.k1; a++) {
+      __m512d Nu = _mm512_loadu_pd(&bb.Nu[a * n + t]);
+      __m512d dNu = _mm512_loadu_pd(&bb.dNu[a * n + t]);
+      for (int b = 0; b <= s.k2; b++) {
+        __m512d Nv = _mm512_loadu_pd(&bb.Nv[b * n + t]);
+        __m512d dNv = _mm512_loadu_pd(&bb.dNv[b * n + t]);
+        __m256i c = _mm256_add_epi32(base, _mm256_set1_epi32(a * s.m2 + b));
+        __m512d cx = _mm512_mask_i32gather_pd(zero, 0xff, c, s.x.data(), 8);
+        __m512d cy = _mm512_mask_i32gather_pd(zero, 0xff, c, s.y.data(), 8);
+        __m512d cz = _mm512_mask_i32gather_pd(zero, 0xff, c, s.z.data(), 8);
+        __m512d w = _mm512_mul_pd(Nu, Nv);
+        __m512d wu = _mm512_mul_pd(dNu, Nv);
+        __m512d wv = _mm512_mul_pd(Nu, dNv);
+        px = _mm512_fmadd_pd(w, cx, px);
+        py = _mm512_fmadd_pd(w, cy, py);
+        pz = _mm512_fmadd_pd(w, cz, pz);
+        ux = _mm512_fmadd_pd(wu, cx, ux);
+        uy = _mm512_fmadd_pd(wu, cy, uy);
+        uz = _mm512_fmadd_pd(wu, cz, uz);
+        vx = _mm512_fmadd_pd(wv, cx, vx);
+        vy = _mm512_fmadd_pd(wv, cy, vy);
+        vz = _mm512_fmadd_pd(wv, cz, vz);
+      }
+    }
+    _mm512_storeu_pd(&out.x[offset + t], px);
+    _mm512_storeu_pd(&out.y[offset + t], py);
+    _mm512_storeu_pd(&out.z[offset + t], pz);
+    _mm512_storeu_pd(&out.ux[offset + t], ux);
+    _mm512_storeu_pd(&out.uy[offset + t], uy);
+    _mm512_storeu_pd(&out.uz[offset + t], uz);
+    _mm512_storeu_pd(&out.vx[offset + t], vx);
+    _mm512_storeu_pd(&out.vy[offset + t], vy);
+    _mm512_storeu_pd(&out.vz[offset + t], vz);
   }
-  // Записываем количество узлов и элементов в файл
-  fout << setw(10) << numnp << setw(10) << nelem << setw(10) << "1" << setw(10) << "0" << setw(10) << "3" << setw(10) << "3\n";
-  fout << "ENDOFSECTION\n";
-  // Записываем секцию узлов в файл
-  fout << "   NODAL COORDINATES\n";
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Записываем количество узлов и элементов в файл
-  fout << setw(10) << numnp << setw(10) << nelem << setw(10) << "1" << setw(10) << "0" << setw(10) << "3" << setw(10) << "3\n";
-  fout << "ENDOFSECTION\n";
-  // Записываем секцию узлов в файл
-  fout << "   NODAL COORDINATES\n";
-  // Перебираем все грани тела
-  int node = 1; // Номер текущего узла
-  for (const Face& face : body.faces) {
-    // Перебираем все вершины грани
-    for (const Point& point : face.points) {
-      // Записываем номер и координаты узла в файл
-      fout << setw(10) << node << setw(20) << point.x << setw(20) << point.y << setw(20) << point.z << "\n";
-      node++; // Увеличиваем номер узла
+  return t;
+}
+#endif
+
+// Набор инструкций, используемый пакетным вычислителем: 0 - скалярный код, 2 - AVX2, 3 - AVX-512
+int batch_isa() {
+#if defined(__GNUC__) && defined(__x86_64__)
+  static int isa = __builtin_cpu_supports("avx512f") ? 3 : (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) ? 2 : 0;
+  return isa;
+#else
+  return 0;
+#endif
+}
+
+// Функция для пакетного вычисления точек B-spline поверхности и первых производных для count пар параметров (us[t], vs[t])
+// Параметры обрабатываются пакетами: интервалы и базисные функции вычисляются скалярно, а тензорные суммы - векторным ядром
+// Массивы out получают размер count; если они размещены в арене потока, размер нужно задать заранее
+void evaluate_b_spline_batch(const SurfaceSoA& s, const double* us, const double* vs, int count, SurfaceSamples& out) {
+  const int chunk = 256; // Количество точек в пакете
+  out.resize(count);
+  ScratchScope scope;
+  BatchBasis bb(&scope.arena);
+  bb.idx.resize(chunk);
+  bb.Nu.resize(chunk * (s.k1 + 1));
+  bb.dNu.resize(chunk * (s.k1 + 1));
+  bb.Nv.resize(chunk * (s.k2 + 1));
+  bb.dNv.resize(chunk * (s.k2 + 1));
+  pmr::vector<double> work(2 * (max(s.k1, s.k2) + 1), &scope.arena);
+  // Базисные функции одной точки и их производные по двум направлениям
+  pmr::vector<double> Nu(s.k1 + 1, &scope.arena), dNu(s.k1 + 1, &scope.arena), Nv(s.k2 + 1, &scope.arena), dNv(s.k2 + 1, &scope.arena);
+  int isa = batch_isa();
+  for (int offset = 0; offset < count; offset += chunk) {
+    int n = min(chunk, count - offset);
+    bb.count = n;
+    // Скалярный этап: интервалы и базисные функции с производными для каждой точки пакета
+    for (int t = 0; t < n; t++) {
+      int su = find_span(s.u, s.k1, s.m1, us[offset + t]);
+      int sv = find_span(s.v, s.k2, s.m2, vs[offset + t]);
+      basis_functions_derivs(s.u, s.k1, su, us[offset + t], Nu.data(), dNu.data(), work.data());
+      basis_functions_derivs(s.v, s.k2, sv, vs[offset + t], Nv.data(), dNv.data(), work.data());
+      bb.idx[t] = (su - s.k1) * s.m2 + (sv - s.k2);
+      for (int a = 0; a <= s.k1; a++) {
+        bb.Nu[a * n + t] = Nu[a];
+        bb.dNu[a * n + t] = dNu[a];
+      }
+      for (int b = 0; b <= s.k2; b++) {
+        bb.Nv[b * n + t] = Nv[b];
+        bb.dNv[b * n + t] = dNv[b];
+      }
     }
+    // Векторный этап: тензорные суммы, остаток пакета обрабатывается скалярным ядром
+    int done = 0;
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (isa == 3) done = batch_kernel_avx512(s, bb, out, offset);
+    else if (isa == 2) done = batch_kernel_avx2(s, bb, out, offset);
+#endif
+    batch_kernel_scalar(s, bb, done, n, out, offset);
   }
-  fout << "ENDOFSECTION\n";
-  // Записываем секцию элементов в файл
-  fout << "      ELEMENTS/CELLS\n";
-  // Перебираем все грани тела
-  int elem = 1; // Номер текущего элемента
-  node = 1; // Номер текущего узла
-  for (const Face& face : body.faces) {
-    // Перебираем все четырехугольники грани
-    for (int i = 0; i < face.points.size(); i += 4) {
-      // Записываем номер и тип элемента в файл
-      fout << setw(10) << elem << setw(10) << "3" << "\n";
-      // Записываем номера узлов элемента в файл
-      fout << setw(10) << node + i << setw(10) << node + i + 1 << setw(10) << node + i + 2 << setw(10) << node + i + 3;
-      fout <<
-////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Записываем номера узлов элемента в файл
-      fout << setw(10) << node + i << setw(10) << node + i + 1 << setw(10) << node + i + 2 << setw(10) << node + i + 3;
-      fout << "\n";
-      elem++; // Увеличиваем номер элемента
-    }
-    node += face.points.size(); // Увеличиваем номер узла на количество вершин грани
-  }
-  fout << "ENDOFSECTION\n";
-  // Закрываем файл
-  fout.close();
 }
 
-// Функция для генерации неструктурированной поверхностной прямоугольной сетки при помощи алгоритма Q-Morph для трехмерного тела
-void generate_mesh(const Body& body) {
-  // Алгоритм Q-Morph: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
-  // Шаг 1: Создаем начальную сетку из четырехугольников, аппроксимирующих поверхность тела
-  // Этот шаг уже выполнен при чтении тела из файла формата IGES
-  // Шаг 2: Определяем качество каждого четырехугольника в сетке по метрике углов
-  // Метрика углов: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
-  vector<double> quality; // Вектор для хранения качества каждого четырехугольника в сетке
-  for (const Face& face : body.faces) {
-    for (int i = 0; i < face.points.size(); i += 4) {
-      // Берем четыре вершины четырехугольника
-      Point p1 = face.points[i];
-      Point p2 = face.points[i + 1];
-      Point p3 = face.points[i + 2];
-      Point p4 = face.points[i + 3];
-      // Берем четыре ребра четырехугольника
-      Edge e1(p1, p2);
-      Edge e2(p2, p3);
-      Edge e3(p3, p4);
-      Edge e4(p4, p1);
-      // Вычисляем четыре угла четырехугольника в радианах
-      double a1 = angle(e1, e4);
-      double a2 = angle(e2, e1);
-      double a3 = angle(e3, e2);
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Вычисляем четыре угла четырехугольника в радианах
-      double a1 = angle(e1, e4);
-      double a2 = angle(e2, e1);
-      double a3 = angle(e3, e2);
-      double a4 = angle(e4, e3);
-      // Вычисляем качество четырехугольника по метрике углов
-      double q = min(a1, min(a2, min(a3, a4))) / max(a1, max(a2, max(a3, a4)));
-      // Добавляем качество четырехугольника в вектор
-      quality.push_back(q);
-    }
-  }
-  // Шаг 3: Создаем очередь приоритетов для хранения четырехугольников в сетке по убыванию их качества
-  priority_queue<pair<double, int>> pq; // Очередь приоритетов из пар (качество, индекс)
-  for (int i = 0; i < quality.size(); i++) {
-    pq.push({quality[i], i}); // Добавляем пару (качество, индекс) в очередь
+// Структура для задания размеров элементов при разбиении поверхностей
+// Если не задана ни длина ребра, ни допуск на отклонение хорды, каждая поверхность разбивается равномерно на divisions x divisions
+// четырехугольников; иначе количество и расположение узлов по каждому направлению выбираются по длине и кривизне поверхности
+struct SizeField {
+  double edge_length = 0; // Целевая длина ребра, 0 - не ограничивается
+  double chordal_tolerance = 0; // Наибольшее отклонение ребра от поверхности, 0 - не ограничивается
+  unordered_map<int, double> local_edge_length; // Целевая длина ребра для отдельных поверхностей по указателю DE их записи
+  int divisions = 10; // Количество четырехугольников по каждому направлению при равномерном разбиении
+  int max_divisions = 1000; // Наибольшее количество четырехугольников по одному направлению
+  double shared_tolerance = 1e-6; // Допуск совпадения общих сторон соседних поверхностей в долях размера тела, 0 - стороны не объединяются
+};
+
+// Функция для выбора значений параметра dir (0 - u, 1 - v) узлов сетки поверхности по целевой длине ребра length
+// и допуску tolerance на отклонение хорды (нулевые значения не ограничивают размер)
+// Поверхность просматривается вдоль нескольких линий другого параметра с шагом в часть интервала узлового вектора; на каждом шаге
+// по длине хорды ds и углу поворота касательной da оценивается нужное количество ребер: ds / length по длине и
+// sqrt(ds * da / (8 * tolerance)) по отклонению (прогиб хорды длины c на окружности радиуса R равен c * c / (8 * R))
+// Берется наибольшая оценка по линиям, и узлы расставляются так, чтобы на каждое ребро приходилась равная доля суммы
+// Изломы поверхности (узлы кратности не меньше степени) всегда становятся узлами сетки, а участки между ними размечаются отдельно
+// Точки и касательные всех линий участка вычисляются одним пакетом по поверхности soa (см. evaluate_b_spline_batch)
+// Результат записывается в params; рабочие массивы берутся из арены потока, поэтому params должен размещаться вне ее
+void surface_parameters(const BSplineSurface& s, const SurfaceSoA& soa, int dir, double length, double tolerance, int max_divisions,
+                        pmr::vector<double>& params) {
+  const pmr::vector<double>& t = dir == 0 ? s.u : s.v; // Узловой вектор вдоль выбранного направления
+  const pmr::vector<double>& w = dir == 0 ? s.v : s.u; // Узловой вектор другого направления
+  int k = dir == 0 ? s.k1 : s.k2, kw = dir == 0 ? s.k2 : s.k1; // Степени
+  int m = dir == 0 ? s.p.size() : s.p[0].size(), mw = dir == 0 ? s.p[0].size() : s.p.size(); // Количество контрольных точек
+  const int samples = 8; // Количество шагов на интервал узлового вектора
+  ScratchScope scope;
+  pmr::memory_resource* scratch = &scope.arena;
+  // Линии другого параметра: начала и середины ненулевых интервалов и конец области
+  pmr::vector<double> ws(scratch);
+  for (int i = kw; i < mw; i++) {
+    if (w[i + 1] <= w[i]) continue;
+    ws.push_back(w[i]);
+    ws.push_back((w[i] + w[i + 1]) / 2);
   }
-  // Шаг 4: Пока очередь не пуста и качество наиболее низкого четырехугольника меньше заданного порога, выполняем следующее:
-  double threshold = 0.8; // Порог для качества четырехугольников
-  while (!pq.empty() && pq.top().first < threshold) {
-    // Извлекаем наиболее низкое качество и соответствующий индекс из очереди
-    double q = pq.top().first;
-    int i = pq.top().second;
-    pq.pop();
-    // Находим грань и четырехугольник в теле по индексу
-    int f = i / (body.faces[0].points.size() / 4); // Индекс грани
-    int j = i % (body.faces[0].points.size() / 4); // Индекс четырехугольника в грани
-    Face& face = body.faces[f]; // Ссылка на грань
-    Point& p1 = face.points[j * 4]; // Ссылка на первую вершину четырехугольника
-    Point& p2 = face.points[j * 4 + 1]; // Ссылка на вторую вершину четырехугольника
-    Point& p3 = face.points[j * 4 + 2]; // Ссылка на третью вершину четырехугольника
-    Point& p4 = face.points[j * 4 + 3]; // Ссылка на четвертую вершину четырехугольника
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    Point& p1 = face.points[j * 4]; // Ссылка на первую вершину четырехугольника
-    Point& p2 = face.points[j * 4 + 1]; // Ссылка на вторую вершину четырехугольника
-    Point& p3 = face.points[j * 4 + 2]; // Ссылка на третью вершину четырехугольника
-    Point& p4 = face.points[j * 4 + 3]; // Ссылка на четвертую вершину четырехугольника
-    // Шаг 4.1: Проверяем, является ли четырехугольник выпуклым или вогнутым
-    // Для этого вычисляем знаки скалярных произведений нормалей к смежным ребрам четырехугольника
-    Vector n1 = (p2 - p1) ^ face.pl; // Нормаль к ребру p1 p2
-    Vector n2 = (p3 - p2) ^ face.pl; // Нормаль к ребру p2 p3
-    Vector n3 = (p4 - p3) ^ face.pl; // Нормаль к ребру p3 p4
-    Vector n4 = (p1 - p4) ^ face.pl; // Нормаль к ребру p4 p1
-    double s1 = n1 * n2; // Скалярное произведение нормалей к ребрам p1 p2 и p2 p3
-    double s2 = n2 * n3; // Скалярное произведение нормалей к ребрам p2 p3 и p3 p4
-    double s3 = n3 * n4; // Скалярное произведение нормалей к ребрам p3 p4 и p4 p1
-    double s4 = n4 * n1; // Скалярное произведение нормалей к ребрам p4 p1 и p1 p2
-    bool convex = (s1 >= 0 && s2 >= 0 && s3 >= 0 && s4 >= 0); // Четырехугольник выпуклый, если все скалярные произведения неотрицательны
-    bool concave = (s1 <= 0 && s2 <= 0 && s3 <= 0 && s4 <= 0); // Четырехугольник вогнутый, если все скалярные произведения неположительны
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    bool convex = (s1 >= 0 && s2 >= 0 && s3 >= 0 && s4 >= 0); // Четырехугольник выпуклый, если все скалярные произведения неотрицательны
-    bool concave = (s1 <= 0 && s2 <= 0 && s3 <= 0 && s4 <= 0); // Четырехугольник вогнутый, если все скалярные произведения неположительны
-    // Шаг 4.2: Если четырехугольник выпуклый, то применяем к нему операцию сглаживания
-    if (convex) {
-      // Операция сглаживания: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
-      // Вычисляем центр масс четырехугольника
-      Point c = (p1 + p2 + p3 + p4) / 4;
-      // Вычисляем новые координаты вершин четырехугольника по формуле сглаживания
-      Point p1_new = c + (p1 - c) * 0.5;
-      Point p2_new = c + (p2 - c) * 0.5;
-      Point p3_new = c + (p3 - c) * 0.5;
-      Point p4_new = c + (p4 - c) * 0.5;
-      // Проверяем, что новые вершины лежат внутри или на границе тела
-      bool valid = true; // Флаг валидности новых вершин
-      for (const Face& f : body.faces) {
-        if (!inside(p1_new, f)) valid = false; // Если вершина не лежит внутри или на границе грани, то флаг становится ложным
-        if (!inside(p2_new, f)) valid = false; // Аналогично для остальных вершин
-        if (!inside(p3_new, f)) valid = false;
-        if (!inside(p4_new, f)) valid = false;
-      }
-      // Если флаг валидности истинный, то обновляем координаты вершин четырехугольника
-      if (valid) {
-        p1 = p1_new;
-        p2 = p2_new;
-        p3 = p3_new;
-        p4 = p4_new;
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Если флаг валидности истинный, то обновляем координаты вершин четырехугольника
-      if (valid) {
-        p1 = p1_new;
-        p2 = p2_new;
-        p3 = p3_new;
-        p4 = p4_new;
-        // Вычисляем новое качество четырехугольника по метрике углов
-        double q_new = min(a1, min(a2, min(a3, a4))) / max(a1, max(a2, max(a3, a4)));
-        // Если новое качество больше старого, то добавляем четырехугольник в очередь приоритетов с новым качеством
-        if (q_new > q) {
-          pq.push({q_new, i});
+  ws.push_back(w[mw]);
+  // Границы участков: концы области и изломы внутри нее
+  pmr::vector<double> breaks(1, t[k], scratch);
+  for (int i = k + 1; i < m;) {
+    int j = i;
+    while (j < m && t[j] == t[i]) j++;
+    if (j - i >= max(k, 1) && t[i] > t[k] && t[i] < t[m]) breaks.push_back(t[i]);
+    i = j;
+  }
+  breaks.push_back(t[m]);
+  params.assign(1, t[k]);
+  pmr::vector<double> ps(scratch), qs(scratch); // Параметры точек пакета по первому и второму направлениям
+  SurfaceSamples points(scratch);
+  for (int b = 0; b + 1 < (int)breaks.size(); b++) {
+    double t0 = breaks[b], t1 = breaks[b + 1]; // Участок без изломов
+    // Параметры шагов вдоль участка
+    pmr::vector<double> ts(scratch);
+    for (int i = k; i < m; i++) {
+      if (t[i + 1] <= t[i] || t[i] < t0 || t[i + 1] > t1) continue;
+      for (int j = 0; j < samples; j++) ts.push_back(t[i] + (t[i + 1] - t[i]) * j / samples);
+    }
+    ts.push_back(t1);
+    // Точки и производные вдоль всех линий: точка i линии l имеет номер l * ts.size() + i
+    int nt = ts.size();
+    ps.resize(ws.size() * nt);
+    qs.resize(ws.size() * nt);
+    for (int l = 0; l < (int)ws.size(); l++) {
+      for (int i = 0; i < nt; i++) {
+        // Касательную в конце участка берем слева от него, чтобы не захватить излом
+        double t2 = i + 1 < nt ? ts[i] : t1 - 1e-9 * (t1 - t0);
+        ps[l * nt + i] = dir == 0 ? t2 : ws[l];
+        qs[l * nt + i] = dir == 0 ? ws[l] : t2;
+      }
+    }
+    points.resize(ps.size());
+    evaluate_b_spline_batch(soa, ps.data(), qs.data(), ps.size(), points);
+    // Производные вдоль выбранного направления
+    const pmr::vector<double>& dx = dir == 0 ? points.ux : points.vx;
+    const pmr::vector<double>& dy = dir == 0 ? points.uy : points.vy;
+    const pmr::vector<double>& dz = dir == 0 ? points.uz : points.vz;
+    // Оценка количества ребер на каждом шаге - наибольшая по всем линиям
+    pmr::vector<double> need(nt - 1, 0, scratch);
+    for (int l = 0; l < (int)ws.size(); l++) {
+      Point prev;
+      Vector prev_d;
+      for (int i = 0; i < nt; i++) {
+        int j = l * nt + i;
+        Point S(points.x[j], points.y[j], points.z[j]);
+        Vector Su(dx[j], dy[j], dz[j]);
+        Su.normalize();
+        if (i > 0) {
+          double ds = Vector(S - prev).length(); // Длина хорды шага
+          double da = acos(max(-1.0, min(1.0, Su * prev_d))); // Угол поворота касательной на шаге
+          double e = 0;
+          if (length > 0) e = max(e, ds / length);
+          if (tolerance > 0) e = max(e, sqrt(ds * da / (8 * tolerance)));
+          need[i - 1] = max(need[i - 1], e);
         }
+        prev = S;
+        prev_d = Su;
       }
     }
-    // Шаг 4.3: Если четырехугольник вогнутый, то применяем к нему операцию перестройки
-    if (concave) {
-      // Операция перестройки: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
-      // Находим индекс наименьшего угла четырехугольника
-      int k = 0; // Индекс наименьшего угла
-      double a_min = a1; // Значение наименьшего угла
-      if (a2 < a_min) {
-        k = 1;
-        a_min = a2;
-      }
-      if (a3 < a_min) {
-        k = 2;
-        a_min = a3;
-      }
-      if (a4 < a_min) {
-        k = 3;
-        a_min = a4;
-      }
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-      double a_min = a1; // Значение наименьшего угла
-      if (a2 < a_min) {
-        k = 1;
-        a_min = a2;
-      }
-      if (a3 < a_min) {
-        k = 2;
-        a_min = a3;
-      }
-      if (a4 < a_min) {
-        k = 3;
-        a_min = a4;
-      }
-      // Находим соседний четырехугольник, разделяющий ребро с наименьшим углом
-      int l = -1; // Индекс соседнего четырехугольника
-      for (int m = 0; m < face.points.size(); m += 4) {
-        if (m != j) { // Пропускаем сам четырехугольник
-          // Берем четыре вершины соседнего четырехугольника
-          Point q1 = face.points[m];
-          Point q2 = face.points[m + 1];
-          Point q3 = face.points[m + 2];
-          Point q4 = face.points[m + 3];
-          // Проверяем, есть ли общее ребро с исходным четырехугольником
-          if ((p1 == q1 && p2 == q4) || (p1 == q4 && p2 == q1)) {
-            l = m; // Запоминаем индекс соседнего четырехугольника
-            break; // Выходим из цикла
-          }
-          if ((p2 == q1 && p3 == q4) || (p2 == q4 && p3 == q1)) {
-            l = m;
-            break;
-          }
-          if ((p3 == q1 && p4 == q4) || (p3 == q4 && p4 == q1)) {
-            l = m;
-            break;
+    // Количество ребер на участке и расстановка узлов по накопленной оценке
+    pmr::vector<double> total(ts.size(), 0, scratch);
+    for (int i = 0; i + 1 < (int)ts.size(); i++) total[i + 1] = total[i] + need[i];
+    int n = max(1, min(max_divisions, (int)ceil(total.back() - 1e-9)));
+    int i = 0;
+    for (int j = 1; j < n; j++) {
+      double target = total.back() * j / n;
+      while (total[i + 1] < target) i++;
+      double d = total[i + 1] - total[i];
+      params.push_back(ts[i] + (d > 0 ? (ts[i + 1] - ts[i]) * (target - total[i]) / d : 0));
+    }
+    params.push_back(t1);
+  }
+}
+
+// Функция для выбора параметров узлов сетки поверхности по полю размеров, de - указатель DE записи поверхности
+void surface_parameters(const BSplineSurface& s, const SizeField& size, int de, pmr::vector<double>& us, pmr::vector<double>& vs) {
+  double length = size.edge_length;
+  auto it = size.local_edge_length.find(de);
+  if (it != size.local_edge_length.end()) length = it->second;
+  if (length > 0 || size.chordal_tolerance > 0) {
+    ScratchScope scope;
+    SurfaceSoA soa(s.p, s.u, s.v, s.k1, s.k2, &scope.arena);
+    surface_parameters(s, soa, 0, length, size.chordal_tolerance, size.max_divisions, us);
+    surface_parameters(s, soa, 1, length, size.chordal_tolerance, size.max_divisions, vs);
+    return;
+  }
+  // Параметры узлов сетки равномерно покрывают область определения поверхности [u[k1], u[m1]] x [v[k2], v[m2]]
+  int n = max(1, size.divisions);
+  int m1 = s.p.size(), m2 = s.p[0].size();
+  us.resize(n + 1);
+  vs.resize(n + 1);
+  for (int i = 0; i <= n; i++) {
+    us[i] = s.u[s.k1] + (s.u[m1] - s.u[s.k1]) * i / n;
+    vs[i] = s.v[s.k2] + (s.v[m2] - s.v[s.k2]) * i / n;
+  }
+}
+
+// Функция для разбиения B-spline поверхности на четырехугольники по сетке параметров us x vs и добавления их в тело в виде новой грани
+// Поверхность сохраняется в теле, а каждый узел грани запоминает свои параметры для последующего проецирования на поверхность
+void tessellate_b_spline_surface(Body& body, const BSplineSurface& s, const pmr::vector<double>& us, const pmr::vector<double>& vs) {
+  Mesh& mesh = body.mesh;
+  int f = body.faces.size(); // Индекс новой грани
+  int base = mesh.nodes.size(); // Индекс первого узла грани
+  int first = mesh.quads.size(); // Индекс первого четырехугольника грани
+  int nu = us.size() - 1; // Количество четырехугольников по первому направлению
+  int nv = vs.size() - 1; // Количество четырехугольников по второму направлению
+  // Вычисляем узлы сетки один раз: узел (i, j) имеет параметры (us[i], vs[j]) и индекс base + i * (nv + 1) + j
+  ScratchScope scope;
+  pmr::vector<Point> grid(&scope.arena);
+  evaluate_b_spline_grid(s.p, s.u, s.v, s.k1, s.k2, us, vs, grid);
+  mesh.nodes.insert(mesh.nodes.end(), grid.begin(), grid.end());
+  mesh.uv.resize(base, {NAN, NAN});
+  for (int i = 0; i <= nu; i++) {
+    for (int j = 0; j <= nv; j++) mesh.uv.push_back({us[i], vs[j]});
+  }
+  // Перебираем четырехугольники по параметрам
+  for (int i = 0; i < nu; i++) {
+    for (int j = 0; j < nv; j++) {
+      int n1 = base + i * (nv + 1) + j; // Вершина с параметрами (us[i], vs[j])
+      int n2 = base + (i + 1) * (nv + 1) + j; // Вершина с параметрами (us[i + 1], vs[j])
+      int n3 = base + (i + 1) * (nv + 1) + j + 1; // Вершина с параметрами (us[i + 1], vs[j + 1])
+      int n4 = base + i * (nv + 1) + j + 1; // Вершина с параметрами (us[i], vs[j + 1])
+      add_quad(mesh, n1, n2, n3, n4, f);
+    }
+  }
+  // Собираем контур грани в порядке обхода против часовой стрелки в плоскости параметров
+  vector<int> contour;
+  contour.reserve(2 * (nu + nv));
+  for (int i = 0; i < nu; i++) contour.push_back(base + i * (nv + 1)); // Сторона v = 0
+  for (int j = 0; j < nv; j++) contour.push_back(base + nu * (nv + 1) + j); // Сторона u = 1
+  for (int i = nu; i > 0; i--) contour.push_back(base + i * (nv + 1) + nv); // Сторона v = 1
+  for (int j = nv; j > 0; j--) contour.push_back(base + j); // Сторона u = 0
+  // Параметры узлов контура запоминаются в грани: узлы общих сторон соседних граней объединяются (см. merge_shared_sides)
+  vector<array<double, 2>> contour_uv;
+  contour_uv.reserve(contour.size());
+  for (int n : contour) contour_uv.push_back(mesh.uv[n]);
+  // Добавляем грань к телу вместе с ее поверхностью
+  body.faces.push_back(Face(mesh.nodes, move(contour), first, nu * nv));
+  body.faces.back().surface = body.surfaces.size();
+  body.faces.back().contour_uv = move(contour_uv);
+  body.surfaces.push_back(s);
+}
+
+// Стороны сетки поверхности 0..3 идут по контуру грани против часовой стрелки в плоскости параметров:
+// v = v0 (u растет), u = u1 (v растет), v = v1 (u убывает), u = u0 (v убывает); вдоль сторон 0 и 2 меняется u, вдоль 1 и 3 - v
+
+// Функция для вычисления параметров точки стороны side поверхности s, в которой меняющийся вдоль стороны параметр равен t
+void side_parameters(const BSplineSurface& s, int side, double t, double& u, double& v) {
+  int m1 = s.p.size(), m2 = s.p[0].size();
+  u = side == 1 ? s.u[m1] : (side == 3 ? s.u[s.k1] : t);
+  v = side == 0 ? s.v[s.k2] : (side == 2 ? s.v[m2] : t);
+}
+
+// Функция для вычисления области [t0, t1] параметра, меняющегося вдоль стороны side поверхности s
+void side_range(const BSplineSurface& s, int side, double& t0, double& t1) {
+  if (side % 2 == 0) {
+    t0 = s.u[s.k1];
+    t1 = s.u[s.p.size()];
+  } else {
+    t0 = s.v[s.k2];
+    t1 = s.v[s.p[0].size()];
+  }
+}
+
+// Функция для вычисления точки стороны side поверхности s с параметром t
+Point side_point(const BSplineSurface& s, int side, double t) {
+  double u, v;
+  side_parameters(s, side, t, u, v);
+  return evaluate_b_spline_surface(s.p, s.u, s.v, s.k1, s.k2, u, v);
+}
+
+// Функция для проецирования точки p на сторону side поверхности s методом Ньютона по параметру стороны t с начальным
+// приближением t; t остается в области стороны, work - рабочий массив размера 6 * (max(k1, k2) + 1)
+// Возвращает расстояние от p до проекции
+double project_to_side(const BSplineSurface& s, int side, const Point& p, double& t, double* work) {
+  double t0, t1;
+  side_range(s, side, t0, t1);
+  const int iterations = 20;
+  for (int it = 0; it < iterations; it++) {
+    double u, v;
+    side_parameters(s, side, t, u, v);
+    Point S;
+    Vector Su, Sv;
+    evaluate_b_spline_derivs(s, u, v, S, Su, Sv, work);
+    const Vector& d = side % 2 == 0 ? Su : Sv; // Производная вдоль стороны
+    double dd = d * d;
+    if (dd == 0) break;
+    double next = max(t0, min(t1, t + (Vector(p - S) * d) / dd));
+    bool done = abs(next - t) <= 1e-14 * (t1 - t0);
+    t = next;
+    if (done) break;
+  }
+  return sqrt(distance2(side_point(s, side, t), p));
+}
+
+// Структура для хранения пары общих сторон сеток двух поверхностей: сторона a % 4 поверхности a / 4 совпадает
+// со стороной b % 4 поверхности b / 4; reversed - стороны проходятся в противоположных направлениях
+struct SideMatch {
+  int a, b;
+  bool reversed;
+};
+
+// Функция для вычисления допуска совпадения сторон сеток поверхностей surfaces: доля tolerance диагонали
+// параллелепипеда, содержащего углы всех поверхностей (nullptr - поверхность не прочитана)
+double side_tolerance(const vector<const BSplineSurface*>& surfaces, double tolerance) {
+  Point lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+  for (const BSplineSurface* s : surfaces) {
+    if (!s) continue;
+    for (int side = 0; side < 4; side++) {
+      double t0, t1;
+      side_range(*s, side, t0, t1);
+      Point p = side_point(*s, side, side < 2 ? t0 : t1);
+      lo = Point(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+      hi = Point(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+  }
+  return lo.x <= hi.x ? tolerance * sqrt(distance2(hi, lo)) : 0;
+}
+
+// Функция для поиска общих сторон сеток поверхностей surfaces (nullptr - поверхность не прочитана)
+// Стороны общие, если их концы совпадают с допуском tolerance в долях диагонали параллелепипеда углов всех поверхностей,
+// а средняя точка одной стороны лежит на другой с тем же допуском. Кандидаты ищутся по пространственному хешу начал сторон
+// с ячейками размера 2 * допуск; сторона сопоставляется не больше чем с одной, а из нескольких кандидатов выбирается
+// сторона с наименьшим номером, поэтому результат не зависит от порядка обхода хеша. Стороны с совпадающими концами
+// (полюса и замкнутые кривые, направление которых не определяется концами) и стороны одной поверхности (швы замкнутых
+// поверхностей) не сопоставляются
+vector<SideMatch> match_patch_sides(const vector<const BSplineSurface*>& surfaces, double tolerance) {
+  int n = surfaces.size();
+  vector<Point> start(4 * n), middle(4 * n);
+  vector<char> valid(4 * n, 0);
+  for (int i = 0; i < n; i++) {
+    if (!surfaces[i]) continue;
+    const BSplineSurface& s = *surfaces[i];
+    for (int side = 0; side < 4; side++) {
+      double t0, t1;
+      side_range(s, side, t0, t1);
+      start[4 * i + side] = side_point(s, side, side < 2 ? t0 : t1);
+      middle[4 * i + side] = side_point(s, side, (t0 + t1) / 2);
+      valid[4 * i + side] = 1;
+    }
+  }
+  vector<SideMatch> matches;
+  double tol = side_tolerance(surfaces, tolerance);
+  if (!(tol > 0)) return matches;
+  // Конец стороны - начало следующей стороны той же поверхности
+  auto end = [&](int a) -> const Point& { return start[a - a % 4 + (a + 1) % 4]; };
+  for (int a = 0; a < 4 * n; a++) {
+    if (valid[a] && distance2(start[a], end(a)) <= tol * tol) valid[a] = 0;
+  }
+  // Точка на расстоянии не больше допуска от начала стороны лежит в той же или в соседней ячейке хеша
+  double h = 2 * tol;
+  auto cell = [&](const Point& p, int dx, int dy, int dz) {
+    long long x = (long long)floor(p.x / h) + dx, y = (long long)floor(p.y / h) + dy, z = (long long)floor(p.z / h) + dz;
+    return (x * 73856093LL) ^ (y * 19349663LL) ^ (z * 83492791LL);
+  };
+  unordered_map<long long, vector<int>> grid;
+  for (int a = 0; a < 4 * n; a++) {
+    if (valid[a]) grid[cell(start[a], 0, 0, 0)].push_back(a);
+  }
+  vector<char> matched(4 * n, 0);
+  vector<double> work;
+  for (int a = 0; a < 4 * n; a++) {
+    if (!valid[a] || matched[a]) continue;
+    const BSplineSurface& s = *surfaces[a / 4];
+    work.resize(6 * (max(s.k1, s.k2) + 1));
+    double t0, t1;
+    side_range(s, a % 4, t0, t1);
+    int best = -1;
+    bool best_reversed = false;
+    // Сторона b проходится в обратном направлении, если ее начало совпадает с концом a, и в том же - если с началом a
+    for (int reversed = 1; reversed >= 0; reversed--) {
+      const Point& p = reversed ? end(a) : start[a];
+      const Point& q = reversed ? start[a] : end(a);
+      for (int dx = -1; dx <= 1; dx++) {
+        for (int dy = -1; dy <= 1; dy++) {
+          for (int dz = -1; dz <= 1; dz++) {
+            auto it = grid.find(cell(p, dx, dy, dz));
+            if (it == grid.end()) continue;
+            for (int b : it->second) {
+              if (b / 4 == a / 4 || matched[b] || (best >= 0 && b >= best)) continue;
+              if (distance2(start[b], p) > tol * tol || distance2(end(b), q) > tol * tol) continue;
+              double t = (t0 + t1) / 2;
+              if (project_to_side(s, a % 4, middle[b], t, work.data()) > tol) continue;
+              best = b;
+              best_reversed = reversed;
+            }
           }
-          if ((p4 == q1 && p1 == q4) || (p4 == q4 && p1 == q1)) {
-            l = m;
-            break;
-///////////////////////////////////////////////////////////////////////////////////////////////////////////////
-          if ((p3 == q1 && p4 == q4) || (p3 == q4 && p4 == q1)) {
-            l = m;
-            break;
+        }
+      }
+    }
+    if (best < 0) continue;
+    matched[a] = matched[best] = 1;
+    matches.push_back({a, best, best_reversed});
+  }
+  return matches;
+}
+
+// Функция для поиска представителя множества x в системе непересекающихся множеств parent (со сжатием путей)
+int find_root(vector<int>& parent, int x) {
+  while (parent[x] != x) {
+    parent[x] = parent[parent[x]];
+    x = parent[x];
+  }
+  return x;
+}
+
+// Функция для объединения множеств a и b; представителем становится элемент с меньшим номером
+void unite(vector<int>& parent, int a, int b) {
+  a = find_root(parent, a);
+  b = find_root(parent, b);
+  if (a < b) parent[b] = a;
+  else parent[a] = b;
+}
+
+// Функция для перераспределения возрастающих параметров params на n ребер линейной интерполяцией по номеру узла
+// Концы области сохраняются
+void resample_parameters(pmr::vector<double>& params, int n) {
+  int m = params.size() - 1;
+  if (m == n) return;
+  vector<double> old(params.begin(), params.end());
+  params.resize(n + 1);
+  for (int j = 0; j <= n; j++) {
+    double x = double(j) * m / n;
+    int i = min(m - 1, (int)x);
+    params[j] = old[i] + (old[i + 1] - old[i]) * (x - i);
+  }
+  params[n] = old[m];
+}
+
+// Функция для согласования параметров узлов сеток поверхностей вдоль общих сторон matches, us[i] и vs[i] - параметры
+// узлов поверхности i. Направления параметров, связанные общими сторонами, получают одинаковое количество ребер
+// (наибольшее из выбранных по полю размеров). Параметры направления с наименьшим номером перераспределяются, а параметры
+// остальных направлений получаются проецированием узлов уже согласованной соседней стороны, поэтому узлы общих сторон
+// совпадают. Если направление связано с несколькими соседями, используется первый из них при обходе в ширину; если проекции
+// не возрастают, параметры направления только перераспределяются
+// Поэтому узлы пары сторон, не вошедшей в обход (второй сосед направления, замыкающая пара кольца поверхностей), или пары
+// с неудачным проецированием могут не совпасть. Возвращает для каждой пары признак того, что все узлы ее сторон совпадают
+// с допуском; объединять можно только такие пары
+vector<char> conform_patch_parameters(const vector<const BSplineSurface*>& surfaces, const vector<SideMatch>& matches, double tolerance,
+                                      vector<pmr::vector<double>*>& us, vector<pmr::vector<double>*>& vs) {
+  int n = surfaces.size();
+  auto params = [&](int d) -> pmr::vector<double>& { return d % 2 == 0 ? *us[d / 2] : *vs[d / 2]; };
+  // Направление параметра d = 2 * i + (сторона % 2) поверхности i
+  auto direction = [](int side) { return 2 * (side / 4) + side % 2; };
+  vector<int> parent(2 * n);
+  iota(parent.begin(), parent.end(), 0);
+  vector<vector<int>> links(2 * n); // Номера пар сторон при каждом направлении
+  for (int k = 0; k < (int)matches.size(); k++) {
+    int a = direction(matches[k].a), b = direction(matches[k].b);
+    unite(parent, a, b);
+    links[a].push_back(k);
+    links[b].push_back(k);
+  }
+  vector<int> count(2 * n, 0);
+  for (int d = 0; d < 2 * n; d++) {
+    if (surfaces[d / 2]) count[find_root(parent, d)] = max(count[find_root(parent, d)], (int)params(d).size() - 1);
+  }
+  double tol = side_tolerance(surfaces, tolerance);
+  vector<char> done(2 * n, 0);
+  vector<double> work;
+  for (int root = 0; root < 2 * n; root++) {
+    if (!surfaces[root / 2] || find_root(parent, root) != root) continue;
+    int m = count[root];
+    resample_parameters(params(root), m);
+    done[root] = 1;
+    // Обход в ширину по общим сторонам класса
+    vector<int> queue(1, root);
+    for (size_t head = 0; head < queue.size(); head++) {
+      int d = queue[head];
+      for (int k : links[d]) {
+        const SideMatch& match = matches[k];
+        int from = direction(match.a) == d ? match.a : match.b, to = from == match.a ? match.b : match.a;
+        int e = direction(to);
+        if (done[e]) continue;
+        done[e] = 1;
+        queue.push_back(e);
+        const BSplineSurface& s = *surfaces[from / 4];
+        const BSplineSurface& r = *surfaces[to / 4];
+        const pmr::vector<double>& x = params(d);
+        pmr::vector<double>& y = params(e);
+        // Стороны 2 и 3 проходятся против возрастания параметра
+        bool flipped = (match.reversed != (from % 4 >= 2)) != (to % 4 >= 2);
+        double x0, x1, y0, y1;
+        side_range(s, from % 4, x0, x1);
+        side_range(r, to % 4, y0, y1);
+        work.resize(6 * (max(r.k1, r.k2) + 1));
+        vector<double> t(m + 1);
+        bool ok = true;
+        for (int i = 0; i <= m && ok; i++) {
+          int j = flipped ? m - i : i;
+          double f = (x[i] - x0) / (x1 - x0);
+          t[j] = y0 + (flipped ? 1 - f : f) * (y1 - y0);
+          ok = project_to_side(r, to % 4, side_point(s, from % 4, x[i]), t[j], work.data()) <= tol;
+        }
+        t[0] = y0;
+        t[m] = y1;
+        for (int j = 0; j < m && ok; j++) ok = t[j] < t[j + 1];
+        if (ok) y.assign(t.begin(), t.end());
+        else resample_parameters(y, m);
+      }
+    }
+  }
+  // Проверяем каждую пару по точкам сторон с итоговыми параметрами узлов
+  vector<char> conformed(matches.size(), 0);
+  for (int k = 0; k < (int)matches.size(); k++) {
+    const SideMatch& match = matches[k];
+    const BSplineSurface& s = *surfaces[match.a / 4];
+    const BSplineSurface& r = *surfaces[match.b / 4];
+    const pmr::vector<double>& x = params(direction(match.a));
+    const pmr::vector<double>& y = params(direction(match.b));
+    int m = x.size() - 1;
+    if ((int)y.size() != m + 1) continue;
+    bool flipped = (match.reversed != (match.a % 4 >= 2)) != (match.b % 4 >= 2);
+    bool ok = true;
+    for (int i = 0; i <= m && ok; i++) {
+      ok = distance2(side_point(s, match.a % 4, x[i]), side_point(r, match.b % 4, y[flipped ? m - i : i])) <= tol * tol;
+    }
+    conformed[k] = ok;
+  }
+  return conformed;
+}
+
+// Функция для вычисления индекса k-го узла стороны side сетки поверхности с первым узлом base и nu x nv четырехугольниками
+// (узлы нумеруются в направлении обхода стороны)
+int side_node(int base, int nu, int nv, int side, int k) {
+  switch (side) {
+    case 0: return base + k * (nv + 1);
+    case 1: return base + nu * (nv + 1) + k;
+    case 2: return base + (nu - k) * (nv + 1) + nv;
+    default: return base + nv - k;
+  }
+}
+
+// Функция для удаления узлов сетки, объединенных в множества parent (см. find_root): остается узел-представитель,
+// индексы остальных узлов в четырехугольниках и контурах граней faces заменяются его индексом, порядок оставшихся
+// узлов сохраняется. Возвращает количество удаленных узлов
+int remove_merged_nodes(Mesh& mesh, vector<Face>& faces, vector<int>& parent) {
+  vector<int> index(mesh.nodes.size());
+  int n = 0;
+  for (int i = 0; i < (int)mesh.nodes.size(); i++) {
+    int r = find_root(parent, i);
+    if (r != i) {
+      index[i] = index[r];
+      continue;
+    }
+    index[i] = n;
+    mesh.nodes[n] = mesh.nodes[i];
+    if (!mesh.uv.empty()) mesh.uv[n] = mesh.uv[i];
+    n++;
+  }
+  int removed = mesh.nodes.size() - n;
+  if (removed == 0) return 0;
+  mesh.nodes.resize(n);
+  if (!mesh.uv.empty()) mesh.uv.resize(n);
+  for (array<int, 4>& q : mesh.quads) {
+    for (int& v : q) v = index[v];
+  }
+  for (Face& f : faces) {
+    for (int& v : f.contour) v = index[v];
+  }
+  return removed;
+}
+
+// Функция для объединения узлов общих сторон matches сеток граней тела; grids[i] - индекс первого узла сетки поверхности i
+// и количество ее четырехугольников по двум направлениям (первый узел -1 - поверхность не разбита)
+// Объединяются только пары с признаком conformed (см. conform_patch_parameters); признак сбрасывается у пар, стороны которых
+// разбиты на разное количество ребер или не разбиты вовсе
+// Узлы пары сторон объединяются попарно, углы нескольких граней - транзитивно; остается узел с наименьшим индексом
+// Возвращает количество удаленных узлов
+int merge_shared_sides(Mesh& mesh, vector<Face>& faces, const vector<SideMatch>& matches, vector<char>& conformed,
+                       const vector<array<int, 3>>& grids) {
+  vector<int> parent(mesh.nodes.size());
+  iota(parent.begin(), parent.end(), 0);
+  for (int i = 0; i < (int)matches.size(); i++) {
+    const SideMatch& match = matches[i];
+    if (!conformed[i]) continue;
+    const array<int, 3>& a = grids[match.a / 4];
+    const array<int, 3>& b = grids[match.b / 4];
+    int m = a[1 + match.a % 2];
+    if (a[0] < 0 || b[0] < 0 || m != b[1 + match.b % 2]) {
+      conformed[i] = 0;
+      continue;
+    }
+    for (int k = 0; k <= m; k++) {
+      unite(parent, side_node(a[0], a[1], a[2], match.a % 4, k), side_node(b[0], b[1], b[2], match.b % 4, match.reversed ? m - k : k));
+    }
+  }
+  return remove_merged_nodes(mesh, faces, parent);
+}
+
+// Функция для определения количества потоков, выполняющих n задач при заданном количестве threads (0 - по числу ядер)
+int worker_count(int threads, int n) {
+  if (threads <= 0) threads = max(1u, thread::hardware_concurrency());
+  return max(1, min(threads, n));
+}
+
+// Функция для параллельного выполнения независимых задач с перехватом работы между потоками
+// Задачи раздаются потокам по кругу в порядке убывания веса, поэтому самые тяжелые задачи начинаются первыми
+// Каждый поток берет задачи из начала своей очереди, а освободившийся поток забирает задачи из конца чужих очередей
+// Задаче передаются ее номер и номер выполняющего ее потока из [0, worker_count(threads, n)), по которому задача может
+// выбрать собственные данные потока, например его арену
+void run_work_stealing(const vector<long long>& weight, int threads, const function<void(int, int)>& task) {
+  int n = weight.size(); // Количество задач
+  threads = worker_count(threads, n);
+  // Упорядочиваем задачи по убыванию веса, при равном весе - по номеру
+  vector<int> order(n);
+  for (int i = 0; i < n; i++) order[i] = i;
+  stable_sort(order.begin(), order.end(), [&](int a, int b) { return weight[a] > weight[b]; });
+  // В однопоточном режиме выполняем задачи в том же порядке без создания потоков
+  if (threads <= 1) {
+    for (int t : order) task(t, 0);
+    return;
+  }
+  // Очереди задач потоков, каждая защищена своим мьютексом
+  vector<deque<int>> queues(threads);
+  vector<mutex> locks(threads);
+  for (int i = 0; i < n; i++) queues[i % threads].push_back(order[i]);
+  // Функция для извлечения следующей задачи потоком w: сначала из своей очереди, затем из чужих
+  auto next = [&](int w) {
+    {
+      lock_guard<mutex> guard(locks[w]);
+      if (!queues[w].empty()) {
+        int t = queues[w].front();
+        queues[w].pop_front();
+        return t;
+      }
+    }
+    for (int d = 1; d < threads; d++) {
+      int o = (w + d) % threads; // Поток, у которого перехватываем работу
+      lock_guard<mutex> guard(locks[o]);
+      if (!queues[o].empty()) {
+        int t = queues[o].back();
+        queues[o].pop_back();
+        return t;
+      }
+    }
+    return -1;
+  };
+  // Новые задачи в процессе работы не появляются, поэтому поток завершается, когда все очереди пусты
+  vector<thread> pool;
+  for (int w = 0; w < threads; w++) {
+    pool.emplace_back([&, w]() {
+      for (int t = next(w); t != -1; t = next(w)) task(t, w);
+    });
+  }
+  for (thread& th : pool) th.join();
+}
+
+// Структура для хранения записи секции каталога IGES (Directory Entry)
+struct IgesEntry {
+  int type; // Тип сущности
+  int de; // Указатель DE - порядковый номер первой строки записи в секции D
+  int param; // Порядковый номер первой строки параметров сущности в секции P
+  int lines; // Количество строк параметров сущности
+  int form; // Номер формы сущности
+};
+
+// Функция для отображения файла в память только для чтения, возвращает false, если файл не удалось прочитать
+// Для пустого файла data равно nullptr; отображение освобождается вызовом munmap(data, size)
+bool map_file(const string& filename, const char*& data, size_t& size, int advice) {
+  data = nullptr;
+  size = 0;
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    return false;
+  }
+  if (st.st_size > 0) {
+    void* m = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (m == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    data = (const char*)m;
+    size = st.st_size;
+    madvise(m, size, advice);
+  }
+  close(fd);
+  return true;
+}
+
+// Структура для чтения файла IGES, отображенного в память
+// При открытии файл один раз просматривается построчно: разбираются разделители из секции G, строится таблица записей каталога
+// и запоминаются смещения строк секции P; параметры сущностей разбираются только при обращении к ним по указателю DE
+struct IgesFile {
+  const char* data = nullptr; // Содержимое файла
+  size_t size = 0; // Размер файла в байтах
+  char param_delim = ','; // Разделитель параметров
+  char record_delim = ';'; // Признак конца записи
+  vector<IgesEntry> directory; // Записи каталога в порядке следования
+  vector<size_t> p_lines; // Смещения начала строк секции P, строка с номером n имеет индекс n - 1
+
+  IgesFile() {}
+  IgesFile(const IgesFile&) = delete;
+  IgesFile& operator=(const IgesFile&) = delete;
+  ~IgesFile() {
+    if (data) munmap((void*)data, size);
+  }
+
+  // Функция для получения длины строки, начинающейся со смещения offset, без символов конца строки
+  size_t line_length(size_t offset) const {
+    const char* s = data + offset;
+    const char* e = (const char*)memchr(s, '\n', size - offset);
+    size_t n = e ? e - s : size - offset;
+    if (n > 0 && s[n - 1] == '\r') n--;
+    return n;
+  }
+
+  // Функция для открытия файла и построения индекса секций, возвращает false, если файл не удалось прочитать
+  bool open(const string& filename) {
+    if (!map_file(filename, data, size, MADV_SEQUENTIAL)) return false;
+    // Записи IGES имеют длину 80 символов; обычно они разделены переводами строк, но встречаются файлы без них
+    bool fixed = size >= 80 && memchr(data, '\n', min<size_t>(size, 82)) == nullptr;
+    string global; // Данные секции глобальных параметров (колонки 1-72)
+    vector<size_t> d_lines; // Смещения строк секции каталога
+    for (size_t offset = 0; offset < size;) {
+      size_t n, next; // Длина строки и смещение следующей строки
+      if (fixed) {
+        n = min<size_t>(80, size - offset);
+        next = offset + 80;
+      } else {
+        const char* nl = (const char*)memchr(data + offset, '\n', size - offset);
+        next = nl ? nl - data + 1 : size;
+        n = line_length(offset);
+      }
+      // Тип секции записан в 73-й колонке строки
+      if (n >= 73) {
+        char section = data[offset + 72];
+        if (section == 'G') global.append(data + offset, 72); // Секция глобальных параметров
+        else if (section == 'D') d_lines.push_back(offset); // Секция каталога записей
+        else if (section == 'P') p_lines.push_back(offset); // Секция параметров
+        else if (section == 'T') break; // Секция завершения
+        // Секция спецификации 'S' не содержит информации о геометрии тела и пропускается
+      }
+      offset = next;
+    }
+    // Первые два глобальных параметра задают разделители в виде строк Холлерита "1H,", "1H;"; пустое поле означает значение по умолчанию
+    size_t k = 0;
+    if (global.compare(0, 2, "1H") == 0 && global.size() > 2) {
+      param_delim = global[2];
+      k = 3;
+    }
+    if (k < global.size() && global[k] == param_delim) k++;
+    if (global.compare(k, 2, "1H") == 0 && global.size() > k + 2) record_delim = global[k + 2];
+    // Каждая запись каталога занимает две строки по девять полей шириной 8 символов
+    directory.reserve(d_lines.size() / 2);
+    for (size_t i = 0; i + 1 < d_lines.size(); i += 2) {
+      IgesEntry e;
+      e.type = field(d_lines[i], 0);
+      e.param = field(d_lines[i], 1);
+      e.lines = field(d_lines[i + 1], 3);
+      e.form = field(d_lines[i + 1], 4);
+      e.de = i + 1;
+      directory.push_back(e);
+    }
+    return true;
+  }
+
+  // Функция для чтения целого поля с номером k (от нуля) строки каталога, начинающейся со смещения offset
+  int field(size_t offset, int k) const {
+    const char* s = data + offset + 8 * k;
+    const char* e = s + 8;
+    while (s < e && *s == ' ') s++;
+    if (s < e && *s == '+') s++;
+    int value = 0;
+    from_chars(s, e, value);
+    return value;
+  }
+
+  // Функция для поиска записи каталога по указателю DE, возвращает nullptr для неверного указателя
+  const IgesEntry* entry(int de) const {
+    if (de < 1 || de % 2 == 0 || (de - 1) / 2 >= (int)directory.size()) return nullptr;
+    return &directory[(de - 1) / 2];
+  }
+
+  // Функция для чтения B-spline поверхности (тип 128) по указателю DE, возвращает false при ошибке в записи
+  // Рациональная поверхность с неравными весами не читается: rational получает true, а функция возвращает false
+  bool read_b_spline_surface(int de, BSplineSurface& s, bool& rational) const;
+};
+
+// Структура для последовательного чтения параметров одной сущности из секции P без копирования данных
+// Параметры занимают колонки 1-64 строк секции; лексемы возвращаются как ссылки на отображенный в память файл
+struct IgesTokenizer {
+  const IgesFile& file;
+  int line; // Индекс текущей строки секции P
+  int last; // Индекс строки, следующей за последней строкой сущности
+  const char* pos = nullptr; // Текущая позиция в строке
+  const char* end = nullptr; // Конец области параметров текущей строки
+  bool finished = false; // Признак того, что запись сущности прочитана до конца
+  bool error = false; // Признак ошибки при разборе числа
+
+  IgesTokenizer(const IgesFile& file, const IgesEntry& e) : file(file), line(e.param - 1), last(e.param - 1 + e.lines) {
+    if (line < 0 || last > (int)file.p_lines.size() || line >= last) {
+      finished = error = true;
+      return;
+    }
+    load(line);
+  }
+
+  // Функция для перехода на строку с индексом l
+  void load(int l) {
+    size_t offset = file.p_lines[l];
+    pos = file.data + offset;
+    end = pos + min<size_t>(64, file.line_length(offset));
+  }
+
+  // Функция для пропуска пробелов, в том числе в конце строки; возвращает false, если строки сущности закончились
+  bool skip_spaces() {
+    for (;;) {
+      while (pos < end && *pos == ' ') pos++;
+      if (pos < end) return true;
+      if (line + 1 >= last) return false;
+      load(++line);
+    }
+  }
+
+  // Функция для чтения следующей лексемы, возвращает false, если параметры сущности закончились
+  // Пустая лексема соответствует параметру со значением по умолчанию
+  bool next(string_view& token) {
+    if (finished || !skip_spaces()) {
+      finished = true;
+      return false;
+    }
+    const char* s = pos;
+    // Проверяем, является ли параметр строкой Холлерита вида nHxxx
+    const char* q = pos;
+    while (q < end && *q >= '0' && *q <= '9') q++;
+    if (q > pos && q < end && (*q == 'H' || *q == 'h')) {
+      int n = 0;
+      from_chars(pos, q, n);
+      pos = q + 1;
+      s = pos;
+      // Строка может продолжаться на следующих строках, в этом случае лексема содержит только ее первую часть
+      size_t first = min<size_t>(n, end - pos);
+      token = string_view(s, first);
+      for (int left = n; left > 0;) {
+        int take = min<long>(left, end - pos);
+        pos += take;
+        left -= take;
+        if (left > 0) {
+          if (line + 1 >= last) break;
+          load(++line);
+        }
+      }
+    } else {
+      while (pos < end && *pos != file.param_delim && *pos != file.record_delim) pos++;
+      const char* e = pos;
+      while (e > s && e[-1] == ' ') e--;
+      token = string_view(s, e - s);
+    }
+    // Пропускаем разделитель параметров или признак конца записи
+    if (!skip_spaces()) {
+      finished = true;
+    } else if (*pos == file.param_delim) {
+      pos++;
+    } else if (*pos == file.record_delim) {
+      pos++;
+      finished = true;
+    }
+    return true;
+  }
+
+  // Функция для чтения следующего целого параметра
+  int next_int() {
+    string_view t;
+    if (!next(t)) {
+      error = true;
+      return 0;
+    }
+    const char* s = t.data();
+    const char* e = s + t.size();
+    if (s < e && *s == '+') s++;
+    int value = 0;
+    if (s < e && from_chars(s, e, value).ptr != e) error = true;
+    return value;
+  }
+
+  // Функция для чтения следующего вещественного параметра
+  // Показатель степени двойной точности записывается в IGES через букву D, которую from_chars не принимает
+  double next_double() {
+    string_view t;
+    if (!next(t)) {
+      error = true;
+      return 0;
+    }
+    const char* s = t.data();
+    const char* e = s + t.size();
+    if (s < e && *s == '+') s++;
+    double value = 0;
+    if (s == e) return value;
+    if (find_if(s, e, [](char c) { return c == 'D' || c == 'd'; }) == e) {
+      if (from_chars(s, e, value).ptr != e) error = true;
+      return value;
+    }
+    char buffer[64];
+    int n = min<long>(e - s, sizeof(buffer));
+    for (int i = 0; i < n; i++) buffer[i] = (s[i] == 'D' || s[i] == 'd') ? 'E' : s[i];
+    if (from_chars(buffer, buffer + n, value).ptr != buffer + n) error = true;
+    return value;
+  }
+};
+
+bool IgesFile::read_b_spline_surface(int de, BSplineSurface& s, bool& rational) const {
+  rational = false;
+  const IgesEntry* e = entry(de);
+  if (!e || e->type != 128) return false;
+  IgesTokenizer t(*this, *e);
+  if (t.next_int() != 128) return false;
+  // Читаем параметры поверхности
+  int K1 = t.next_int(), K2 = t.next_int(); // Верхние индексы сумм - количество контрольных точек минус один
+  int M1 = t.next_int(), M2 = t.next_int(); // Степени B-spline базисных функций по двум направлениям
+  // Свойства поверхности: замкнутость по двум направлениям, полиномиальность (PROP3 = 1) и периодичность
+  int prop[5];
+  for (int& x : prop) x = t.next_int();
+  if (t.error || K1 < 0 || K2 < 0 || M1 < 0 || M2 < 0 || M1 > K1 || M2 > K2) return false;
+  int m1 = K1 + 1, m2 = K2 + 1; // Количество контрольных точек по двум направлениям
+  s.k1 = M1;
+  s.k2 = M2;
+  s.u.resize(m1 + M1 + 1);
+  s.v.resize(m2 + M2 + 1);
+  for (double& x : s.u) x = t.next_double();
+  for (double& x : s.v) x = t.next_double();
+  // Веса контрольных точек: поверхность вычисляется как полиномиальная, поэтому рациональная поверхность принимается,
+  // только если все ее веса равны (тогда веса сокращаются); иначе, например у точных цилиндров и конусов, она отвергается
+  double w0 = t.next_double();
+  for (int i = 1; i < m1 * m2; i++) {
+    double w = t.next_double();
+    if (prop[2] == 0 && fabs(w - w0) > 1e-12 * fabs(w0)) rational = true;
+  }
+  if (rational) return false;
+  // Контрольные точки записаны в декартовых координатах, первый индекс меняется быстрее
+  s.p.resize(m1);
+  for (pmr::vector<Point>& row : s.p) row.resize(m2);
+  for (int j = 0; j < m2; j++) {
+    for (int i = 0; i < m1; i++) {
+      double x = t.next_double(), y = t.next_double(), z = t.next_double();
+      s.p[i][j] = Point(x, y, z);
+    }
+  }
+  s.u0 = t.next_double();
+  s.u1 = t.next_double();
+  s.v0 = t.next_double();
+  s.v1 = t.next_double();
+  return !t.error;
+}
+
+// Функция для чтения тела из файла формата IGES
+// Параметры поверхностей разбираются параллельно в threads потоках (0 - по числу ядер): записи разных сущностей в секции P
+// независимы, а грани добавляются в тело в порядке записей каталога, поэтому результат совпадает с последовательным чтением
+// Размеры элементов задаются полем size (по умолчанию - равномерное разбиение 10 x 10). Общие стороны соседних поверхностей
+// разбиваются одинаково и их узлы объединяются, поэтому сетка тела согласована вдоль границ граней
+// Грани добавляются в пустое тело body, сетка и поверхности размещаются в его источнике памяти
+// Возвращает false и описание ошибки в error, если файл не удалось прочитать
+// Сообщения о пропущенных поверхностях, в том числе о рациональных поверхностях с неравными весами, добавляются в warnings
+bool read_iges(const string& filename, Body& body, string& error, vector<string>& warnings, int threads = 0,
+               const SizeField& size = SizeField()) {
+  // Отображаем файл в память и строим индекс секций
+  IgesFile iges;
+  if (!iges.open(filename)) {
+    error = "cannot open file " + filename;
+    return false;
+  }
+  // Выбираем из каталога B-spline поверхности (тип 128)
+  vector<const IgesEntry*> entities;
+  for (const IgesEntry& e : iges.directory) {
+    if (e.type == 128) entities.push_back(&e);
+  }
+  // Разбираем параметры поверхностей в заранее выделенные элементы массива и там же выбираем параметры узлов их сеток,
+  // вес задачи - количество строк параметров. Контрольные сети и параметры узлов размещаются в арене потока, который разбирал
+  // поверхность; арены потоков освобождаются целиком после переноса поверхностей в тело
+  // Структура для хранения разобранной поверхности и параметров узлов ее сетки
+  struct Parsed {
+    BSplineSurface s;
+    pmr::vector<double> us, vs;
+    bool ok = false;
+    bool rational = false; // Признак рациональной поверхности, которую нельзя вычислить как полиномиальную
+    Parsed(Arena* arena) : s(arena), us(arena), vs(arena) {}
+  };
+  vector<Arena> arenas(worker_count(threads, entities.size())); // Арены потоков, освобождаются после всех поверхностей
+  vector<optional<Parsed>> parsed(entities.size());
+  vector<long long> weight;
+  for (const IgesEntry* e : entities) weight.push_back(e->lines);
+  run_work_stealing(weight, threads, [&](int i, int w) {
+    Parsed& r = parsed[i].emplace(&arenas[w]);
+    {
+      QM_STAT_TIMER(parse_ns);
+      r.ok = iges.read_b_spline_surface(entities[i]->de, r.s, r.rational);
+    }
+    QM_STAT_TIMER(tessellation_ns);
+    if (r.ok) surface_parameters(r.s, size, entities[i]->de, r.us, r.vs);
+  });
+  QM_STAT_TIMER(tessellation_ns);
+  // Находим общие стороны соседних поверхностей и согласуем вдоль них параметры узлов, чтобы каждая общая сторона
+  // разбивалась один раз одинаковыми узлами для обеих граней
+  vector<const BSplineSurface*> surfaces(entities.size(), nullptr);
+  vector<pmr::vector<double>*> us(entities.size(), nullptr), vs(entities.size(), nullptr);
+  for (int i = 0; i < (int)entities.size(); i++) {
+    if (!parsed[i]->ok) continue;
+    surfaces[i] = &parsed[i]->s;
+    us[i] = &parsed[i]->us;
+    vs[i] = &parsed[i]->vs;
+  }
+  vector<SideMatch> matches;
+  if (size.shared_tolerance > 0) matches = match_patch_sides(surfaces, size.shared_tolerance);
+  vector<char> conformed;
+  if (!matches.empty()) conformed = conform_patch_parameters(surfaces, matches, size.shared_tolerance, us, vs);
+  // Размеры сетки известны заранее, поэтому ее массивы выделяются один раз
+  size_t nodes = 0, quads = 0;
+  for (const optional<Parsed>& r : parsed) {
+    if (!r->ok) continue;
+    nodes += r->us.size() * r->vs.size();
+    quads += (r->us.size() - 1) * (r->vs.size() - 1);
+  }
+  body.mesh.nodes.reserve(nodes);
+  body.mesh.uv.reserve(nodes);
+  body.mesh.quads.reserve(quads);
+  body.mesh.owner.reserve(quads);
+  body.surfaces.reserve(entities.size());
+  body.faces.reserve(entities.size());
+  // Добавляем в тело грани в порядке записей каталога
+  vector<array<int, 3>> grids(entities.size(), {-1, 0, 0}); // Первый узел и размеры сетки каждой поверхности
+  for (int i = 0; i < (int)entities.size(); i++) {
+    const Parsed& r = *parsed[i];
+    // Рациональная поверхность разбивалась бы по неверной геометрии, поэтому она пропускается, как и нечитаемая
+    if (r.rational) {
+      warnings.push_back("rational B-spline surface (entity 128 at DE " + to_string(entities[i]->de) + ") is not supported in " + filename);
+      continue;
+    }
+    if (!r.ok) {
+      warnings.push_back("cannot read entity 128 at DE " + to_string(entities[i]->de) + " in " + filename);
+      continue;
+    }
+    // Разбиваем поверхность на четырехугольники с общими узлами и добавляем полученную грань к телу
+    grids[i] = {(int)body.mesh.nodes.size(), (int)r.us.size() - 1, (int)r.vs.size() - 1};
+    tessellate_b_spline_surface(body, r.s, r.us, r.vs);
+    QM_STAT_ADD(surfaces, 1);
+  }
+  // Объединяем узлы общих сторон: сетка тела получается согласованной без последующего слияния узлов
+  if (!matches.empty()) {
+    int merged = merge_shared_sides(body.mesh, body.faces, matches, conformed, grids);
+    QM_STAT_ADD(merged_nodes, merged);
+    QM_STAT_ADD(shared_sides, count(conformed.begin(), conformed.end(), 1));
+  }
+  QM_STAT_ADD(nodes, body.mesh.nodes.size());
+  QM_STAT_ADD(quads, body.mesh.quads.size());
+  return true;
+}
+
+// Функция для чтения тела из файла формата IGES в новую арену задания; предупреждения выводятся в cerr,
+// при ошибке программа завершается
+Body read_iges(const string& filename, int threads = 0, const SizeField& size = SizeField()) {
+  Body body(make_shared<Arena>());
+  string error;
+  vector<string> warnings;
+  bool ok = read_iges(filename, body, error, warnings, threads, size);
+  for (const string& w : warnings) cerr << "Warning: " << w << endl;
+  if (!ok) {
+    cerr << "Error: " << error << endl;
+    exit(1);
+  }
+  return body;
+}
+
+// Функция для записи целого числа, выровненного по правому краю в поле ширины w (как setw(w) << value), возвращает конец записи
+char* put_int(char* out, long long value, int w) {
+  char buffer[24];
+  char* e = to_chars(buffer, buffer + sizeof(buffer), value).ptr;
+  int n = e - buffer;
+  for (int i = n; i < w; i++) *out++ = ' ';
+  memcpy(out, buffer, n);
+  return out + n;
+}
+
+// Функция для записи вещественного числа в формате потока по умолчанию (%g с 6 значащими цифрами) в поле ширины w
+char* put_double(char* out, double value, int w) {
+  char buffer[32];
+  char* e = to_chars(buffer, buffer + sizeof(buffer), value, chars_format::general, 6).ptr;
+  int n = e - buffer;
+  for (int i = n; i < w; i++) *out++ = ' ';
+  memcpy(out, buffer, n);
+  return out + n;
+}
+
+// Функция для записи строки в поле ширины w с выравниванием по правому краю
+char* put_string(char* out, const char* s, int w) {
+  int n = strlen(s);
+  for (int i = n; i < w; i++) *out++ = ' ';
+  memcpy(out, s, n);
+  return out + n;
+}
+
+// Структура для последовательной записи в файл блоками через writev
+struct BlockWriter {
+  int fd = -1; // Дескриптор файла
+  bool failed = false; // Признак ошибки записи
+
+  // Функция для записи нескольких участков памяти системными вызовами writev (с повтором при частичной записи)
+  void write(vector<iovec> iov) {
+    QM_STAT_TIMER(output_ns);
+#ifdef QM_STATS
+    for (const iovec& v : iov) QM_STAT_ADD(output_bytes, v.iov_len);
+#endif
+    size_t k = 0; // Первый незаписанный участок
+    while (k < iov.size() && !failed) {
+      ssize_t n = writev(fd, &iov[k], min<size_t>(iov.size() - k, IOV_MAX));
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        failed = true;
+        break;
+      }
+      // Пропускаем полностью записанные участки и сдвигаем начало частично записанного
+      while (k < iov.size() && n >= (ssize_t)iov[k].iov_len) n -= iov[k++].iov_len;
+      if (k < iov.size()) {
+        iov[k].iov_base = (char*)iov[k].iov_base + n;
+        iov[k].iov_len -= n;
+      }
+    }
+  }
+
+  // Функция для записи нескольких блоков одним системным вызовом
+  void write(vector<string>& blocks) {
+    vector<iovec> iov;
+    for (string& b : blocks) {
+      if (!b.empty()) iov.push_back({&b[0], b.size()});
+    }
+    write(iov);
+  }
+
+  // Функция для записи одного блока
+  void write(const string& text) {
+    vector<string> blocks(1, text);
+    write(blocks);
+  }
+
+  // Функция для записи count блоков по порядку номеров; блок b форматируется вызовом format(b, text) в threads потоках
+  // (0 - по числу ядер). Потоки создаются один раз и берут блоки по возрастанию номеров, а вызывающий поток записывает
+  // готовые блоки, пока форматируются следующие. Блоки форматируются в кольцо из двух буферов на поток, поэтому поток,
+  // который ушел вперед на целое кольцо, ждет записи; самый ранний незаписанный блок всегда уже взят в работу
+  void write(int count, int threads, const function<void(int, string&)>& format) {
+    int workers = worker_count(threads, count);
+    if (workers <= 1) {
+      string text;
+      for (int b = 0; b < count; b++) {
+        format(b, text);
+        write(text);
+      }
+      return;
+    }
+    const int window = 2 * workers; // Количество буферов кольца
+    vector<string> buffers(window);
+    vector<char> ready(window, 0); // Признак того, что блок в буфере отформатирован и ждет записи
+    int written = 0; // Количество записанных блоков
+    atomic<int> next{0}; // Номер следующего блока для форматирования
+    mutex lock;
+    condition_variable formatted, freed;
+    vector<thread> pool;
+    for (int w = 0; w < workers; w++) {
+      pool.emplace_back([&]() {
+        for (int b = next++; b < count; b = next++) {
+          {
+            unique_lock<mutex> guard(lock);
+            freed.wait(guard, [&] { return b < written + window; });
           }
-          if ((p4 == q1 && p1 == q4) || (p4 == q4 && p1 == q1)) {
-            l = m;
-            break;
+          format(b, buffers[b % window]);
+          {
+            lock_guard<mutex> guard(lock);
+            ready[b % window] = 1;
           }
+          formatted.notify_one();
         }
+      });
+    }
+    // Записываем подряд идущие готовые блоки одним вызовом writev
+    vector<iovec> iov;
+    while (written < count) {
+      int first = written, last = written;
+      {
+        unique_lock<mutex> guard(lock);
+        formatted.wait(guard, [&] { return ready[first % window] != 0; });
+        while (last < count && last - first < window && ready[last % window]) last++;
       }
-      // Если соседний четырехугольник найден, то выполняем операцию перестройки
-      if (l != -1) {
-        // Берем четыре вершины соседнего четырехугольника
-        Point& q1 = face.points[l];
-        Point& q2 = face.points[l + 1];
-        Point& q3 = face.points[l + 2];
-        Point& q4 = face.points[l + 3];
-        // Вычисляем углы соседнего четырехугольника в радианах
-        double b1 = angle(Edge(q1, q2), Edge(q4, q1));
-        double b2 = angle(Edge(q2, q3), Edge(q1, q2));
-        double b3 = angle(Edge(q3, q4), Edge(q2, q3));
-        double b4 = angle(Edge(q4, q1), Edge(q3, q4));
-        // Вычисляем качество соседнего четырехугольника по метрике углов
-        double r = min(b1, min(b2, min(b3, b4))) / max(b1, max(b2, max(b3, b4)));
-        // Выполняем перестройку в зависимости от индекса наименьшего угла исходного четырехугольника
-        switch (k) {
-          case 0: // Наименьший угол при вершине p1
-            // Проверяем условие перестройки: a_min + b_min < pi
-            if (a_min + min(b2, b3) < M_PI) {
-              // Меняем ребро p2 p3 на ребро p1 q3
-              p2 = q3;
-              q3 = p1;
-              // Вычисляем новые углы исходного и соседнего четырехугольников в радианах
-              a1 = angle(Edge(p1, p2), Edge(p4, p1));
-              a2 = angle(Edge(p2, p3), Edge(p1, p2));
-              a3 = angle(Edge(p3, p4), Edge(p2, p3));
-              a4 = angle(Edge(p4, p1), Edge(p3, p4));
-              b1 = angle(Edge(q1, q2), Edge(q4, q1));
-              b2 = angle(Edge(q2, q3), Edge(q1, q2));
-              b3 = angle(Edge(q3, q4), Edge(q2, q3));
-              b4 = angle(Edge(q4, q1), Edge(q3, q4));
-////////////////////////////////////////////////////////////////////////////////////////////////////////
-              b1 = angle(Edge(q1, q2), Edge(q4, q1));
-              b2 = angle(Edge(q2, q3), Edge(q1, q2));
-              b3 = angle(Edge(q3, q4), Edge(q2, q3));
-              b4 = angle(Edge(q4, q1), Edge(q3, q4));
-              // Вычисляем новые качества исходного и соседнего четырехугольников по метрике углов
-              double q_new = min(a1, min(a2, min(a3, a4))) / max(a1, max(a2, max(a3, a4)));
-              double r_new = min(b1, min(b2, min(b3, b4))) / max(b1, max(b2, max(b3, b4)));
-              // Если новые качества больше старых, то добавляем четырехугольники в очередь приоритетов с новыми качествами
-              if (q_new > q) {
-                pq.push({q_new, i});
-              }
-              if (r_new > r) {
-                pq.push({r_new, l});
-              }
-            }
-            break;
-          case 1: // Наименьший угол при вершине p2
-            // Проверяем условие перестройки: a_min + b_min < pi
-            if (a_min + min(b3, b4) < M_PI) {
-              // Меняем ребро p3 p4 на ребро p2 q4
-              p3 = q4;
-              q4 = p2;
-              // Вычисляем новые углы исходного и соседнего четырехугольников в радианах
-              a1 = angle(Edge(p1, p2), Edge(p4, p1));
-              a2 = angle(Edge(p2, p3), Edge(p1, p2));
-///////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Вычисляем новые углы исходного и соседнего четырехугольников в радианах
-              a1 = angle(Edge(p1, p2), Edge(p4, p1));
-              a2 = angle(Edge(p2, p3), Edge(p1, p2));
-              a3 = angle(Edge(p3, p4), Edge(p2, p3));
-              a4 = angle(Edge(p4, p1), Edge(p3, p4));
-              b1 = angle(Edge(q1, q2), Edge(q4, q1));
-              b2 = angle(Edge(q2, q3), Edge(q1, q2));
-              b3 = angle(Edge(q3, q4), Edge(q2, q3));
-              b4 = angle(Edge(q4, q1), Edge(q3, q4));
-              // Вычисляем новые качества исходного и соседнего четырехугольников по метрике углов
-              double q_new = min(a1, min(a2, min(a3, a4))) / max(a1, max(a2, max(a3, a4)));
-              double r_new = min(b1, min(b2, min(b3, b4))) / max(b1, max(b2, max(b3, b4)));
-              // Если новые качества больше старых, то добавляем четырехугольники в очередь приоритетов с новыми качествами
-              if (q_new > q) {
-                pq.push({q_new, i});
-              }
-              if (r_new > r) {
-                pq.push({r_new, l});
-              }
-            }
-            break;
-          case 2: // Наименьший угол при вершине p3
-            // Проверяем условие перестройки: a_min + b_min < pi
-            if (a_min + min(b4, b1) < M_PI) {
-              // Меняем ребро p4 p1 на ребро p3 q1
-              p4 = q1;
-              q1 = p3;
-              // Вычисляем новые углы исходного и соседнего четырехугольников в радианах
-/////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Меняем ребро p4 p1 на ребро p3 q1
-              p4 = q1;
-              q1 = p3;
-              // Вычисляем новые углы исходного и соседнего четырехугольников в радианах
-              a1 = angle(Edge(p1, p2), Edge(p4, p1));
-              a2 = angle(Edge(p2, p3), Edge(p1, p2));
-              a3 = angle(Edge(p3, p4), Edge(p2, p3));
-              a4 = angle(Edge(p4, p1), Edge(p3, p4));
-              b1 = angle(Edge(q1, q2), Edge(q4, q1));
-              b2 = angle(Edge(q2, q3), Edge(q1, q2));
-              b3 = angle(Edge(q3, q4), Edge(q2, q3));
-              b4 = angle(Edge(q4, q1), Edge(q3, q4));
-              // Вычисляем новые качества исходного и соседнего четырехугольников по метрике углов
-              double q_new = min(a1, min(a2, min(a3, a4))) / max(a1, max(a2, max(a3, a4)));
-              double r_new = min(b1, min(b2, min(b3, b4))) / max(b1, max(b2, max(b3, b4)));
-              // Если новые качества больше старых, то добавляем четырехугольники в очередь приоритетов с новыми качествами
-              if (q_new > q) {
-                pq.push({q_new, i});
-              }
-              if (r_new > r) {
-                pq.push({r_new, l});
-              }
-            }
-            break;
-          case 3: // Наименьший угол при вершине p4
-            // Проверяем условие перестройки: a_min + b_min < pi
-            if (a_min + min(b1, b2) < M_PI) {
-              // Меняем ребро p1 p2 на ребро p4 q2
-              p1 = q2;
-              q2 = p4;
-              // Вычисляем новые углы исходного и соседнего четырехугольников в радианах
-////////////////////////////////////////////////////////////////////////////////////
+      iov.clear();
+      for (int b = first; b < last; b++) {
+        string& text = buffers[b % window];
+        if (!text.empty()) iov.push_back({&text[0], text.size()});
+      }
+      write(iov);
+      {
+        lock_guard<mutex> guard(lock);
+        for (int b = first; b < last; b++) ready[b % window] = 0;
+        written = last;
+      }
+      freed.notify_all();
+    }
+    for (thread& th : pool) th.join();
+  }
+};
+
+// Функция для записи тела в файл формата NEU
+// Записи узлов и элементов форматируются блоками параллельно в threads потоках (0 - по числу ядер), а готовые блоки
+// записываются в файл по порядку одновременно с форматированием следующих; в памяти находится не больше двух блоков на поток
+// Результат побайтно совпадает с записью через поток вывода с setw
+// Возвращает false и описание ошибки в error, если файл не удалось записать
+bool write_neu(const string& filename, const Body& body, string& error, int threads = 0) {
+  // Открываем файл для записи
+  BlockWriter fout;
+  fout.fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fout.fd < 0) {
+    error = "cannot open file " + filename;
+    return false;
+  }
+  const Mesh& mesh = body.mesh;
+  const int chunk = 1 << 15; // Количество записей в одном блоке
+  // Записываем заголовок файла
+  string header;
+  header += "        CONTROL INFO\n";
+  header += "** GAMBIT NEUTRAL FILE\n";
+  header += "PROGRAM:                Bing\n";
+  header += "VERSION:                1.0\n";
+  header += string("Written by Bing on ") + __DATE__ + " at " + __TIME__ + "\n";
+  header += "     NUMNP     NELEM     NGRPS    NBSETS     NDFCD     NDFVL\n";
+  // Количество узлов и элементов в теле - каждый узел сетки записывается один раз
+  int numnp = mesh.nodes.size(); // Количество узлов
+  int nelem = mesh.quads.size(); // Количество элементов
+  // Записываем количество узлов и элементов в файл
+  char line[128];
+  char* e = line;
+  e = put_int(e, numnp, 10);
+  e = put_int(e, nelem, 10);
+  e = put_string(e, "1", 10);
+  e = put_string(e, "0", 10);
+  e = put_string(e, "3", 10);
+  e = put_string(e, "3\n", 10);
+  header.append(line, e);
+  header += "ENDOFSECTION\n";
+  // Записываем секцию узлов в файл
+  header += "   NODAL COORDINATES\n";
+  fout.write(header);
+  // Блоки по chunk узлов форматируются параллельно и записываются по мере готовности
+  fout.write((numnp + chunk - 1) / chunk, threads, [&](int t, string& b) {
+    int begin = t * chunk, end = min(numnp, begin + chunk);
+    b.resize((end - begin) * (10 + 3 * 32 + 1));
+    char* out = &b[0];
+    for (int i = begin; i < end; i++) {
+      // Записываем номер и координаты узла
+      const Point& point = mesh.nodes[i];
+      out = put_int(out, i + 1, 10);
+      out = put_double(out, point.x, 20);
+      out = put_double(out, point.y, 20);
+      out = put_double(out, point.z, 20);
+      *out++ = '\n';
+    }
+    b.resize(out - &b[0]);
+  });
+  fout.write(string("ENDOFSECTION\n") + "      ELEMENTS/CELLS\n");
+  // Записываем секцию элементов грань за гранью блоками из отрезков четырехугольников граней
+  vector<array<int, 3>> segments; // Отрезки (первый четырехугольник, количество, номер первого элемента)
+  int elem = 1; // Номер текущего элемента
+  for (const Face& face : body.faces) {
+    for (int i = 0; i < face.count; i += chunk) {
+      segments.push_back({face.first + i, min(chunk, face.count - i), elem});
+      elem += min(chunk, face.count - i);
+    }
+  }
+  fout.write(segments.size(), threads, [&](int t, string& b) {
+    const array<int, 3>& s = segments[t];
+    b.resize(s[1] * (20 + 1 + 4 * 24 + 1));
+    char* out = &b[0];
+    for (int k = 0; k < s[1]; k++) {
+      const array<int, 4>& q = mesh.quads[s[0] + k];
+      // Записываем номер и тип элемента
+      out = put_int(out, s[2] + k, 10);
+      out = put_string(out, "3", 10);
+      *out++ = '\n';
+      // Записываем номера узлов элемента (в формате NEU узлы нумеруются с единицы)
+      for (int j = 0; j < 4; j++) out = put_int(out, q[j] + 1, 10);
+      *out++ = '\n';
+    }
+    b.resize(out - &b[0]);
+  });
+  fout.write(string("ENDOFSECTION\n"));
+  // Закрываем файл
+  if (close(fout.fd) != 0 || fout.failed) {
+    error = "cannot write file " + filename;
+    return false;
+  }
+  return true;
+}
+
+// Функция для записи тела в файл формата NEU; при ошибке программа завершается
+void write_neu(const string& filename, const Body& body, int threads = 0) {
+  string error;
+  if (!write_neu(filename, body, error, threads)) {
+    cerr << "Error: " << error << endl;
+    exit(1);
+  }
+}
+
+// Формат QMB - двоичный файл сетки, который читается отображением в память без разбора
+// Файл состоит из заголовка и блоков фиксированной структуры: координаты узлов, вершины четырехугольников, номера граней
+// четырехугольников, таблица граней, узлы контуров граней и необязательный массив качества четырехугольников
+// Каждый блок выровнен на 64 байта, поэтому после отображения файла блоки используются как массивы напрямую
+// Числа записываются в порядке байтов процессора; поле order заголовка позволяет отвергнуть файл с другим порядком
+const char mesh_file_magic[8] = {'Q', 'M', 'B', 'M', 'E', 'S', 'H', 0}; // Сигнатура файла
+const uint32_t mesh_file_version = 1; // Версия формата
+const uint32_t mesh_file_order = 0x01020304; // Метка порядка байтов
+const uint32_t mesh_file_quality = 1; // Флаг наличия массива качества
+const size_t mesh_file_align = 64; // Выравнивание блоков
+
+// Структура заголовка файла QMB
+struct MeshFileHeader {
+  char magic[8]; // Сигнатура mesh_file_magic
+  uint32_t version; // Версия формата
+  uint32_t order; // Метка порядка байтов mesh_file_order
+  uint32_t flags; // Флаги необязательных блоков
+  uint32_t reserved; // Не используется
+  uint64_t nodes; // Количество узлов
+  uint64_t quads; // Количество четырехугольников
+  uint64_t faces; // Количество граней
+  uint64_t contour; // Суммарное количество узлов контуров граней
+  uint64_t node_offset; // Смещение блока координат узлов (Point)
+  uint64_t quad_offset; // Смещение блока вершин четырехугольников (4 x int32)
+  uint64_t owner_offset; // Смещение блока номеров граней четырехугольников (int32)
+  uint64_t face_offset; // Смещение таблицы граней (MeshFileFace)
+  uint64_t contour_offset; // Смещение блока узлов контуров (int32)
+  uint64_t quality_offset; // Смещение массива качества (double) или 0, если массива нет
+};
+
+// Структура записи грани в файле QMB
+struct MeshFileFace {
+  int32_t first; // Индекс первого четырехугольника грани
+  int32_t count; // Количество четырехугольников грани
+  int32_t contour_first; // Индекс первого узла контура в блоке контуров
+  int32_t contour_count; // Количество узлов контура
+  double a, b, c, d; // Коэффициенты плоскости грани
+};
+
+static_assert(sizeof(Point) == 3 * sizeof(double), "Point must be three packed doubles");
+static_assert(sizeof(array<int, 4>) == 4 * sizeof(int32_t), "quad must be four packed int32");
+static_assert(sizeof(MeshFileHeader) % 8 == 0 && sizeof(MeshFileFace) == 48, "unexpected padding in QMB records");
+
+// Функция для вычисления качества каждого четырехугольника сетки
+vector<double> mesh_quality(const Mesh& mesh) {
+  vector<double> q(mesh.quads.size());
+  quality_kernel(mesh, 0, mesh.quads.size(), nullptr, q.data());
+  return q;
+}
+
+// Функция для записи тела в двоичный файл формата QMB
+// Все блоки передаются в файл напрямую из массивов сетки несколькими большими вызовами writev;
+// with_quality добавляет в файл массив качества четырехугольников
+// Возвращает false и описание ошибки в error, если файл не удалось записать
+bool write_mesh_file(const string& filename, const Body& body, string& error, bool with_quality = false) {
+  // Открываем файл для записи
+  BlockWriter fout;
+  fout.fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fout.fd < 0) {
+    error = "cannot open file " + filename;
+    return false;
+  }
+  const Mesh& mesh = body.mesh;
+  // Составляем таблицу граней и общий блок контуров
+  vector<MeshFileFace> faces;
+  vector<int32_t> contour;
+  for (const Face& face : body.faces) {
+    MeshFileFace f;
+    f.first = face.first;
+    f.count = face.count;
+    f.contour_first = contour.size();
+    f.contour_count = face.contour.size();
+    f.a = face.pl.a;
+    f.b = face.pl.b;
+    f.c = face.pl.c;
+    f.d = face.pl.d;
+    faces.push_back(f);
+    contour.insert(contour.end(), face.contour.begin(), face.contour.end());
+  }
+  vector<double> q;
+  if (with_quality) q = mesh_quality(mesh);
+  // Заполняем заголовок и размещаем блоки друг за другом с выравниванием
+  MeshFileHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, mesh_file_magic, sizeof(h.magic));
+  h.version = mesh_file_version;
+  h.order = mesh_file_order;
+  h.flags = with_quality ? mesh_file_quality : 0;
+  h.nodes = mesh.nodes.size();
+  h.quads = mesh.quads.size();
+  h.faces = faces.size();
+  h.contour = contour.size();
+  static const char zeros[mesh_file_align] = {}; // Байты для заполнения промежутков между блоками
+  vector<iovec> iov;
+  size_t offset = 0; // Текущий размер файла
+  // Функция для добавления блока, возвращает его смещение в файле
+  auto add = [&](const void* p, size_t n) -> uint64_t {
+    size_t pad = (mesh_file_align - offset % mesh_file_align) % mesh_file_align;
+    if (pad > 0) iov.push_back({(void*)zeros, pad});
+    offset += pad;
+    uint64_t start = offset;
+    if (n > 0) iov.push_back({(void*)p, n});
+    offset += n;
+    return start;
+  };
+  add(&h, sizeof(h));
+  h.node_offset = add(mesh.nodes.data(), mesh.nodes.size() * sizeof(Point));
+  h.quad_offset = add(mesh.quads.data(), mesh.quads.size() * sizeof(array<int, 4>));
+  h.owner_offset = add(mesh.owner.data(), mesh.owner.size() * sizeof(int32_t));
+  h.face_offset = add(faces.data(), faces.size() * sizeof(MeshFileFace));
+  h.contour_offset = add(contour.data(), contour.size() * sizeof(int32_t));
+  if (with_quality) h.quality_offset = add(q.data(), q.size() * sizeof(double));
+  // Заголовок уже находится в списке блоков по адресу, поэтому записывается с заполненными смещениями
+  fout.write(iov);
+  // Закрываем файл
+  if (close(fout.fd) != 0 || fout.failed) {
+    error = "cannot write file " + filename;
+    return false;
+  }
+  return true;
+}
+
+// Функция для записи тела в двоичный файл формата QMB; при ошибке программа завершается
+void write_mesh_file(const string& filename, const Body& body, bool with_quality = false) {
+  string error;
+  if (!write_mesh_file(filename, body, error, with_quality)) {
+    cerr << "Error: " << error << endl;
+    exit(1);
+  }
+}
+
+// Структура для чтения файла QMB, отображенного в память
+// Блоки файла не копируются и не разбираются: указатели ссылаются прямо на отображенные страницы
+struct MeshFile {
+  const char* data = nullptr; // Содержимое файла
+  size_t size = 0; // Размер файла в байтах
+  const MeshFileHeader* header = nullptr; // Заголовок файла
+  const Point* nodes = nullptr; // Координаты узлов
+  const array<int, 4>* quads = nullptr; // Вершины четырехугольников
+  const int32_t* owner = nullptr; // Номера граней четырехугольников
+  const MeshFileFace* faces = nullptr; // Таблица граней
+  const int32_t* contour = nullptr; // Узлы контуров граней
+  const double* quality = nullptr; // Качество четырехугольников или nullptr, если массива нет в файле
+
+  MeshFile() {}
+  MeshFile(const MeshFile&) = delete;
+  MeshFile& operator=(const MeshFile&) = delete;
+  ~MeshFile() {
+    if (data) munmap((void*)data, size);
+  }
+
+  // Функция для проверки, что блок из count элементов размера item по смещению offset целиком лежит в файле и выровнен
+  bool block(uint64_t offset, uint64_t count, size_t item) const {
+    if (offset % 8 != 0 || offset > size) return false;
+    return count <= (size - offset) / item;
+  }
+
+  // Функция для открытия файла, возвращает false, если файл не удалось прочитать или он поврежден
+  bool open(const string& filename) {
+    if (!map_file(filename, data, size, MADV_WILLNEED)) return false;
+    if (size < sizeof(MeshFileHeader)) return false;
+    header = (const MeshFileHeader*)data;
+    const MeshFileHeader& h = *header;
+    if (memcmp(h.magic, mesh_file_magic, sizeof(h.magic)) != 0 || h.version != mesh_file_version || h.order != mesh_file_order) return false;
+    if (h.nodes > INT_MAX || h.quads > INT_MAX || h.faces > INT_MAX || h.contour > INT_MAX) return false;
+    if (!block(h.node_offset, h.nodes, sizeof(Point)) || !block(h.quad_offset, h.quads, sizeof(array<int, 4>)) ||
+        !block(h.owner_offset, h.quads, sizeof(int32_t)) || !block(h.face_offset, h.faces, sizeof(MeshFileFace)) ||
+        !block(h.contour_offset, h.contour, sizeof(int32_t)))
+      return false;
+    if ((h.flags & mesh_file_quality) && !block(h.quality_offset, h.quads, sizeof(double))) return false;
+    nodes = (const Point*)(data + h.node_offset);
+    quads = (const array<int, 4>*)(data + h.quad_offset);
+    owner = (const int32_t*)(data + h.owner_offset);
+    faces = (const MeshFileFace*)(data + h.face_offset);
+    contour = (const int32_t*)(data + h.contour_offset);
+    if (h.flags & mesh_file_quality) quality = (const double*)(data + h.quality_offset);
+    // Проверяем только таблицу граней, чтобы диапазоны четырехугольников и контуров не выходили за блоки
+    for (uint64_t i = 0; i < h.faces; i++) {
+      const MeshFileFace& f = faces[i];
+      if (f.first < 0 || f.count < 0 || (uint64_t)f.first + f.count > h.quads) return false;
+      if (f.contour_first < 0 || f.contour_count < 0 || (uint64_t)f.contour_first + f.contour_count > h.contour) return false;
+    }
+    return true;
+  }
+};
+
+// Функция для копирования сетки из отображенного файла QMB в тело
+void load_body(const MeshFile& file, Body& body) {
+  const MeshFileHeader& h = *file.header;
+  Mesh& mesh = body.mesh; // Массивы сетки копируются в источник памяти тела одним выделением каждый
+  mesh.nodes.assign(file.nodes, file.nodes + h.nodes);
+  mesh.quads.assign(file.quads, file.quads + h.quads);
+  mesh.owner.assign(file.owner, file.owner + h.quads);
+  for (uint64_t i = 0; i < h.faces; i++) {
+    const MeshFileFace& f = file.faces[i];
+    Face face;
+    face.contour.assign(file.contour + f.contour_first, file.contour + f.contour_first + f.contour_count);
+    face.first = f.first;
+    face.count = f.count;
+    // Плоскость грани берется из файла, а не вычисляется заново по контуру
+    face.pl.a = f.a;
+    face.pl.b = f.b;
+    face.pl.c = f.c;
+    face.pl.d = f.d;
+    body.faces.push_back(move(face));
+  }
+}
+
+// Функция для создания тела по файлу QMB в новой арене задания
+Body load_body(const MeshFile& file) {
+  Body body(make_shared<Arena>());
+  load_body(file, body);
+  return body;
+}
+
+// Функция для чтения тела из файла формата QMB в пустое тело body
+// Возвращает false и описание ошибки в error, если файл не удалось прочитать
+bool read_mesh_file(const string& filename, Body& body, string& error) {
+  MeshFile file;
+  if (!file.open(filename)) {
+    error = "cannot read mesh file " + filename;
+    return false;
+  }
+  load_body(file, body);
+  return true;
+}
+
+// Функция для чтения тела из файла формата QMB; при ошибке программа завершается
+Body read_mesh_file(const string& filename) {
+  Body body(make_shared<Arena>());
+  string error;
+  if (!read_mesh_file(filename, body, error)) {
+    cerr << "Error: " << error << endl;
+    exit(1);
+  }
+  return body;
+}
+
+// Функция для чтения тела из файла формата NEU
+// Понимает записи элементов в виде, который выдает write_neu (номер и тип 3 на одной строке, четыре узла на следующей),
+// и в стандартном виде GAMBIT (номер, тип, количество узлов и узлы); читаются только четырехугольники - элементы типа 2
+// с четырьмя узлами (и записи write_neu), остальные элементы, в том числе тетраэдры с четырьмя узлами, пропускаются
+// В файле NEU нет разбиения на грани, поэтому все четырехугольники относятся к одной грани без контура
+// Номера узлов должны быть от 1 до NUMNP (без заголовка - не больше, чем строк может поместиться в файле), и каждый
+// узел должен быть задан. Тело читается в пустое тело body; возвращает false и описание ошибки в error, если файл
+// не удалось прочитать или номера узлов неверны. Сообщение о пропущенных элементах добавляется в warnings
+bool read_neu(const string& filename, Body& body, string& error, vector<string>& warnings) {
+  const char* data;
+  size_t size;
+  if (!map_file(filename, data, size, MADV_SEQUENTIAL)) {
+    error = "cannot open file " + filename;
+    return false;
+  }
+  const char* s = data; // Текущая позиция
+  const char* end = data + size; // Конец файла
+  // Функция для получения очередной строки файла без символов конца строки
+  auto next_line = [&](string_view& line) -> bool {
+    if (s >= end) return false;
+    const char* nl = (const char*)memchr(s, '\n', end - s);
+    const char* e = nl ? nl : end;
+    line = string_view(s, e - s);
+    if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    s = nl ? nl + 1 : end;
+    return true;
+  };
+  // Функция для разбиения строки на лексемы, разделенные пробелами
+  auto split = [](string_view line, vector<string_view>& tokens) {
+    tokens.clear();
+    size_t i = 0;
+    while (true) {
+      while (i < line.size() && (line[i] == ' ' || line[i] == '\t')) i++;
+      if (i == line.size()) break;
+      size_t j = i;
+      while (j < line.size() && line[j] != ' ' && line[j] != '\t') j++;
+      tokens.push_back(line.substr(i, j - i));
+      i = j;
+    }
+  };
+  // Функции для чтения чисел из лексемы
+  auto to_int = [](string_view t) {
+    int value = 0;
+    from_chars(t.data(), t.data() + t.size(), value);
+    return value;
+  };
+  auto to_double = [](string_view t) {
+    double value = 0;
+    if (!t.empty() && t[0] == '+') t.remove_prefix(1);
+    from_chars(t.data(), t.data() + t.size(), value);
+    return value;
+  };
+  Mesh& mesh = body.mesh;
+  string_view line;
+  vector<string_view> tokens;
+  bool skipped = false; // Признак пропущенных элементов, не являющихся четырехугольниками
+  // Строка узла или элемента занимает не меньше 8 байт, поэтому числа из файла, превышающие это ограничение, неверны
+  // и не приводят к выделению памяти не по размеру файла
+  const int lines = min<size_t>(size / 8, numeric_limits<int>::max());
+  int numnp = -1; // Количество узлов из заголовка или -1, если заголовка нет
+  vector<char> seen; // Узел задан в секции координат
+  bool failed = false;
+  while (!failed && next_line(line)) {
+    if (line.find("NUMNP") != string_view::npos && next_line(line)) {
+      split(line, tokens);
+      if (tokens.size() >= 2) {
+        numnp = to_int(tokens[0]);
+        int nelem = to_int(tokens[1]);
+        if (numnp < 0 || numnp > lines || nelem < 0 || nelem > lines) {
+          error = "node or element count in the header does not match the size of " + filename;
+          failed = true;
+        } else {
+          mesh.nodes.reserve(numnp);
+          mesh.quads.reserve(nelem);
+          mesh.owner.reserve(nelem);
+        }
+      }
+    } else if (line.find("NODAL COORDINATES") != string_view::npos) {
+      // Строка узла: номер и три координаты; номера узлов начинаются с единицы
+      int limit = numnp >= 0 ? numnp : lines;
+      while (next_line(line) && line.find("ENDOFSECTION") == string_view::npos) {
+        split(line, tokens);
+        if (tokens.size() < 4) continue;
+        int id = to_int(tokens[0]);
+        if (id < 1 || id > limit) {
+          error = "node number " + string(tokens[0]) + " is out of range in " + filename;
+          failed = true;
+          break;
+        }
+        if (id > (int)mesh.nodes.size()) {
+          mesh.nodes.resize(id);
+          seen.resize(id, 0);
+        }
+        mesh.nodes[id - 1] = Point(to_double(tokens[1]), to_double(tokens[2]), to_double(tokens[3]));
+        seen[id - 1] = 1;
+      }
+    } else if (line.find("ELEMENTS/CELLS") != string_view::npos) {
+      vector<int> ids; // Номера узлов текущего элемента
+      int need = -1; // Количество узлов, которое осталось прочитать для текущего элемента, -1 - ожидается новый элемент
+      bool quad = false; // Текущий элемент - четырехугольник
+      while (next_line(line) && line.find("ENDOFSECTION") == string_view::npos) {
+        split(line, tokens);
+        if (tokens.empty()) continue;
+        size_t k = 0;
+        if (need < 0) {
+          // Начало элемента: номер, тип и (в стандартном виде) количество узлов; у записей write_neu узлов четыре
+          ids.clear();
+          int type = tokens.size() >= 2 ? to_int(tokens[1]) : -1;
+          need = tokens.size() >= 3 ? to_int(tokens[2]) : 4;
+          quad = tokens.size() >= 3 ? type == 2 && need == 4 : type == 2 || type == 3;
+          k = min<size_t>(tokens.size(), 3);
+        }
+        for (; k < tokens.size() && need > 0; k++, need--) ids.push_back(to_int(tokens[k]) - 1);
+        if (need == 0) {
+          if (quad) add_quad(mesh, ids[0], ids[1], ids[2], ids[3], 0);
+          else skipped = true;
+          need = -1;
+        }
+      }
+    }
+  }
+  munmap((void*)data, size);
+  if (failed) return false;
+  // Все узлы от 1 до NUMNP (или до наибольшего номера) должны быть заданы
+  if (numnp > (int)mesh.nodes.size()) seen.resize(numnp, 0);
+  int missing = find(seen.begin(), seen.end(), 0) - seen.begin();
+  if (missing < (int)seen.size()) {
+    error = "node " + to_string(missing + 1) + " is missing in " + filename;
+    return false;
+  }
+  if (skipped) warnings.push_back("non-quadrilateral elements skipped in " + filename);
+  // Проверяем, что все элементы ссылаются на существующие узлы
+  for (const array<int, 4>& q : mesh.quads) {
+    for (int v : q) {
+      if (v < 0 || v >= (int)mesh.nodes.size()) {
+        error = "element references missing node in " + filename;
+        return false;
+      }
+    }
+  }
+  body.faces.push_back(Face(mesh.nodes, vector<int>(), 0, mesh.quads.size()));
+  return true;
+}
+
+// Функция для чтения тела из файла формата NEU; предупреждения выводятся в cerr, при ошибке программа завершается
+Body read_neu(const string& filename) {
+  Body body(make_shared<Arena>());
+  string error;
+  vector<string> warnings;
+  bool ok = read_neu(filename, body, error, warnings);
+  for (const string& w : warnings) cerr << "Warning: " << w << endl;
+  if (!ok) {
+    cerr << "Error: " << error << endl;
+    exit(1);
+  }
+  return body;
+}
+
+// Функция для преобразования файла NEU в файл QMB
+void neu_to_mesh_file(const string& neu, const string& qmb, bool with_quality = false) {
+  write_mesh_file(qmb, read_neu(neu), with_quality);
+}
+
+// Функция для преобразования файла QMB в файл NEU
+void mesh_file_to_neu(const string& qmb, const string& neu, int threads = 0) {
+  write_neu(neu, read_mesh_file(qmb), threads);
+}
+
+// Структура для хранения смежности четырехугольников грани через полуребра
+// Полуребро 4 * i + k - это ребро k четырехугольника i (из вершины k в вершину k + 1)
+// Таблица строится один раз для грани и обновляется при каждом повороте ребра, поэтому поиск соседа выполняется за O(1)
+struct Adjacency {
+  int first; // Индекс первого четырехугольника грани в сетке тела
+  pmr::vector<int> twin; // Противоположное полуребро соседнего четырехугольника или -1, если ребро лежит на границе грани
+  Adjacency(int first = 0, int count = 0, pmr::memory_resource* memory = pmr::get_default_resource())
+      : first(first), twin(4 * count, -1, memory) {}
+  // Ссылка на противоположное полуребро для полуребра k четырехугольника i
+  int& operator()(int i, int k) {
+    return twin[4 * (i - first) + k];
+  }
+};
+
+// Функция для построения таблицы смежности четырехугольников грани по индексам узлов, таблица размещается в memory
+Adjacency build_adjacency(const Mesh& mesh, const Face& face, pmr::memory_resource* memory = pmr::get_default_resource()) {
+  Adjacency adj(face.first, face.count, memory);
+  // Ключ полуребра - пара индексов его начала и конца; словарь размещается в арене потока и освобождается при выходе
+  ScratchScope scope;
+  pmr::unordered_map<long long, int> half_edges(&scope.arena); // Полуребра, для которых еще не найдена пара
+  half_edges.reserve(4 * face.count);
+  for (int i = face.first; i < face.first + face.count; i++) {
+    for (int k = 0; k < 4; k++) {
+      long long a = mesh.quads[i][k]; // Начало ребра
+      long long b = mesh.quads[i][(k + 1) % 4]; // Конец ребра
+      // У соседа с тем же направлением обхода общее ребро проходится в обратном направлении
+      auto it = half_edges.find((b << 32) | a);
+      if (it != half_edges.end()) {
+        adj(i, k) = it->second;
+        adj.twin[it->second - 4 * face.first] = 4 * i + k;
+        half_edges.erase(it);
+      } else {
+        half_edges[(a << 32) | b] = 4 * i + k;
+      }
+    }
+  }
+  return adj;
+}
+
+// Функция для поиска соседнего четырехугольника грани, разделяющего ребро k четырехугольника i (из вершины k в вершину k + 1)
+// Возвращает индекс соседа или -1, если ребро лежит на границе; в m записывается номер общего ребра у соседа
+int find_neighbour(Adjacency& adj, int i, int k, int& m) {
+  QM_STAT_ADD(neighbour_searches, 1);
+  int t = adj(i, k); // Противоположное полуребро
+  if (t == -1) return -1;
+  m = t % 4;
+  return t / 4;
+}
+
+// Функция для получения вершин шестиугольника, образованного двумя соседними четырехугольниками
+// Ребро k четырехугольника i совпадает с ребром m четырехугольника l, пройденным в обратном направлении
+// Вершины перечисляются в порядке обхода, общее ребро соединяет вершины h[0] и h[3]
+void hexagon(const Mesh& mesh, int i, int k, int l, int m, int h[6]) {
+  const array<int, 4>& a = mesh.quads[i];
+  const array<int, 4>& b = mesh.quads[l];
+  h[0] = a[(k + 1) % 4];
+  h[1] = a[(k + 2) % 4];
+  h[2] = a[(k + 3) % 4];
+  h[3] = a[k];
+  h[4] = b[(m + 2) % 4];
+  h[5] = b[(m + 3) % 4];
+}
+
+// Функция для получения четырехугольников, которые получатся после поворота общего ребра шестиугольника
+// При dir = 1 ребро поворачивается против часовой стрелки и соединяет вершины h[1] и h[4], при dir = -1 - по часовой стрелке и соединяет h[5] и h[2]
+void rotated(const int h[6], int dir, array<int, 4>& a, array<int, 4>& b) {
+  int s = (dir > 0) ? 1 : 5;
+  a = {h[s % 6], h[(s + 1) % 6], h[(s + 2) % 6], h[(s + 3) % 6]};
+  b = {h[(s + 3) % 6], h[(s + 4) % 6], h[(s + 5) % 6], h[s % 6]};
+}
+
+// Функция для поворота общего ребра двух соседних четырехугольников внутри образованного ими шестиугольника
+// Таблица смежности грани обновляется только для ребер шестиугольника и нового общего ребра
+void swap_edge(Mesh& mesh, Adjacency& adj, int i, int k, int l, int m, int dir) {
+  int h[6];
+  hexagon(mesh, i, k, l, m, h);
+  // Запоминаем противоположные полуребра для сторон шестиугольника h[e] h[e + 1]
+  int outer[6] = {adj(i, (k + 1) % 4), adj(i, (k + 2) % 4), adj(i, (k + 3) % 4),
+                  adj(l, (m + 1) % 4), adj(l, (m + 2) % 4), adj(l, (m + 3) % 4)};
+  rotated(h, dir, mesh.quads[i], mesh.quads[l]);
+  // Ребра 0..2 нового четырехугольника i - стороны шестиугольника, начиная с s, ребра 0..2 четырехугольника l - начиная с s + 3
+  int s = (dir > 0) ? 1 : 5;
+  for (int j = 0; j < 3; j++) {
+    int e1 = outer[(s + j) % 6];
+    int e2 = outer[(s + 3 + j) % 6];
+    adj(i, j) = e1;
+    adj(l, j) = e2;
+    if (e1 != -1) adj.twin[e1 - 4 * adj.first] = 4 * i + j;
+    if (e2 != -1) adj.twin[e2 - 4 * adj.first] = 4 * l + j;
+  }
+  // Ребро 3 обоих четырехугольников - новое общее ребро
+  adj(i, 3) = 4 * l + 3;
+  adj(l, 3) = 4 * i + 3;
+}
+
+// Структура индексированной очереди с приоритетом (двоичная куча по минимуму) для элементов 0..n-1
+// Каждый элемент находится в очереди не более одного раза, а его ключ можно уменьшить или увеличить на месте
+struct IndexedHeap {
+  pmr::vector<int> heap; // Элементы в порядке двоичной кучи
+  pmr::vector<int> pos; // Позиция элемента в куче или -1, если элемента нет в очереди
+  pmr::vector<double> key; // Ключ каждого элемента
+
+  IndexedHeap(int n = 0, pmr::memory_resource* memory = pmr::get_default_resource()) : heap(memory), pos(n, -1, memory), key(n, memory) {
+    heap.reserve(n);
+  }
+
+  bool empty() const {
+    return heap.empty();
+  }
+  bool contains(int e) const {
+    return pos[e] >= 0;
+  }
+  // Элемент с наименьшим ключом
+  int top() const {
+    return heap[0];
+  }
+  double top_key() const {
+    return key[heap[0]];
+  }
+
+  // Функция для перестановки двух позиций кучи
+  void swap_at(int a, int b) {
+    swap(heap[a], heap[b]);
+    pos[heap[a]] = a;
+    pos[heap[b]] = b;
+  }
+  // Функция для подъема элемента с позиции k к вершине кучи
+  void sift_up(int k) {
+    while (k > 0 && key[heap[k]] < key[heap[(k - 1) / 2]]) {
+      swap_at(k, (k - 1) / 2);
+      k = (k - 1) / 2;
+    }
+  }
+  // Функция для опускания элемента с позиции k к листьям кучи
+  void sift_down(int k) {
+    int n = heap.size();
+    while (true) {
+      int c = 2 * k + 1;
+      if (c >= n) break;
+      if (c + 1 < n && key[heap[c + 1]] < key[heap[c]]) c++;
+      if (!(key[heap[c]] < key[heap[k]])) break;
+      swap_at(k, c);
+      k = c;
+    }
+  }
+
+  // Функция для добавления элемента в очередь или изменения его ключа, если он уже в очереди
+  void update(int e, double k) {
+    key[e] = k;
+    if (pos[e] < 0) {
+      QM_STAT_ADD(queue_pushes, 1);
+      pos[e] = heap.size();
+      heap.push_back(e);
+      sift_up(pos[e]);
+    } else {
+      sift_up(pos[e]);
+      sift_down(pos[e]);
+    }
+  }
+
+  // Функция для извлечения элемента с наименьшим ключом
+  int pop() {
+    QM_STAT_ADD(queue_pops, 1);
+    int e = heap[0];
+    swap_at(0, heap.size() - 1);
+    heap.pop_back();
+    pos[e] = -1;
+    if (!heap.empty()) sift_down(0);
+    return e;
+  }
+
+  // Функция для удаления элемента из очереди, если он в ней есть
+  void erase(int e) {
+    int k = pos[e];
+    if (k < 0) return;
+    swap_at(k, heap.size() - 1);
+    heap.pop_back();
+    pos[e] = -1;
+    if (k < (int)heap.size()) {
+      int moved = heap[k]; // Последний элемент, перенесенный на место удаленного
+      sift_up(k);
+      sift_down(pos[moved]);
+    }
+  }
+
+  // Функция для увеличения количества элементов до n; новые элементы не находятся в очереди
+  void resize(int n) {
+    pos.resize(n, -1);
+    key.resize(n);
+  }
+};
+
+// Структура для хранения косинусов углов и качества четырехугольников грани (структура массивов)
+// Значения вычисляются один раз для всей грани, а затем обновляются только для четырехугольников, измененных поворотом ребра
+struct QualityCache {
+  int first; // Индекс первого четырехугольника грани в сетке тела
+  pmr::vector<double> c[4]; // Косинусы углов при вершинах 0..3 четырехугольников
+  pmr::vector<double> q; // Качество четырехугольников
+
+  QualityCache(const Mesh& mesh, const Face& face, pmr::memory_resource* memory = pmr::get_default_resource())
+      : first(face.first), c{pmr::vector<double>(memory), pmr::vector<double>(memory), pmr::vector<double>(memory), pmr::vector<double>(memory)},
+        q(face.count, memory) {
+    double* cs[4];
+    for (int k = 0; k < 4; k++) {
+      c[k].resize(face.count);
+      cs[k] = c[k].data();
+    }
+    quality_kernel(mesh, face.first, face.count, cs, q.data());
+  }
+
+  // Угол при вершине k четырехугольника i в радианах
+  double angle(int i, int k) const {
+    return fast_acos(c[k][i - first]);
+  }
+  // Функция для пересчета косинуса угла при вершине k четырехугольника i
+  void update_corner(const Mesh& mesh, int i, int k) {
+    const array<int, 4>& v = mesh.quads[i];
+    c[k][i - first] = corner_cosine(mesh.nodes[v[(k + 3) % 4]], mesh.nodes[v[k]], mesh.nodes[v[(k + 1) % 4]]);
+  }
+  // Функция для пересчета качества четырехугольника i по сохраненным косинусам
+  void update_quality(int i) {
+    int t = i - first;
+    q[t] = quality_from_cosines(c[0][t], c[1][t], c[2][t], c[3][t]);
+  }
+  // Функция для полного пересчета четырехугольника i
+  void update_quad(const Mesh& mesh, int i) {
+    for (int k = 0; k < 4; k++) update_corner(mesh, i, k);
+    update_quality(i);
+  }
+};
+
+// Функция для улучшения сетки одной грани перестройкой вогнутых четырехугольников
+// Грань изменяет только свои четырехугольники и не перемещает узлы, поэтому разные грани можно обрабатывать одновременно
+// Улучшаются четырехугольники с качеством ниже threshold; узлы сглаживаются отдельно для всего тела (см. smooth_mesh)
+void improve_face(Body& body, int f, double threshold = 0.8) {
+  Mesh& mesh = body.mesh;
+  Face& face = body.faces[f]; // Ссылка на грань
+  // Все рабочие массивы грани размещаются в арене потока и освобождаются разом при выходе
+  ScratchScope scope;
+  pmr::memory_resource* scratch = &scope.arena;
+  // Строим таблицу смежности четырехугольников грани один раз
+  Adjacency adj = [&] {
+    QM_STAT_TIMER(adjacency_ns);
+    return build_adjacency(mesh, face, scratch);
+  }();
+  // Шаг 2: Определяем качество каждого четырехугольника грани по метрике углов
+  QualityCache cache = [&] {
+    QM_STAT_TIMER(quality_ns);
+    return QualityCache(mesh, face, scratch); // Косинусы углов и качество четырехугольников грани
+  }();
+  // Шаг 3: Создаем очередь четырехугольников грани по возрастанию их качества
+  // Очередь индексирована номером четырехугольника в грани, поэтому в ней нет устаревших записей
+  IndexedHeap pq(face.count, scratch);
+  for (int i = 0; i < face.count; i++) {
+    pq.update(i, cache.q[i]); // Добавляем четырехугольник с его качеством в очередь
+  }
+  // Шаг 4: Пока очередь не пуста и качество наиболее низкого четырехугольника меньше заданного порога, выполняем следующее:
+  while (!pq.empty() && pq.top_key() < threshold) {
+    // Извлекаем наиболее низкое качество и соответствующий индекс из очереди
+    double q = pq.top_key();
+    int i = face.first + pq.pop();
+    // Находим вершины четырехугольника
+    array<int, 4>& v = mesh.quads[i]; // Индексы вершин четырехугольника
+    // Берем четыре угла четырехугольника в радианах из сохраненных косинусов
+    double a[4];
+    for (int t = 0; t < 4; t++) a[t] = cache.angle(i, t);
+    // Шаг 4.1: Проверяем, является ли четырехугольник вогнутым
+    // Для этого вычисляем точные знаки ориентации его углов: у вогнутого (или самопересекающегося) четырехугольника
+    // углы обходятся в разные стороны
+    int pos, neg; // Количество углов с положительной и отрицательной ориентацией
+    corner_orientations(mesh, v, quad_normal(mesh, v), pos, neg);
+    bool concave = pos > 0 && neg > 0; // Четырехугольник вогнутый, если знаки ориентации углов различаются
+    // Шаг 4.2: Если четырехугольник вогнутый, то применяем к нему операцию перестройки
+    if (concave) {
+      QM_STAT_TIMER(swap_ns);
+      // Операция перестройки: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
+      // Находим индекс наименьшего угла четырехугольника
+      int k = 0; // Индекс наименьшего угла
+      double a_min = a[0]; // Значение наименьшего угла
+      for (int t = 1; t < 4; t++) {
+        if (a[t] < a_min) {
+          k = t;
+          a_min = a[t];
+        }
+      }
+      // Находим соседний четырехугольник, разделяющий ребро, выходящее из вершины с наименьшим углом
+      int m; // Номер общего ребра у соседнего четырехугольника
+      int l = find_neighbour(adj, i, k, m); // Индекс соседнего четырехугольника
+      // Если соседний четырехугольник найден, то выполняем операцию перестройки
+      if (l != -1) {
+        // Берем углы соседнего четырехугольника в радианах и его качество из сохраненных значений
+        double b[4];
+        for (int t = 0; t < 4; t++) b[t] = cache.angle(l, t);
+        double r = cache.q[l - face.first];
+        // Проверяем условие перестройки: a_min + b_min < pi, где b_min - наименьший угол соседа на концах общего ребра
+        if (a_min + min(b[m], b[(m + 1) % 4]) < M_PI) {
+          int h[6]; // Вершины шестиугольника, образованного парой четырехугольников
+          hexagon(mesh, i, k, l, m, h);
+          double best = min(q, r); // Наименьшее качество пары до перестройки
+          int best_dir = 0; // Лучшее направление поворота ребра (0 - не поворачивать)
+          double q_best = q, r_best = r;
+          // Если вершины шестиугольника повторяются (у пары больше одного общего ребра), поворот ребра дал бы вырожденные четырехугольники
+          bool simple = true;
+          for (int s = 0; s < 6; s++) {
+            for (int t = s + 1; t < 6; t++) simple = simple && h[s] != h[t];
+          }
+          // Ориентация пары - преобладающий знак ориентации углов обоих четырехугольников в проекции вдоль их общей нормали
+          Vector n = quad_normal(mesh, v) + quad_normal(mesh, mesh.quads[l]);
+          int pos_l, neg_l;
+          corner_orientations(mesh, v, n, pos, neg);
+          corner_orientations(mesh, mesh.quads[l], n, pos_l, neg_l);
+          int sign = pos + pos_l >= neg + neg_l ? 1 : -1;
+          // Функция для проверки, что все углы четырехугольника после поворота ориентированы так же, как пара
+          auto valid = [&](const array<int, 4>& r) {
+            int p, m;
+            corner_orientations(mesh, r, n, p, m);
+            return sign > 0 ? p == 4 : m == 4;
+          };
+          // Пробуем повернуть общее ребро в обоих направлениях, не изменяя сетку
+          if (simple) QM_STAT_ADD(swap_attempts, 1);
+          for (int dir = -1; dir <= 1 && simple; dir += 2) {
+            array<int, 4> qa, qb; // Четырехугольники после поворота ребра
+            rotated(h, dir, qa, qb);
+            // Поворот допустим, только если оба новых четырехугольника выпуклые
+            if (!valid(qa) || !valid(qb)) continue;
+            // Вычисляем новые качества исходного и соседнего четырехугольников по метрике углов
+            double q_new = quad_quality(mesh, qa);
+            double r_new = quad_quality(mesh, qb);
+            if (min(q_new, r_new) > best) {
+              best = min(q_new, r_new);
+              best_dir = dir;
+              q_best = q_new;
+              r_best = r_new;
+            }
+          }
+          if (best_dir != 0) {
+            swap_edge(mesh, adj, i, k, l, m, best_dir);
+            QM_STAT_ADD(edge_swaps, 1);
+            cache.update_quad(mesh, i);
+            cache.update_quad(mesh, l);
+            // Если новое качество больше старого, то возвращаем четырехугольник в очередь с новым качеством
+            if (q_best > q) {
+              pq.update(i - face.first, q_best);
+            }
+            // Ключ соседа, еще ожидающего в очереди, заменяем его новым качеством
+            if (pq.contains(l - face.first) || r_best > r) {
+              pq.update(l - face.first, r_best);
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Функция для вычисления кода Мортона ячейки (x, y, z) с координатами до 2^21: биты координат чередуются, поэтому
+// близкие ячейки получают близкие коды
+inline uint64_t morton_code(uint64_t x, uint64_t y, uint64_t z) {
+  auto spread = [](uint64_t v) {
+    v &= 0x1fffff;
+    v = (v | v << 32) & 0x1f00000000ffffULL;
+    v = (v | v << 16) & 0x1f0000ff0000ffULL;
+    v = (v | v << 8) & 0x100f00f00f00f00fULL;
+    v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+    v = (v | v << 2) & 0x1249249249249249ULL;
+    return v;
+  };
+  return spread(x) | spread(y) << 1 | spread(z) << 2;
+}
+
+// Функция для вычисления угла от луча o a до луча o b против часовой стрелки на плоскости z = 0, в радианах от 0 до 2 * pi
+double angle_ccw(const Point& a, const Point& o, const Point& b) {
+  double ux = a.x - o.x, uy = a.y - o.y;
+  double vx = b.x - o.x, vy = b.y - o.y;
+  double t = atan2(ux * vy - uy * vx, ux * vx + uy * vy);
+  return t < 0 ? t + 2 * M_PI : t;
+}
+
+// Ограничения локальных операций алгоритма Q-Morph. Каждая операция меняет сетку только вокруг одного-двух узлов
+// или внутри одного четырехугольника, поэтому рабочие массивы имеют постоянный размер, а время шага не зависит
+// от размера грани. Превышение ограничения означает сильно неравномерную или испорченную сетку: операция
+// отказывается, не меняя сетку, и фронт переходит к другому ребру
+const int qmorph_valence = 32; // Наибольшее количество элементов вокруг сглаживаемого узла: в фоновой сетке у узла около 6 треугольников, на фронте - до 12
+const int qmorph_patch = 64; // Наибольшее количество элементов, заменяемых одной операцией: склейка шва заменяет все элементы вокруг узла
+const int qmorph_fan = 64; // Наибольшее количество треугольников веера при конце ребра фронта - столько же, сколько элементов в одной замене
+const int qmorph_quad_triangles = 32; // Наибольшее количество треугольников внутри нового четырехугольника: его стороны не длиннее нескольких ребер фона
+const int qmorph_recover_flips = 64; // Наибольшее количество поворотов при восстановлении ребра: ребро пересекает не больше нескольких рядов треугольников
+const int qmorph_side_rounds = 4; // Количество попыток выбрать боковые ребра четырехугольника: каждая может один раз изменить сетку у обоих концов
+const int qmorph_walk = 1024; // Наибольшая длина обхода вокруг узла и вдоль фронта; защищает от зацикливания на испорченной сетке
+const int qmorph_attempts = 3; // Количество неудачных попыток построить четырехугольник на ребре, после которых оно исключается из очереди
+const int qmorph_steps = 8; // Наибольшее количество шагов продвижения фронта на элемент фоновой сетки: каждое ребро фронта
+                            // обрабатывается не больше qmorph_attempts раз, а каждый шаг поглощает хотя бы один треугольник
+const int qmorph_chain = 4096; // Наибольшее количество состояний поиска цепочки при перемещении треугольника: почти
+                               // у всех оставшихся треугольников пара находится в нескольких элементах от них, а для
+                               // остальных путь ищется без ограничения, но с добавлением узлов (drive_triangle)
+const int qmorph_detours = 8; // Количество элементов, которые обходит путь переноса треугольника после неудачных шагов:
+                              // неудача означает вырожденную область, и обойти ее удается за несколько попыток
+const int qmorph_merge_rounds = 12; // Количество раундов перемещения оставшихся треугольников со сглаживанием узлов между
+                                    // раундами; если треугольники остались и после них, грань сохраняет исходную сетку
+
+// Структура смешанной сетки грани из треугольников и четырехугольников для алгоритма Q-Morph
+// Элемент e - треугольник (elem[e][3] = -1) или четырехугольник с вершинами в порядке обхода против часовой стрелки
+// Полуребро 4 * e + k - ребро из вершины k элемента e в следующую вершину; twin - противоположное полуребро соседнего
+// элемента или -1 на границе грани, как в таблице Adjacency. Узлы лежат на плоскости z = 0: это параметры поверхности,
+// приведенные к длинам на ней, или проекция на плоскость грани
+// Фронт - полуребра треугольников, за которыми лежит четырехугольник или граница грани; треугольники лежат слева от фронта
+struct QMorphMesh {
+  pmr::vector<Point> xy; // Координаты узлов на плоскости
+  pmr::vector<Point> pos; // Положение узлов в пространстве
+  pmr::vector<int> global; // Индекс узла в сетке тела или -1 для нового узла
+  pmr::vector<char> locked; // Узлы границы грани не перемещаются и не удаляются
+  pmr::vector<char> moved; // Узел тела перемещен при закрытии шва
+  pmr::vector<int> level; // Номер ряда, в котором узел вошел во фронт, или -1
+  pmr::vector<int> node_he; // Полуребро живого элемента, выходящее из узла, или -1, если узел удален
+  pmr::vector<array<int, 4>> elem; // Вершины элементов
+  pmr::vector<int> twin; // Противоположные полуребра
+  pmr::vector<char> dead; // Элемент удален
+  IndexedHeap front; // Очередь ребер фронта по номеру ряда, количеству острых углов при концах и длине
+  pmr::unordered_map<long long, int> fails; // Количество неудачных попыток построить четырехугольник на ребре фронта (ключ - пара узлов)
+  pmr::vector<char> visits; // Количество посещений элементов при поиске цепочки в move_triangle; вне поиска - нули
+  pmr::vector<int> reached; // Полуребра пути, найденного find_path; вне переноса треугольника - -1
+  double length = 1; // Характерная длина ребер грани
+  bool advancing = true; // Фронт продвигается: очередь обновляется при каждом изменении сетки
+
+  QMorphMesh(pmr::memory_resource* memory)
+      : xy(memory), pos(memory), global(memory), locked(memory), moved(memory), level(memory), node_he(memory), elem(memory), twin(memory),
+        dead(memory), front(0, memory), fails(memory), visits(memory), reached(memory) {}
+
+  // Функция для резервирования памяти под nodes узлов и elements элементов
+  void reserve(int nodes, int elements) {
+    for (auto* a : {&xy, &pos}) a->reserve(nodes);
+    for (auto* a : {&global, &level, &node_he}) a->reserve(nodes);
+    for (auto* a : {&locked, &moved}) a->reserve(nodes);
+    elem.reserve(elements);
+    twin.reserve(4 * elements);
+    dead.reserve(elements);
+  }
+
+  // Количество вершин элемента e
+  int size(int e) const {
+    return elem[e][3] < 0 ? 3 : 4;
+  }
+  // Элемент e - треугольник
+  bool triangle(int e) const {
+    return elem[e][3] < 0;
+  }
+  // Начало, конец, следующее и предыдущее полуребра того же элемента для полуребра h
+  int origin(int h) const {
+    return elem[h / 4][h % 4];
+  }
+  int next(int h) const {
+    return h - h % 4 + (h % 4 + 1) % size(h / 4);
+  }
+  int prev(int h) const {
+    int n = size(h / 4);
+    return h - h % 4 + (h % 4 + n - 1) % n;
+  }
+  int dest(int h) const {
+    return origin(next(h));
+  }
+  // Полуребро h лежит на фронте
+  bool on_front(int h) const {
+    return triangle(h / 4) && (twin[h] < 0 || !triangle(twin[h] / 4));
+  }
+};
+
+// Функция для вычисления ключа ребра из узла a в узел b для словарей
+inline long long edge_key(int a, int b) {
+  return ((long long)a << 32) | (unsigned)b;
+}
+
+// Функция для добавления узла с координатами xy на плоскости и положением p в пространстве, возвращает индекс узла
+int add_node(QMorphMesh& m, const Point& xy, const Point& p, int global = -1) {
+  m.xy.push_back(xy);
+  m.pos.push_back(p);
+  m.global.push_back(global);
+  m.locked.push_back(0);
+  m.moved.push_back(0);
+  m.level.push_back(-1);
+  m.node_he.push_back(-1);
+  return m.xy.size() - 1;
+}
+
+// Функция для добавления элемента без соседей, возвращает индекс элемента
+int add_element(QMorphMesh& m, const array<int, 4>& v) {
+  m.elem.push_back(v);
+  m.dead.push_back(0);
+  m.twin.insert(m.twin.end(), 4, -1);
+  // Очередь фронта растет удвоением, как и массивы сетки
+  if (m.front.pos.size() < m.twin.size()) m.front.resize(max(m.twin.size(), 2 * m.front.pos.size()));
+  return m.elem.size() - 1;
+}
+
+// Функция для вызова f(g) для каждого полуребра g, выходящего из узла v (по одному в каждом элементе вокруг узла)
+// Узел обходится против часовой стрелки, а если граница грани не замыкает обход - по часовой стрелке
+template <class F>
+void for_each_out(const QMorphMesh& m, int v, F f) {
+  int g0 = m.node_he[v];
+  if (g0 < 0) return;
+  int g = g0;
+  for (int step = 0; step < qmorph_walk; step++) {
+    f(g);
+    int t = m.twin[m.prev(g)]; // У соседа противоположное входящему полуребро выходит из v
+    if (t < 0) break;
+    if (t == g0) return;
+    g = t;
+  }
+  g = g0;
+  for (int step = 0; step < qmorph_walk; step++) {
+    int t = m.twin[g];
+    if (t < 0) return;
+    g = m.next(t);
+    if (g == g0) return;
+    f(g);
+  }
+}
+
+// Функция для поиска полуребра из узла a в узел b, возвращает -1, если узлы не соединены ребром
+int find_half_edge(const QMorphMesh& m, int a, int b) {
+  int h = -1;
+  for_each_out(m, a, [&](int g) {
+    if (m.dest(g) == b) h = g;
+  });
+  return h;
+}
+
+// Функция для записи элементов вокруг узла v в out; возвращает их количество или -1,
+// если узел лежит на границе грани или элементов больше limit
+int element_fan(const QMorphMesh& m, int v, int* out, int limit) {
+  int g0 = m.node_he[v];
+  if (g0 < 0) return -1;
+  int n = 0, g = g0;
+  do {
+    if (n == limit) return -1;
+    out[n++] = g / 4;
+    g = m.twin[m.prev(g)];
+    if (g < 0) return -1;
+  } while (g != g0);
+  return n;
+}
+
+// Функции для поиска соседних ребер фронта: узла, из которого приходит ребро фронта в начало ребра h,
+// и узла, в который уходит ребро фронта из конца h; -1, если фронт не найден
+int front_prev(const QMorphMesh& m, int h) {
+  for (int step = 0; step < qmorph_walk; step++) {
+    int p = m.prev(h);
+    if (m.on_front(p)) return m.origin(p);
+    h = m.twin[p];
+  }
+  return -1;
+}
+int front_next(const QMorphMesh& m, int h) {
+  int g = m.next(h);
+  for (int step = 0; step < qmorph_walk; step++) {
+    if (m.on_front(g)) return m.dest(g);
+    g = m.next(m.twin[g]);
+  }
+  return -1;
+}
+
+// Функция для вычисления ключа ребра фронта h в очереди или -1, если ребро больше не обрабатывается
+// Сначала обрабатываются ребра ряда с меньшим номером, в ряду - ребра с острыми (меньше 3 * pi / 4) углами фронта
+// при обоих концах, затем при одном и ни при одном, а среди них - более короткие; ребро с неудачными попытками
+// переносится в конец очереди, а после qmorph_attempts попыток исключается из нее
+double front_key(const QMorphMesh& m, int h) {
+  int a = m.origin(h), b = m.dest(h);
+  int fails = 0;
+  if (!m.fails.empty()) {
+    auto it = m.fails.find(edge_key(a, b));
+    if (it != m.fails.end()) fails = it->second;
+  }
+  if (fails >= qmorph_attempts) return -1;
+  int x = front_prev(m, h), y = front_next(m, h);
+  if (x < 0 || y < 0) return -1;
+  const double side = 3 * M_PI / 4;
+  int sharp = (angle_ccw(m.xy[b], m.xy[a], m.xy[x]) < side) + (angle_ccw(m.xy[y], m.xy[b], m.xy[a]) < side);
+  int level = max(0, max(m.level[a], m.level[b]));
+  double length = Vector(m.xy[b] - m.xy[a]).length() / m.length;
+  return fails * 1e6 + level * 4 + (2 - sharp) + min(length, 0.999);
+}
+
+// Функция для добавления полуребра h в очередь фронта с новым ключом или удаления из нее, если оно не на фронте
+void refresh_front(QMorphMesh& m, int h) {
+  double key = (!m.dead[h / 4] && m.on_front(h)) ? front_key(m, h) : -1;
+  if (key >= 0) m.front.update(h, key);
+  else m.front.erase(h);
+}
+
+// Функция для обновления ключей ребер фронта, входящих в узел v и выходящих из него
+void refresh_node(QMorphMesh& m, int v) {
+  for_each_out(m, v, [&](int g) {
+    if (!m.triangle(g / 4)) return;
+    refresh_front(m, g);
+    refresh_front(m, m.prev(g));
+  });
+}
+
+// Функция для замены элементов old[0..n_old) элементами fresh[0..n_new), покрывающими ту же область (не больше qmorph_patch каждых)
+// Новые элементы занимают места старых, недостающие добавляются в конец, а лишние места старых помечаются удаленными
+// Полуребра связываются по узлам: внешние ребра - с прежними соседями, внутренние - между собой. Узел from в старых
+// элементах считается совпавшим с узлом to (склейка узлов); узлы старых элементов, которых нет в новых, удаляются
+void replace_elements(QMorphMesh& m, const int* old, int n_old, const array<int, 4>* fresh, int n_new, int from = -1, int to = -1) {
+  const int limit = qmorph_patch;
+  int oa[4 * limit], ob[4 * limit], ot[4 * limit]; // Внешние ребра старых элементов и их противоположные полуребра
+  int n_outer = 0;
+  int nodes[4 * limit]; // Узлы старых элементов
+  int n_nodes = 0;
+  auto in_old = [&](int e) { return find(old, old + n_old, e) != old + n_old; };
+  auto sub = [&](int v) { return v == from ? to : v; };
+  for (int i = 0; i < n_old; i++) {
+    int e = old[i];
+    for (int k = 0; k < m.size(e); k++) {
+      int h = 4 * e + k;
+      m.front.erase(h);
+      nodes[n_nodes++] = m.elem[e][k];
+      int t = m.twin[h];
+      if (t >= 0 && in_old(t / 4)) continue;
+      oa[n_outer] = sub(m.origin(h));
+      ob[n_outer] = sub(m.dest(h));
+      ot[n_outer] = t;
+      n_outer++;
+    }
+  }
+  int slot[limit]; // Места новых элементов
+  for (int j = 0; j < n_new; j++) slot[j] = j < n_old ? old[j] : add_element(m, fresh[j]);
+  for (int j = n_new; j < n_old; j++) {
+    m.dead[old[j]] = 1;
+    for (int k = 0; k < 4; k++) m.twin[4 * old[j] + k] = -1;
+  }
+  for (int j = 0; j < n_new; j++) {
+    m.elem[slot[j]] = fresh[j];
+    m.dead[slot[j]] = 0;
+    for (int k = 0; k < 4; k++) m.twin[4 * slot[j] + k] = -1;
+  }
+  for (int j = 0; j < n_new; j++) {
+    int e = slot[j];
+    for (int k = 0; k < m.size(e); k++) {
+      int h = 4 * e + k, a = m.elem[e][k], b = m.dest(h);
+      m.node_he[a] = h;
+      int t = -1;
+      bool found = false;
+      for (int i = 0; i < n_outer && !found; i++) {
+        if (oa[i] == a && ob[i] == b) {
+          t = ot[i];
+          found = true;
+        }
+      }
+      for (int l = 0; l < n_new && !found; l++) {
+        for (int s = 0; s < m.size(slot[l]) && !found; s++) {
+          int g = 4 * slot[l] + s;
+          if (m.elem[slot[l]][s] == b && m.dest(g) == a) {
+            t = g;
+            found = true;
+          }
+        }
+      }
+      m.twin[h] = t;
+      if (t >= 0) m.twin[t] = h;
+    }
+  }
+  for (int i = 0; i < n_nodes; i++) {
+    int v = nodes[i];
+    bool kept = false;
+    for (int j = 0; j < n_new && !kept; j++) kept = find(fresh[j].begin(), fresh[j].end(), v) != fresh[j].end();
+    if (v == from || !kept) m.node_he[v] = -1;
+  }
+  if (!m.advancing) return;
+  for (int j = 0; j < n_new; j++) {
+    for (int k = 0; k < m.size(slot[j]); k++) refresh_node(m, fresh[j][k]);
+  }
+}
+
+// Функция для проверки, что треугольник a b c на плоскости положительно ориентирован и не слишком вытянут:
+// удвоенная площадь не меньше 2% квадрата длины его наибольшего ребра
+bool fair(const Point& a, const Point& b, const Point& c) {
+  double l = max(Vector(b - a) * Vector(b - a), max(Vector(c - b) * Vector(c - b), Vector(a - c) * Vector(a - c)));
+  return orient2d(a, b, c) > 0.02 * l;
+}
+
+// Функция для проверки, что точка d лежит внутри окружности, описанной около положительно ориентированного треугольника a b c
+// Определитель вычисляется в обычной арифметике и сравнивается с оценкой его погрешности: для точек, почти лежащих
+// на одной окружности, возвращается false, поэтому повороты ребер по этому условию не зацикливаются
+bool in_circle(const Point& a, const Point& b, const Point& c, const Point& d) {
+  double ax = a.x - d.x, ay = a.y - d.y, bx = b.x - d.x, by = b.y - d.y, cx = c.x - d.x, cy = c.y - d.y;
+  double al = ax * ax + ay * ay, bl = bx * bx + by * by, cl = cx * cx + cy * cy;
+  double det = al * (bx * cy - cx * by) + bl * (cx * ay - ax * cy) + cl * (ax * by - bx * ay);
+  double bound = al * (abs(bx * cy) + abs(cx * by)) + bl * (abs(cx * ay) + abs(ax * cy)) + cl * (abs(ax * by) + abs(bx * ay));
+  return det > 1e-12 * bound;
+}
+
+// Функция для поворота общего ребра двух треугольников (полуребро o и противоположное ему) внутри образованного ими четырехугольника
+// Возвращает false, если за ребром нет треугольника, четырехугольник не выпуклый или новое ребро уже есть в сетке
+bool swap_diagonal(QMorphMesh& m, int o) {
+  int t = m.twin[o];
+  if (!m.triangle(o / 4) || t < 0 || !m.triangle(t / 4)) return false;
+  int u = m.origin(o), w = m.dest(o);
+  int p = m.origin(m.prev(o)); // Вершина треугольника o напротив ребра
+  int q = m.origin(m.prev(t)); // Вершина соседнего треугольника напротив ребра
+  // Новые треугольники не должны вырождаться: площадь сравнивается с квадратом длины нового ребра
+  double eps = 1e-6 * (Vector(m.xy[q] - m.xy[p]) * Vector(m.xy[q] - m.xy[p]));
+  if (orient2d(m.xy[p], m.xy[u], m.xy[q]) <= eps || orient2d(m.xy[p], m.xy[q], m.xy[w]) <= eps) return false;
+  if (find_half_edge(m, p, q) >= 0 || find_half_edge(m, q, p) >= 0) return false;
+  int old[2] = {o / 4, t / 4};
+  array<int, 4> fresh[2] = {{p, u, q, -1}, {p, q, w, -1}};
+  replace_elements(m, old, 2, fresh, 2);
+  QM_STAT_ADD(triangle_swaps, 1);
+  return true;
+}
+
+// Функция для деления общего ребра двух треугольников (полуребро o из u в w) новым узлом в точке u + (w - u) * s
+// Возвращает новый узел или -1, если за ребром нет треугольника
+int split_edge(QMorphMesh& m, int o, double s) {
+  int t = m.twin[o];
+  if (!m.triangle(o / 4) || t < 0 || !m.triangle(t / 4)) return -1;
+  int u = m.origin(o), w = m.dest(o);
+  int p = m.origin(m.prev(o)), q = m.origin(m.prev(t));
+  Point xy = m.xy[u] + (m.xy[w] - m.xy[u]) * s;
+  if (!fair(m.xy[u], xy, m.xy[p]) || !fair(xy, m.xy[w], m.xy[p])) return -1;
+  if (!fair(m.xy[w], xy, m.xy[q]) || !fair(xy, m.xy[u], m.xy[q])) return -1;
+  int n = add_node(m, xy, m.pos[u] + (m.pos[w] - m.pos[u]) * s);
+  int old[2] = {o / 4, t / 4};
+  array<int, 4> fresh[4] = {{u, n, p, -1}, {n, w, p, -1}, {w, n, q, -1}, {n, u, q, -1}};
+  replace_elements(m, old, 2, fresh, 4);
+  QM_STAT_ADD(inserted_nodes, 1);
+  return n;
+}
+
+// Функция для добавления узла в точку xy внутри треугольника e, который делится на три треугольника
+// Точка немного сдвигается к центру треугольника; возвращает новый узел или -1, если новые треугольники слишком вытянуты
+int insert_node(QMorphMesh& m, int e, const Point& xy) {
+  int a = m.elem[e][0], b = m.elem[e][1], c = m.elem[e][2];
+  Point center = (m.xy[a] + m.xy[b] + m.xy[c]) / 3;
+  Point p = center + (xy - center) * 0.9;
+  if (!fair(m.xy[a], m.xy[b], p) || !fair(m.xy[b], m.xy[c], p) || !fair(m.xy[c], m.xy[a], p)) return -1;
+  // Положение в пространстве - по барицентрическим координатам точки в треугольнике
+  double area = orient2d(m.xy[a], m.xy[b], m.xy[c]);
+  double la = orient2d(p, m.xy[b], m.xy[c]) / area, lb = orient2d(m.xy[a], p, m.xy[c]) / area;
+  int n = add_node(m, p, m.pos[a] * la + m.pos[b] * lb + m.pos[c] * (1 - la - lb));
+  array<int, 4> fresh[3] = {{a, b, n, -1}, {b, c, n, -1}, {c, a, n, -1}};
+  replace_elements(m, &e, 1, fresh, 3);
+  QM_STAT_ADD(inserted_nodes, 1);
+  return n;
+}
+
+// Функция для восстановления ребра c d в сетке треугольников поворотами пересекающих его ребер
+// Каждый раз поворачивается первое ребро вдоль отрезка c d, образующее с соседом выпуклый четырехугольник
+// Возвращает false, если отрезок проходит через узел или фронт либо ребро не восстановилось за ограниченное число поворотов
+bool recover_edge(QMorphMesh& m, int c, int d) {
+  const int limit = qmorph_recover_flips;
+  for (int iteration = 0; iteration < limit; iteration++) {
+    if (find_half_edge(m, c, d) >= 0 || find_half_edge(m, d, c) >= 0) return true;
+    const Point& pc = m.xy[c];
+    const Point& pd = m.xy[d];
+    // Ищем треугольник при узле c, внутри угла которого лежит направление на d; e - его ребро напротив c
+    int e = -1;
+    for_each_out(m, c, [&](int g) {
+      if (!m.triangle(g / 4)) return;
+      int u = m.dest(g), w = m.origin(m.prev(g));
+      if (orient2d(pc, m.xy[u], pd) > 0 && orient2d(pc, pd, m.xy[w]) > 0) e = m.next(g);
+    });
+    if (e < 0) return false;
+    // Идем вдоль отрезка по пересекаемым ребрам: начало ребра e лежит справа от c d, конец - слева
+    bool swapped = false;
+    for (int step = 0; step < limit && !swapped; step++) {
+      int t = m.twin[e];
+      if (t < 0 || !m.triangle(t / 4)) return false;
+      int q = m.origin(m.prev(t)); // Вершина следующего треугольника напротив ребра e
+      if (swap_diagonal(m, e)) {
+        swapped = true;
+      } else {
+        if (q == d) return false;
+        double s = orient2d(pc, pd, m.xy[q]);
+        if (s == 0) return false;
+        e = s > 0 ? m.next(t) : m.prev(t);
+      }
+    }
+    if (!swapped) return false;
+  }
+  return false;
+}
+
+// Структура веера треугольников при одном конце ребра фронта: от ребра фронта до соседнего ребра фронта
+// node[0] - другой конец ребра фронта, node[n] - соседний узел фронта; angle[j] - угол между ребром фронта и ребром
+// apex node[j] со стороны треугольников; opposite[j] - полуребро треугольника j между node[j] и node[j + 1]
+struct FrontFan {
+  static const int limit = qmorph_fan; // Наибольшее количество треугольников веера
+  int apex; // Конец ребра фронта
+  int n; // Количество треугольников веера
+  int node[limit + 1];
+  double angle[limit + 1];
+  int opposite[limit];
+};
+
+// Функция для построения веера при начале (at_start) или конце ребра фронта h; возвращает false, если веер слишком велик
+bool build_fan(const QMorphMesh& m, int h, bool at_start, FrontFan& fan) {
+  int a = m.origin(h), b = m.dest(h);
+  fan.apex = at_start ? a : b;
+  fan.node[0] = at_start ? b : a;
+  fan.angle[0] = 0;
+  fan.n = 0;
+  // У начала ребра веер обходится против часовой стрелки, у конца - по часовой
+  int o = at_start ? m.next(h) : m.prev(h);
+  while (fan.n < FrontFan::limit) {
+    int j = fan.n++;
+    fan.opposite[j] = o;
+    int v = at_start ? m.dest(o) : m.origin(o);
+    fan.node[j + 1] = v;
+    fan.angle[j + 1] = at_start ? angle_ccw(m.xy[b], m.xy[a], m.xy[v]) : angle_ccw(m.xy[v], m.xy[b], m.xy[a]);
+    int e = at_start ? m.next(o) : m.prev(o); // Ребро треугольника между apex и v
+    if (m.on_front(e)) return true;
+    int t = m.twin[e];
+    o = at_start ? m.next(t) : m.prev(t);
+  }
+  return false;
+}
+
+// Функция для выбора бокового ребра четырехугольника при конце ребра фронта по вееру fan; length - желаемая длина ребра
+// Если угол фронта меньше 3 * pi / 4, боковым становится соседнее ребро фронта. Иначе берется ребро веера, ближайшее
+// к идеальному направлению - биссектрисе угла фронта, а при угле больше 5 * pi / 4 - перпендикуляру к ребру фронта
+// Если ребра в пределах pi / 6 от него нет, оно восстанавливается: в треугольник, содержащий идеальную точку, добавляется
+// узел, либо поворачивается или делится ребро, которое пересекает идеальное направление
+// Узел exclude (второй узел другого бокового ребра) не выбирается из веера
+// Возвращает второй узел бокового ребра, -1, если ребро не найдено, или -2, если сетка изменена и выбор нужно повторить
+int side_edge(QMorphMesh& m, const FrontFan& fan, bool at_start, double length, int exclude = -1) {
+  double theta = fan.angle[fan.n]; // Угол между ребром фронта и соседним ребром фронта
+  if (theta < 3 * M_PI / 4) return fan.node[fan.n];
+  double phi = theta < 5 * M_PI / 4 ? theta / 2 : M_PI / 2; // Угол идеального бокового ребра от ребра фронта
+  const double tolerance = M_PI / 6;
+  int best = -1;
+  double diff = M_PI;
+  for (int j = 1; j < fan.n; j++) {
+    if (fan.node[j] == exclude) continue;
+    double d = abs(fan.angle[j] - phi);
+    if (d < diff) {
+      diff = d;
+      best = j;
+    }
+  }
+  if (best >= 0 && diff < tolerance) return fan.node[best];
+  // Идеальная точка: ребро фронта поворачивается на phi в сторону треугольников
+  const Point p = m.xy[fan.apex];
+  Vector d = m.xy[fan.node[0]] - p;
+  d.normalize();
+  double c = cos(phi), s = at_start ? sin(phi) : -sin(phi);
+  Point dir(d.x * c - d.y * s, d.x * s + d.y * c);
+  Point ideal = p + dir * length;
+  // Треугольник веера, внутри угла которого лежит идеальное направление, и его ребро u w напротив apex
+  int j = 0;
+  while (j + 1 < fan.n && fan.angle[j + 1] <= phi) j++;
+  int o = fan.opposite[j];
+  int u = m.origin(o), w = m.dest(o);
+  if (orient2d(m.xy[u], m.xy[w], ideal) * orient2d(m.xy[u], m.xy[w], p) > 0) {
+    if (insert_node(m, o / 4, ideal) >= 0) return -2;
+  }
+  int t = m.twin[o];
+  if (t >= 0 && m.triangle(t / 4)) {
+    int q = m.origin(m.prev(t)); // Вершина соседнего треугольника за ребром u w
+    double aq = at_start ? angle_ccw(m.xy[fan.node[0]], p, m.xy[q]) : angle_ccw(m.xy[q], p, m.xy[fan.node[0]]);
+    if (abs(aq - phi) < tolerance && swap_diagonal(m, o)) return -2;
+    // Делим ребро u w в точке пересечения с идеальным направлением, не подходя близко к его концам
+    Point e = m.xy[w] - m.xy[u], r = p - m.xy[u];
+    double den = e.x * dir.y - e.y * dir.x;
+    if (den != 0 && split_edge(m, o, max(0.2, min(0.8, (r.x * dir.y - r.y * dir.x) / den))) >= 0) return -2;
+  }
+  if (best >= 0 && diff < 2 * tolerance) return fan.node[best];
+  return -1;
+}
+
+// Функция для проверки, что четырехугольник q строго выпуклый на плоскости
+bool convex(const QMorphMesh& m, const array<int, 4>& q) {
+  for (int k = 0; k < 4; k++) {
+    if (orient2d(m.xy[q[k]], m.xy[q[(k + 1) % 4]], m.xy[q[(k + 2) % 4]]) <= 0) return false;
+  }
+  return true;
+}
+
+// Функция для вычисления качества четырехугольника q на плоскости по метрике углов
+double quality(const QMorphMesh& m, const array<int, 4>& q) {
+  const Point& p1 = m.xy[q[0]];
+  const Point& p2 = m.xy[q[1]];
+  const Point& p3 = m.xy[q[2]];
+  const Point& p4 = m.xy[q[3]];
+  return quality_from_cosines(corner_cosine(p4, p1, p2), corner_cosine(p1, p2, p3), corner_cosine(p2, p3, p4), corner_cosine(p3, p4, p1));
+}
+
+// Функция для сглаживания узла v: узел переносится в среднее соседних по ребрам узлов, если все элементы вокруг него
+// остаются правильными (треугольники - положительно ориентированными, четырехугольники - выпуклыми)
+// Узлы границы грани и узлы вне ее не перемещаются; возвращает true, если узел перемещен
+bool smooth_node(QMorphMesh& m, int v) {
+  if (m.locked[v] || m.node_he[v] < 0) return false;
+  const int limit = qmorph_valence;
+  int fan[limit];
+  int n = element_fan(m, v, fan, limit);
+  if (n < 0) return false;
+  Point xy, pos;
+  int k = 0;
+  for_each_out(m, v, [&](int g) {
+    xy = xy + m.xy[m.dest(g)];
+    pos = pos + m.pos[m.dest(g)];
+    k++;
+  });
+  xy = xy / k;
+  pos = pos / k;
+  Point old = m.xy[v];
+  if (xy == old) return false;
+  m.xy[v] = xy;
+  for (int i = 0; i < n; i++) {
+    const array<int, 4>& e = m.elem[fan[i]];
+    bool valid = m.triangle(fan[i]) ? orient2d(m.xy[e[0]], m.xy[e[1]], m.xy[e[2]]) > 0 : convex(m, e);
+    if (!valid) {
+      m.xy[v] = old;
+      return false;
+    }
+  }
+  m.pos[v] = pos;
+  m.moved[v] = 1;
+  if (m.advancing) refresh_node(m, v);
+  return true;
+}
+
+// Функция для изопараметрического сглаживания узла фронта v по соседним четырехугольникам: для каждого
+// четырехугольника (v, i, j, k) узел переносится в i + k - j, а положения усредняются. Для регулярной сетки
+// параллелограммов положение узла не меняется. Узел перемещается, только если все элементы вокруг остаются правильными
+bool smooth_front_node(QMorphMesh& m, int v) {
+  if (m.locked[v] || m.node_he[v] < 0) return false;
+  const int limit = qmorph_valence;
+  int fan[limit];
+  int n = element_fan(m, v, fan, limit);
+  if (n < 0) return false;
+  Point xy, pos;
+  int k = 0;
+  for (int i = 0; i < n; i++) {
+    if (m.triangle(fan[i])) continue;
+    const array<int, 4>& q = m.elem[fan[i]];
+    int r = find(q.begin(), q.end(), v) - q.begin();
+    int a = q[(r + 1) % 4], c = q[(r + 2) % 4], d = q[(r + 3) % 4];
+    xy = xy + m.xy[a] + m.xy[d] - m.xy[c];
+    pos = pos + m.pos[a] + m.pos[d] - m.pos[c];
+    k++;
+  }
+  if (k == 0) return false;
+  xy = xy / k;
+  pos = pos / k;
+  Point old = m.xy[v];
+  if (xy == old) return false;
+  m.xy[v] = xy;
+  for (int i = 0; i < n; i++) {
+    const array<int, 4>& e = m.elem[fan[i]];
+    bool valid = m.triangle(fan[i]) ? fair(m.xy[e[0]], m.xy[e[1]], m.xy[e[2]]) : convex(m, e);
+    if (!valid) {
+      m.xy[v] = old;
+      return false;
+    }
+  }
+  m.pos[v] = pos;
+  m.moved[v] = 1;
+  if (m.advancing) refresh_node(m, v);
+  return true;
+}
+
+// Функция для построения четырехугольника на ребре фронта из узла a в узел b
+// Боковые ребра a c и b d выбираются или восстанавливаются при каждом конце, верхнее ребро c d восстанавливается
+// поворотами ребер, после чего треугольники внутри a b d c заменяются четырехугольником, а их внутренние узлы удаляются
+// Возвращает false, если четырехугольник построить не удалось; сетка при этом остается согласованной
+bool form_quad(QMorphMesh& m, int a, int b) {
+  int c = -1, d = -1;
+  for (int round = 0;; round++) {
+    if (round == qmorph_side_rounds) return false;
+    int h = find_half_edge(m, a, b);
+    if (h < 0 || !m.on_front(h)) return false;
+    FrontFan fa, fb;
+    if (!build_fan(m, h, true, fa) || !build_fan(m, h, false, fb)) return false;
+    double ab = Vector(m.xy[b] - m.xy[a]).length();
+    double la = (ab + Vector(m.xy[fa.node[fa.n]] - m.xy[a]).length()) / 2;
+    double lb = (ab + Vector(m.xy[fb.node[fb.n]] - m.xy[b]).length()) / 2;
+    c = side_edge(m, fa, true, la);
+    if (c == -2) continue;
+    d = side_edge(m, fb, false, lb, c);
+    if (d == -2) continue;
+    // При остром угле фронта у конца b ребро b d совпадает с соседним ребром фронта, и треугольник a b d лежит в веере a:
+    // четвертым узлом четырехугольника становится следующий за d узел веера
+    if (c == d && fb.angle[fb.n] < 3 * M_PI / 4) {
+      for (int j = 1; j < fa.n; j++) {
+        if (fa.node[j] == d) c = fa.node[j + 1];
+      }
+    }
+    break;
+  }
+  if (c < 0 || d < 0 || c == d || c == b || d == a) return false;
+  array<int, 4> quad = {a, b, d, c};
+  if (!convex(m, quad) || quality(m, quad) < 0.1 || !recover_edge(m, c, d)) return false;
+  // Собираем треугольники внутри четырехугольника, начиная с треугольника ребра фронта
+  int h = find_half_edge(m, a, b);
+  if (h < 0 || !m.on_front(h)) return false;
+  const int limit = qmorph_quad_triangles;
+  int inner[limit]; // Треугольники внутри четырехугольника
+  int n = 1, border = 0;
+  inner[0] = h / 4;
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < 3; k++) {
+      int g = 4 * inner[i] + k;
+      int u = m.origin(g), w = m.dest(g);
+      bool side = false;
+      for (int s = 0; s < 4; s++) side = side || (quad[s] == u && quad[(s + 1) % 4] == w);
+      if (side) {
+        border++;
+        continue;
+      }
+      // Область не должна пересекать фронт
+      int t = m.twin[g];
+      if (t < 0 || !m.triangle(t / 4)) return false;
+      if (find(inner, inner + n, t / 4) == inner + n) {
+        if (n == limit) return false;
+        inner[n++] = t / 4;
+      }
+    }
+  }
+  if (border != 4) return false;
+  for (int i = 0; i < n; i++) {
+    for (int k = 0; k < 3; k++) {
+      int v = m.elem[inner[i]][k];
+      if (m.locked[v] && find(quad.begin(), quad.end(), v) == quad.end()) return false;
+    }
+  }
+  // Новые узлы фронта относятся к следующему ряду
+  int level = max(0, max(m.level[a], m.level[b]));
+  if (m.level[c] < 0) m.level[c] = level + 1;
+  if (m.level[d] < 0) m.level[d] = level + 1;
+  replace_elements(m, inner, n, &quad, 1);
+  smooth_front_node(m, c);
+  smooth_front_node(m, d);
+  QM_STAT_ADD(front_quads, 1);
+  return true;
+}
+
+// Функция для закрытия шва: ребра фронта p n и n q сходятся в узле n под малым углом
+// Ребро q p восстанавливается, узлы p и q склеиваются (в середине отрезка, если оба свободны), а треугольники
+// по обе стороны ребра q p вырождаются и удаляются. Возвращает false, если склейка испортила бы сетку
+bool close_seam(QMorphMesh& m, int n, int p, int q) {
+  if (m.locked[p] && m.locked[q]) return false;
+  if (!recover_edge(m, q, p)) return false;
+  int g = find_half_edge(m, q, p);
+  if (g < 0 || !m.triangle(g / 4) || m.origin(m.prev(g)) != n) return false;
+  int t = m.twin[g];
+  if (t < 0 || !m.triangle(t / 4)) return false;
+  int w = m.origin(m.prev(t)); // Вершина треугольника за ребром q p
+  if (w == n) return false;
+  int s = m.locked[q] ? q : p; // Остающийся узел
+  int r = s == p ? q : p; // Удаляемый узел
+  Point target = m.locked[s] ? m.xy[s] : (m.xy[p] + m.xy[q]) / 2;
+  auto position = [&](int v) { return (v == s || v == r) ? target : m.xy[v]; };
+  auto valid = [&](const array<int, 4>& e) {
+    int k = e[3] < 0 ? 3 : 4;
+    for (int i = 0; i < k; i++) {
+      if (orient2d(position(e[i]), position(e[(i + 1) % k]), position(e[(i + 2) % k])) <= 0) return false;
+    }
+    return true;
+  };
+  const int limit = qmorph_patch;
+  int old[limit], around[limit];
+  int n_old = element_fan(m, r, old, limit);
+  int n_around = m.locked[s] ? 0 : element_fan(m, s, around, limit);
+  if (n_old < 0 || n_around < 0) return false;
+  // После склейки у узлов не должно появиться двух ребер к одному соседу: общие соседи p и q - только n и w
+  int neighbours[2 * limit];
+  int k = 0;
+  for_each_out(m, r, [&](int h) {
+    if (k + 2 > 2 * limit) return;
+    neighbours[k++] = m.dest(h);
+    neighbours[k++] = m.origin(m.prev(h));
+  });
+  bool simple = true;
+  for_each_out(m, s, [&](int h) {
+    for (int v : {m.dest(h), m.origin(m.prev(h))}) {
+      if (v != n && v != w && v != r && find(neighbours, neighbours + k, v) != neighbours + k) simple = false;
+    }
+  });
+  if (!simple) return false;
+  // Элементы вокруг удаляемого узла переходят к остающемуся, два треугольника у ребра q p вырождаются
+  array<int, 4> fresh[limit];
+  int n_new = 0;
+  for (int i = 0; i < n_old; i++) {
+    int e = old[i];
+    if (e == g / 4 || e == t / 4) continue;
+    array<int, 4> v = m.elem[e];
+    for (int& x : v) {
+      if (x == s) return false;
+      if (x == r) x = s;
+    }
+    if (!valid(v)) return false;
+    fresh[n_new++] = v;
+  }
+  for (int i = 0; i < n_around; i++) {
+    if (around[i] != g / 4 && around[i] != t / 4 && !valid(m.elem[around[i]])) return false;
+  }
+  if (!m.locked[s]) {
+    m.pos[s] = (m.pos[p] + m.pos[q]) / 2;
+    m.moved[s] = 1;
+  }
+  m.xy[s] = target;
+  if (m.level[s] < 0 || (m.level[r] >= 0 && m.level[r] < m.level[s])) m.level[s] = m.level[r];
+  replace_elements(m, old, n_old, fresh, n_new, r, s);
+  QM_STAT_ADD(seams, 1);
+  return true;
+}
+
+// Функция для построения четырехугольника из треугольника полуребра h и соседнего с ним по этому полуребру треугольника
+array<int, 4> merged_quad(const QMorphMesh& m, int h) {
+  int t = m.twin[h];
+  return {m.origin(h), m.origin(m.prev(t)), m.dest(h), m.origin(m.prev(h))};
+}
+
+// Функция для поиска ребра элемента x из вершины i в следующую, которое в элементе y проходится в обратном направлении
+// Возвращает i или -1, если у элементов нет общего ребра
+int shared_edge(const array<int, 4>& x, const array<int, 4>& y) {
+  int nx = x[3] < 0 ? 3 : 4, ny = y[3] < 0 ? 3 : 4;
+  for (int i = 0; i < nx; i++) {
+    for (int j = 0; j < ny; j++) {
+      if (y[j] == x[(i + 1) % nx] && y[(j + 1) % ny] == x[i]) return i;
+    }
+  }
+  return -1;
+}
+
+// Функция для перемещения треугольника e к другому треугольнику через цепочку четырехугольников и объединения их
+// в четырехугольник. На каждом шаге треугольник и следующий четырехугольник образуют пятиугольник, который делится
+// заново на выпуклый четырехугольник и треугольник при одном из трех других ребер пятиугольника. Варианты
+// перебираются поиском в ширину без изменения сетки, и выполняется первая цепочка, доходящая до другого треугольника
+// Каждый элемент входит в поиск не больше passes раз, а всего состояний не больше qmorph_chain. Возвращает false,
+// если такая цепочка не найдена
+bool move_triangle(QMorphMesh& m, int e, int passes) {
+  // Состояние поиска: треугольник tri в месте элемента e и элемент x за одним из его ребер; step - новые треугольник
+  // и четырехугольник, которыми заменен элемент предыдущего состояния
+  struct State {
+    array<int, 4> tri;
+    int x, parent;
+    array<int, 4> step[2];
+  };
+  // Счетчики посещений хранятся в сетке и растут до начала области арены поиска
+  pmr::vector<char>& visits = m.visits;
+  if (visits.size() < m.elem.size()) visits.resize(m.elem.size(), 0);
+  ScratchScope scope;
+  pmr::vector<State> states(&scope.arena);
+  states.reserve(qmorph_chain);
+  auto push = [&](const State& state) {
+    if ((int)states.size() < qmorph_chain && visits[state.x] < passes) {
+      ++visits[state.x];
+      states.push_back(state);
+    }
+  };
+  for (int k = 0; k < 3; k++) {
+    int t = m.twin[4 * e + k];
+    if (t >= 0) push({m.elem[e], t / 4, -1, {}});
+  }
+  bool moved = false;
+  for (int i = 0; i < (int)states.size() && !moved; i++) {
+    int x = states[i].x;
+    array<int, 4> tri = states[i].tri;
+    // Элемент, достигнутый повторно, не должен уже входить в цепочку
+    bool repeated = x == e;
+    for (int j = states[i].parent; j >= 0 && !repeated && visits[x] > 1; j = states[j].parent) repeated = states[j].x == x;
+    if (repeated) continue;
+    if (m.triangle(x)) {
+      const array<int, 4>& last = m.elem[x];
+      int k = shared_edge(tri, last);
+      if (k < 0) continue;
+      int w = last[0] + last[1] + last[2] - tri[k] - tri[(k + 1) % 3]; // Вершина треугольника x напротив общего ребра
+      array<int, 4> quad = {tri[k], w, tri[(k + 1) % 3], tri[(k + 2) % 3]};
+      if (!convex(m, quad)) continue;
+      // Выполняем цепочку от начала
+      pmr::vector<int> chain(&scope.arena);
+      for (int j = i; j >= 0; j = states[j].parent) chain.push_back(j);
+      for (int j = chain.size() - 2; j >= 0; j--) {
+        int old[2] = {e, states[states[chain[j]].parent].x};
+        replace_elements(m, old, 2, states[chain[j]].step, 2);
+      }
+      int old[2] = {e, x};
+      replace_elements(m, old, 2, &quad, 1);
+      moved = true;
+      continue;
+    }
+    const array<int, 4>& quad = m.elem[x];
+    int k = shared_edge(tri, quad), l = shared_edge(quad, tri);
+    if (k < 0 || l < 0) continue;
+    // Пятиугольник: треугольник (x, y, z) с общим ребром x y и четырехугольник (y, x, a, b)
+    int P[5] = {tri[(k + 1) % 3], tri[(k + 2) % 3], tri[k], quad[(l + 2) % 4], quad[(l + 3) % 4]};
+    for (int s = 2; s < 5; s++) {
+      // Элемент за ребром пятиугольника P[s] P[s + 1], которое принадлежит четырехугольнику x
+      int y = -1;
+      for (int r = 0; r < 4; r++) {
+        if (quad[r] == P[s] && quad[(r + 1) % 4] == P[(s + 1) % 5] && m.twin[4 * x + r] >= 0) y = m.twin[4 * x + r] / 4;
+      }
+      if (y < 0) continue;
+      // Новый треугольник содержит это ребро и одну из соседних с ним вершин пятиугольника
+      for (int start = s + 4; start <= s + 5; start++) {
+        array<int, 4> t = {P[start % 5], P[(start + 1) % 5], P[(start + 2) % 5], -1};
+        array<int, 4> q = {P[(start + 2) % 5], P[(start + 3) % 5], P[(start + 4) % 5], P[start % 5]};
+        if (orient2d(m.xy[t[0]], m.xy[t[1]], m.xy[t[2]]) <= 0 || !convex(m, q)) continue;
+        push({t, y, i, {t, q}});
+      }
+    }
+  }
+  for (const State& state : states) visits[state.x] = 0;
+  return moved;
+}
+
+// Функция для переноса треугольника e, который не удается переместить: треугольник и соседний четырехугольник
+// образуют пятиугольник, внутрь которого добавляется узел, а пятиугольник делится на два четырехугольника и
+// треугольник при другом его ребре. Выбирается правильное разбиение с наилучшим качеством четырехугольников, а если
+// задано полуребро exit соседнего четырехугольника - разбиение, в котором треугольник лежит у этого ребра
+// Возвращает false, если такого разбиения нет
+bool spread_triangle(QMorphMesh& m, int e, int exit = -1) {
+  double q_best = -1;
+  int quad_best = -1;
+  array<int, 4> best[3];
+  Point center_best, pos_best;
+  for (int k = 0; k < 3; k++) {
+    int t = m.twin[4 * e + k];
+    if (t < 0 || m.triangle(t / 4) || (exit >= 0 && t / 4 != exit / 4)) continue;
+    const array<int, 4>& tri = m.elem[e];
+    const array<int, 4>& quad = m.elem[t / 4];
+    int l = t % 4;
+    // Пятиугольник: треугольник (x, y, z) с общим ребром x y и четырехугольник (y, x, a, b)
+    int P[5] = {tri[(k + 1) % 3], tri[(k + 2) % 3], tri[k], quad[(l + 2) % 4], quad[(l + 3) % 4]};
+    Point mean, mean_pos;
+    for (int v : P) {
+      mean = mean + m.xy[v];
+      mean_pos = mean_pos + m.pos[v];
+    }
+    mean = mean / 5;
+    mean_pos = mean_pos / 5;
+    // Новый узел пока не добавлен в сетку, поэтому правильность элементов проверяется по координатам
+    Point center;
+    auto xy = [&](int v) { return v < 0 ? center : m.xy[v]; };
+    for (int r = 0; r < 5; r++) {
+      if (exit >= 0 && (P[(r + 4) % 5] != m.origin(exit) || P[r] != m.dest(exit))) continue;
+      array<int, 4> fresh[3] = {{-1, P[r], P[(r + 1) % 5], P[(r + 2) % 5]},
+                                {-1, P[(r + 2) % 5], P[(r + 3) % 5], P[(r + 4) % 5]},
+                                {-1, P[(r + 4) % 5], P[r], -1}};
+      // Узел ставится в центр пятиугольника, а в вытянутом пятиугольнике - ближе к ребру нового треугольника
+      int a = P[(r + 4) % 5], b = P[r], c = P[(r + 2) % 5];
+      Point mid = (m.xy[a] + m.xy[b]) / 2, mid_pos = (m.pos[a] + m.pos[b]) / 2;
+      Point centers[3] = {mean, (mean + mid) / 2, (m.xy[c] + mid) / 2};
+      Point positions[3] = {mean_pos, (mean_pos + mid_pos) / 2, (m.pos[c] + mid_pos) / 2};
+      for (int i_center = 0; i_center < 3; i_center++) {
+        center = centers[i_center];
+        if (!fair(xy(fresh[2][0]), xy(fresh[2][1]), xy(fresh[2][2]))) continue;
+        double q = 2;
+        for (int j = 0; j < 2 && q > 0; j++) {
+          bool valid = true;
+          for (int i = 0; i < 4; i++) {
+            if (orient2d(xy(fresh[j][i]), xy(fresh[j][(i + 1) % 4]), xy(fresh[j][(i + 2) % 4])) <= 0) valid = false;
+          }
+          const Point& p1 = xy(fresh[j][0]);
+          const Point& p2 = xy(fresh[j][1]);
+          const Point& p3 = xy(fresh[j][2]);
+          const Point& p4 = xy(fresh[j][3]);
+          q = valid ? min(q, quality_from_cosines(corner_cosine(p4, p1, p2), corner_cosine(p1, p2, p3), corner_cosine(p2, p3, p4), corner_cosine(p3, p4, p1))) : -1;
+        }
+        if (q > q_best) {
+          q_best = q;
+          quad_best = t / 4;
+          for (int j = 0; j < 3; j++) best[j] = fresh[j];
+          center_best = center;
+          pos_best = positions[i_center];
+        }
+      }
+    }
+  }
+  if (q_best <= 0) return false;
+  int n = add_node(m, center_best, pos_best);
+  for (array<int, 4>& f : best) {
+    f[0] = n;
+  }
+  // Треугольник остается на месте элемента e
+  array<int, 4> fresh[3] = {best[2], best[0], best[1]};
+  int old[2] = {e, quad_best};
+  replace_elements(m, old, 2, fresh, 3);
+  QM_STAT_ADD(inserted_nodes, 1);
+  return true;
+}
+
+// Функция для поиска пути по элементам от треугольника e до ближайшего по числу переходов через ребра другого
+// треугольника в обход элементов blocked[0..n_blocked). В m.reached для e и промежуточных элементов пути записываются
+// полуребра входа в следующий элемент пути. Возвращает найденный треугольник или -1, если пути нет
+int find_path(QMorphMesh& m, int e, const int* blocked, int n_blocked) {
+  // Метки поиска хранятся в сетке и растут до начала области арены поиска
+  if (m.reached.size() < m.elem.size()) m.reached.resize(m.elem.size(), -1);
+  ScratchScope scope;
+  pmr::vector<int> queue(&scope.arena);
+  m.reached[e] = 4 * e;
+  queue.push_back(e);
+  int found = -1;
+  for (size_t i = 0; i < queue.size() && found < 0; i++) {
+    int x = queue[i];
+    for (int k = 0; k < m.size(x) && found < 0; k++) {
+      int t = m.twin[4 * x + k];
+      if (t < 0 || m.reached[t / 4] >= 0 || find(blocked, blocked + n_blocked, t / 4) != blocked + n_blocked) continue;
+      m.reached[t / 4] = t;
+      queue.push_back(t / 4);
+      if (m.triangle(t / 4)) found = t / 4;
+    }
+  }
+  // Вдоль пути полуребро входа в каждый элемент переносится на предыдущий элемент, остальные метки снимаются
+  pmr::vector<array<int, 2>> path(&scope.arena);
+  for (int x = found, g = -1; found >= 0;) {
+    path.push_back({x, g});
+    if (x == e) break;
+    g = m.reached[x];
+    x = m.twin[g] / 4;
+  }
+  for (int x : queue) m.reached[x] = -1;
+  for (const array<int, 2>& p : path) m.reached[p[0]] = p[1];
+  return found;
+}
+
+// Функция для переноса треугольника e к ближайшему другому треугольнику, когда цепочка move_triangle не найдена:
+// треугольник переносится вдоль пути find_path шагами spread_triangle (каждый добавляет узел) и объединяется с другим
+// треугольником. Элемент, через который шаг не удался, или треугольник, с которым объединение не выпуклое, обходится
+// при следующем поиске пути. Возвращает false, если треугольник не перенесен; сетка при этом остается согласованной
+bool drive_triangle(QMorphMesh& m, int e) {
+  int blocked[qmorph_detours];
+  for (int n_blocked = 0; n_blocked < qmorph_detours;) {
+    int found = find_path(m, e, blocked, n_blocked);
+    if (found < 0) return false;
+    // Полуребро, противоположное входу в следующий элемент пути, - выход из текущего; после шага оно принадлежит e
+    int g = m.reached[e], stop = -1;
+    m.reached[e] = -1;
+    while (g / 4 != found) {
+      int x = g / 4, next = m.reached[x];
+      m.reached[x] = -1;
+      if (stop < 0 && !spread_triangle(m, e, m.twin[next])) stop = x;
+      g = next;
+    }
+    if (stop < 0) {
+      array<int, 4> quad = merged_quad(m, m.twin[g]);
+      if (convex(m, quad)) {
+        int old[2] = {e, found};
+        replace_elements(m, old, 2, &quad, 1);
+        return true;
+      }
+      stop = found;
+    }
+    blocked[n_blocked++] = stop;
+  }
+  return false;
+}
+
+// Функция для стягивания ребра треугольника e, если треугольник не удается перенести: концы кратчайшего из ребер,
+// для которых стягивание допустимо, склеиваются (в середине ребра, если оба свободны), треугольник вырождается,
+// а соседний элемент за ребром теряет узел: четырехугольник становится треугольником, а треугольник исчезает
+// Возвращает false, если ни одно ребро стянуть нельзя
+bool collapse_triangle(QMorphMesh& m, int e) {
+  int order[3] = {0, 1, 2};
+  auto length = [&](int k) { return Vector(m.xy[m.dest(4 * e + k)] - m.xy[m.origin(4 * e + k)]).length(); };
+  sort(order, order + 3, [&](int i, int j) { return length(i) < length(j); });
+  for (int k : order) {
+    int h = 4 * e + k, t = m.twin[h];
+    int u = m.origin(h), w = m.dest(h);
+    if (t < 0 || (m.locked[u] && m.locked[w])) continue;
+    int s = m.locked[u] ? u : w; // Остающийся узел
+    int r = s == u ? w : u; // Удаляемый узел
+    Point target = m.locked[s] ? m.xy[s] : (m.xy[u] + m.xy[w]) / 2;
+    auto position = [&](int v) { return (v == s || v == r) ? target : m.xy[v]; };
+    auto valid = [&](const array<int, 4>& x) {
+      int n = x[3] < 0 ? 3 : 4;
+      for (int i = 0; i < n; i++) {
+        if (orient2d(position(x[i]), position(x[(i + 1) % n]), position(x[(i + 2) % n])) <= 0) return false;
+      }
+      return true;
+    };
+    const int limit = qmorph_patch;
+    int old[limit], around[limit];
+    int n_old = element_fan(m, r, old, limit);
+    int n_around = m.locked[s] ? 0 : element_fan(m, s, around, limit);
+    if (n_old < 0 || n_around < 0) continue;
+    // Общими соседями концов ребра могут быть только вершины треугольников при нем, иначе появятся двойные ребра
+    int apex[2] = {m.origin(m.prev(h)), m.triangle(t / 4) ? m.origin(m.prev(t)) : -1};
+    int neighbours[2 * limit];
+    int n = 0;
+    for_each_out(m, r, [&](int g) {
+      if (n + 2 > 2 * limit) return;
+      neighbours[n++] = m.dest(g);
+      neighbours[n++] = m.origin(m.prev(g));
+    });
+    bool simple = true;
+    for_each_out(m, s, [&](int g) {
+      for (int v : {m.dest(g), m.origin(m.prev(g))}) {
+        if (v != apex[0] && v != apex[1] && v != r && find(neighbours, neighbours + n, v) != neighbours + n) simple = false;
+      }
+    });
+    if (!simple) continue;
+    // Элементы вокруг удаляемого узла переходят к остающемуся; из соседнего четырехугольника удаляемый узел исключается
+    array<int, 4> fresh[limit];
+    int n_new = 0;
+    bool ok = true;
+    for (int i = 0; i < n_old && ok; i++) {
+      int x = old[i];
+      if (x == e || (x == t / 4 && m.triangle(x))) continue;
+      array<int, 4> v = m.elem[x];
+      if (x == t / 4) {
+        int j = find(v.begin(), v.end(), r) - v.begin();
+        for (int l = j; l < 3; l++) v[l] = v[l + 1];
+        v[3] = -1;
+      }
+      for (int& y : v) {
+        if (y == r) y = s;
+      }
+      ok = valid(v);
+      fresh[n_new++] = v;
+    }
+    for (int i = 0; i < n_around && ok; i++) {
+      int x = around[i];
+      if (x != e && x != t / 4 && find(old, old + n_old, x) == old + n_old) ok = valid(m.elem[x]);
+    }
+    if (!ok) continue;
+    if (!m.locked[s]) {
+      m.pos[s] = (m.pos[u] + m.pos[w]) / 2;
+      m.moved[s] = 1;
+    }
+    m.xy[s] = target;
+    replace_elements(m, old, n_old, fresh, n_new, r, s);
+    return true;
+  }
+  return false;
+}
+
+// Функция для объединения треугольников, оставшихся после продвижения фронта, в четырехугольники
+// Сначала соседние треугольники объединяются попарно, выбирая для каждого лучший выпуклый четырехугольник, затем
+// каждый одиночный треугольник перемещается к другому цепочкой поблизости, а если ее нет - переносится к ближайшему
+// треугольнику с добавлением узлов, а если и это не удалось - стягивается или сдвигается к соседнему ребру
+// Затем узлы вокруг оставшихся треугольников сглаживаются, и они обрабатываются снова
+// Возвращает false, если треугольники остались
+bool merge_triangles(QMorphMesh& m) {
+  m.advancing = false;
+  int count = m.elem.size();
+  for (int e = 0; e < count; e++) {
+    if (m.dead[e] || !m.triangle(e)) continue;
+    int best = -1;
+    double q_best = -1;
+    for (int k = 0; k < 3; k++) {
+      int h = 4 * e + k, t = m.twin[h];
+      if (t < 0 || !m.triangle(t / 4)) continue;
+      array<int, 4> q = merged_quad(m, h);
+      if (!convex(m, q)) continue;
+      double r = quality(m, q);
+      if (r > q_best) {
+        q_best = r;
+        best = h;
+      }
+    }
+    if (best < 0) continue;
+    int old[2] = {e, m.twin[best] / 4};
+    array<int, 4> q = merged_quad(m, best);
+    replace_elements(m, old, 2, &q, 1);
+  }
+  // Одиночные треугольники обходятся в порядке кривой Мортона по центрам: пары уже пройденных треугольников
+  // найдены, поэтому пара следующего лежит рядом с ним, а не на другом конце грани
+  Point lo = m.xy[0], hi = lo;
+  for (const Point& p : m.xy) {
+    lo = Point(min(lo.x, p.x), min(lo.y, p.y));
+    hi = Point(max(hi.x, p.x), max(hi.y, p.y));
+  }
+  double extent = max(max(hi.x - lo.x, hi.y - lo.y), 1e-300);
+  const double cells = (1 << 21) - 1;
+  pmr::vector<pair<uint64_t, int>> order(m.xy.get_allocator());
+  for (int round = 0; round < qmorph_merge_rounds; round++) {
+    order.clear();
+    for (int e = 0; e < (int)m.elem.size(); e++) {
+      if (m.dead[e] || !m.triangle(e)) continue;
+      const array<int, 4>& t = m.elem[e];
+      Point c = (m.xy[t[0]] + m.xy[t[1]] + m.xy[t[2]]) / 3;
+      order.push_back({morton_code(uint64_t((c.x - lo.x) / extent * cells), uint64_t((c.y - lo.y) / extent * cells), 0), e});
+    }
+    if (order.empty()) return true;
+    sort(order.begin(), order.end());
+    // После неудачного раунда сглаживаются узлы элементов вокруг оставшихся треугольников
+    for (int i = 0; i < (int)order.size() && round > 0; i++) {
+      for (int j = 0; j < 3; j++) {
+        for_each_out(m, m.elem[order[i].second][j], [&](int g) {
+          for (int k = 0; k < m.size(g / 4); k++) smooth_node(m, m.elem[g / 4][k]);
+        });
+      }
+    }
+    for (const auto& o : order) {
+      int e = o.second;
+      // Поиск проходит каждый элемент сначала один раз, затем дважды, чтобы цепочка могла развернуться
+      if (m.dead[e] || !m.triangle(e) || move_triangle(m, e, 1) || move_triangle(m, e, 2)) continue;
+      if (!drive_triangle(m, e) && !collapse_triangle(m, e)) spread_triangle(m, e);
+    }
+  }
+  return false;
+}
+
+// Функция для добавления узла v в триангуляцию Делоне (алгоритм Лоусона). Треугольник, содержащий узел, ищется
+// шагами от треугольника e через ребра, по другую сторону которых лежит узел; треугольник делится узлом на три,
+// а если узел лежит на ребре - оба треугольника при ребре делятся на четыре. Затем ребра напротив узла, нарушающие
+// условие Делоне, поворачиваются. Возвращает треугольник при узле для начала следующего поиска или -1, если узел
+// совпадает с узлом сетки или не найден внутри триангуляции
+int delaunay_insert(QMorphMesh& m, int v, int e) {
+  const Point& p = m.xy[v];
+  // В триангуляции Делоне обход не зацикливается; ограничение числом треугольников защищает от почти вырожденных случаев
+  for (int step = 0;; step++) {
+    if (step > (int)m.elem.size()) return -1;
+    int out = -1;
+    for (int i = 0; i < 3 && out < 0; i++) {
+      int h = 4 * e + (i + step) % 3;
+      if (orient2d(m.xy[m.origin(h)], m.xy[m.dest(h)], p) < 0) out = h;
+    }
+    if (out < 0) break;
+    if (m.twin[out] < 0) return -1;
+    e = m.twin[out] / 4;
+  }
+  const array<int, 4> t = m.elem[e];
+  int zero = -1; // Вершина треугольника напротив ребра, на котором лежит узел
+  for (int k = 0; k < 3; k++) {
+    if (m.xy[t[k]].x == p.x && m.xy[t[k]].y == p.y) return -1;
+    if (orient2d(m.xy[t[(k + 1) % 3]], m.xy[t[(k + 2) % 3]], p) == 0) zero = k;
+  }
+  // Треугольники меняются на месте: полуребра связываются напрямую, без общего поиска соседей в replace_elements
+  auto link = [&](int g, int h) {
+    if (g >= 0) m.twin[g] = h;
+    if (h >= 0) m.twin[h] = g;
+  };
+  // У треугольников при узле v он - последняя вершина, а ребро напротив него - нулевое полуребро. При переполнении
+  // стека ребра остаются без поворота, сетка остается правильной
+  int stack[qmorph_walk];
+  int n = 0;
+  if (zero < 0) {
+    int a = t[0], b = t[1], c = t[2];
+    int ab = m.twin[4 * e], bc = m.twin[4 * e + 1], ca = m.twin[4 * e + 2];
+    int e1 = add_element(m, {b, c, v, -1}), e2 = add_element(m, {c, a, v, -1});
+    m.elem[e] = {a, b, v, -1};
+    link(4 * e, ab);
+    link(4 * e + 1, 4 * e1 + 2);
+    link(4 * e + 2, 4 * e2 + 1);
+    link(4 * e1, bc);
+    link(4 * e1 + 1, 4 * e2 + 2);
+    link(4 * e2, ca);
+    m.node_he[a] = 4 * e;
+    m.node_he[b] = 4 * e1;
+    m.node_he[c] = 4 * e2;
+    m.node_he[v] = 4 * e + 2;
+    stack[n++] = 4 * e;
+    stack[n++] = 4 * e1;
+    stack[n++] = 4 * e2;
+  } else {
+    // Узел лежит на ребре u w напротив вершины x, за ребром - треугольник с вершиной y
+    int h = 4 * e + (zero + 1) % 3, o = m.twin[h];
+    if (o < 0) return -1;
+    int u = m.origin(h), w = m.dest(h), x = t[zero], y = m.origin(m.prev(o));
+    int old[2] = {e, o / 4};
+    array<int, 4> fresh[4] = {{w, x, v, -1}, {x, u, v, -1}, {u, y, v, -1}, {y, w, v, -1}};
+    int base = m.elem.size();
+    replace_elements(m, old, 2, fresh, 4);
+    for (int j = 0; j < 4; j++) stack[n++] = 4 * (j < 2 ? old[j] : base + j - 2);
+  }
+  // Ребро a b напротив v поворачивается, если вершина q соседнего треугольника (b, a, q) лежит в окружности (a, b, v)
+  while (n > 0) {
+    int h = stack[--n], o = m.twin[h];
+    int e1 = h / 4, e2 = o / 4;
+    if (o < 0 || m.elem[e1][2] != v) continue;
+    int j = o % 4;
+    int a = m.elem[e1][0], b = m.elem[e1][1], q = m.elem[e2][(j + 2) % 3];
+    if (!in_circle(m.xy[a], m.xy[b], p, m.xy[q])) continue;
+    if (orient2d(m.xy[a], m.xy[q], p) <= 0 || orient2d(m.xy[q], m.xy[b], p) <= 0) continue;
+    int bv = m.twin[4 * e1 + 1], va = m.twin[4 * e1 + 2], aq = m.twin[4 * e2 + (j + 1) % 3], qb = m.twin[4 * e2 + (j + 2) % 3];
+    m.elem[e1] = {a, q, v, -1};
+    m.elem[e2] = {q, b, v, -1};
+    link(4 * e1, aq);
+    link(4 * e1 + 1, 4 * e2 + 2);
+    link(4 * e1 + 2, va);
+    link(4 * e2, qb);
+    link(4 * e2 + 1, bv);
+    m.node_he[a] = 4 * e1;
+    m.node_he[q] = 4 * e2;
+    m.node_he[b] = 4 * e2 + 1;
+    m.node_he[v] = 4 * e1 + 2;
+    if (n + 2 > qmorph_walk) continue;
+    stack[n++] = 4 * e1;
+    stack[n++] = 4 * e2;
+  }
+  return e;
+}
+
+// Функция для построения фоновой сетки треугольников грани по ее четырехугольникам quads (в номерах узлов m,
+// adj - их таблица смежности). Узлы границы грани и закрепленные узлы сохраняются, а остальные узлы заменяются
+// точками вложенных треугольных решеток: шаг решетки в четырехугольнике - наибольший из ряда h, 2h, 4h ..., не
+// превышающий его размера (h - размер наименьшего четырехугольника), поэтому решетки соседних шагов совпадают
+// в общих точках. Точка решетки берется, если она лежит в одном из двух треугольников четырехугольника (inside)
+// и не ближе половины шага к границе грани; положение точки в пространстве интерполируется по этому треугольнику
+// По всем точкам в порядке кодов Мортона строится триангуляция Делоне внутри охватывающего треугольника, ребра
+// границы восстанавливаются поворотами, а треугольники вне грани, в том числе в ее отверстиях, удаляются
+// Возвращает false и описание в error, если грань сложена на плоскости или ее границу не удалось восстановить
+bool build_background(QMorphMesh& m, const pmr::vector<array<int, 4>>& quads, const Adjacency& adj, string& error) {
+  pmr::memory_resource* memory = m.xy.get_allocator().resource();
+  int count = quads.size(), nodes = m.xy.size();
+  // Каждый четырехугольник делится короткой диагональю на два треугольника, невыпуклый - той, при которой оба треугольника
+  // правильные; размер четырехугольника - сторона квадрата той же площади
+  pmr::vector<char> diagonal(count, 0, memory);
+  pmr::vector<double> size(count, 0, memory);
+  double h = numeric_limits<double>::infinity();
+  for (int i = 0; i < count; i++) {
+    const array<int, 4>& v = quads[i];
+    array<int, 3> t[2][2] = {{{v[0], v[1], v[2]}, {v[0], v[2], v[3]}}, {{v[0], v[1], v[3]}, {v[1], v[2], v[3]}}};
+    auto valid = [&](int d) {
+      return orient2d(m.xy[t[d][0][0]], m.xy[t[d][0][1]], m.xy[t[d][0][2]]) > 0 && orient2d(m.xy[t[d][1][0]], m.xy[t[d][1][1]], m.xy[t[d][1][2]]) > 0;
+    };
+    int d = Vector(m.xy[v[2]] - m.xy[v[0]]).length() > Vector(m.xy[v[3]] - m.xy[v[1]]).length();
+    if (!valid(d)) d = 1 - d;
+    if (!valid(d)) {
+      error = "face is folded in its parameter plane";
+      return false;
+    }
+    diagonal[i] = d;
+    size[i] = sqrt((orient2d(m.xy[v[0]], m.xy[v[1]], m.xy[v[2]]) + orient2d(m.xy[v[0]], m.xy[v[2]], m.xy[v[3]])) / 2);
+    h = min(h, size[i]);
+  }
+  // Ребра границы грани - ребра четырехугольников без соседа; грань лежит слева от них
+  pmr::vector<array<int, 2>> edges(memory);
+  pmr::vector<char> fixed(m.locked.begin(), m.locked.end(), memory); // Узлы, которые войдут в триангуляцию
+  for (int i = 0; i < count; i++) {
+    for (int k = 0; k < 4; k++) {
+      if (adj.twin[4 * i + k] >= 0) continue;
+      edges.push_back({quads[i][k], quads[i][(k + 1) % 4]});
+      fixed[quads[i][k]] = 1;
+    }
+  }
+  if (edges.empty()) {
+    error = "face has no boundary";
+    return false;
+  }
+  // Точки решеток: j-й ряд решетки шага h лежит на высоте j * hy и сдвинут на j * h / 2, ключ точки - пара номеров (i, j)
+  struct Sample {
+    long long key;
+    Point xy, pos;
+  };
+  pmr::vector<Sample> samples(memory);
+  samples.reserve(count + count / 4);
+  const double hy = h * sqrt(3.0) / 2;
+  Point origin = m.xy[0];
+  for (const Point& p : m.xy) origin = Point(min(origin.x, p.x), min(origin.y, p.y));
+  for (int i = 0; i < count; i++) {
+    const array<int, 4>& v = quads[i];
+    int step = 1;
+    while (step < (1 << 20) && 2 * step * h <= size[i] * (1 + 1e-9)) step *= 2;
+    double spacing = step * h;
+    int d = diagonal[i];
+    array<int, 3> corner[2] = {{v[0], v[1], v[2 + d]}, {v[0 + d], v[2], v[3]}};
+    Triangle tri[2] = {Triangle(m.xy[corner[0][0]], m.xy[corner[0][1]], m.xy[corner[0][2]]),
+                       Triangle(m.xy[corner[1][0]], m.xy[corner[1][1]], m.xy[corner[1][2]])};
+    // Граница вблизи четырехугольника: его узлы на границе и ребра границы у него и у соседей по ребрам
+    int near_nodes[4], n_near = 0;
+    for (int k = 0; k < 4; k++) {
+      if (fixed[v[k]]) near_nodes[n_near++] = v[k];
+    }
+    array<int, 2> near_edges[20];
+    int n_edges = 0;
+    for (int s = -1; s < 4; s++) {
+      int j = s < 0 ? i : adj.twin[4 * i + s] / 4 - adj.first;
+      if (s >= 0 && adj.twin[4 * i + s] < 0) continue;
+      for (int k = 0; k < 4; k++) {
+        if (adj.twin[4 * j + k] < 0) near_edges[n_edges++] = {quads[j][k], quads[j][(k + 1) % 4]};
+      }
+    }
+    double x_lo = m.xy[v[0]].x, x_hi = x_lo, y_lo = m.xy[v[0]].y, y_hi = y_lo;
+    for (int k = 1; k < 4; k++) {
+      x_lo = min(x_lo, m.xy[v[k]].x);
+      x_hi = max(x_hi, m.xy[v[k]].x);
+      y_lo = min(y_lo, m.xy[v[k]].y);
+      y_hi = max(y_hi, m.xy[v[k]].y);
+    }
+    long long j0 = step * (long long)ceil((y_lo - origin.y) / (hy * step)), j1 = step * (long long)floor((y_hi - origin.y) / (hy * step));
+    for (long long j = j0; j <= j1; j += step) {
+      double y = origin.y + j * hy, x0 = origin.x + j * h / 2;
+      long long i0 = step * (long long)ceil((x_lo - x0) / spacing), i1 = step * (long long)floor((x_hi - x0) / spacing);
+      for (long long l = i0; l <= i1; l += step) {
+        Point p(x0 + l * h, y);
+        int c = inside(p, tri[0]) ? 0 : (inside(p, tri[1]) ? 1 : -1);
+        if (c < 0) continue;
+        bool near = false;
+        for (int k = 0; k < n_near && !near; k++) near = Vector(p - m.xy[near_nodes[k]]).length() < spacing / 2;
+        for (int k = 0; k < n_edges && !near; k++) {
+          const Point& a = m.xy[near_edges[k][0]];
+          const Point& b = m.xy[near_edges[k][1]];
+          Vector e = b - a, r = p - a;
+          double s = max(0.0, min(1.0, (r * e) / (e * e)));
+          near = Vector(p - (a + e * s)).length() < max(spacing, e.length()) / 2;
+        }
+        if (near) continue;
+        // Положение в пространстве - по барицентрическим координатам точки в треугольнике четырехугольника
+        const array<int, 3>& w = corner[c];
+        double area = orient2d(m.xy[w[0]], m.xy[w[1]], m.xy[w[2]]);
+        double la = orient2d(p, m.xy[w[1]], m.xy[w[2]]) / area, lb = orient2d(m.xy[w[0]], p, m.xy[w[2]]) / area;
+        samples.push_back({(j << 32) + (l + (1LL << 31)), p, m.pos[w[0]] * la + m.pos[w[1]] * lb + m.pos[w[2]] * (1 - la - lb)});
+      }
+    }
+  }
+  // Точка на общей стороне четырехугольников найдена в каждом из них
+  sort(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.key < b.key; });
+  samples.erase(unique(samples.begin(), samples.end(), [](const Sample& a, const Sample& b) { return a.key == b.key; }), samples.end());
+  // Узлы триангуляции: сохраняемые узлы грани и точки решеток, а также три вершины охватывающего треугольника
+  int n_fixed = count_if(fixed.begin(), fixed.end(), [](char f) { return f != 0; });
+  int points = n_fixed + samples.size();
+  m.reserve(nodes + samples.size() + 3 + count / 4, 2 * points + count / 4 + 16);
+  pmr::vector<pair<uint64_t, int>> order(memory);
+  order.reserve(points);
+  for (int v = 0; v < nodes; v++) {
+    if (fixed[v]) order.push_back({0, v});
+  }
+  for (const Sample& s : samples) order.push_back({0, add_node(m, s.xy, s.pos)});
+  Point lo = m.xy[order[0].second], hi = lo;
+  for (const auto& o : order) {
+    const Point& p = m.xy[o.second];
+    lo = Point(min(lo.x, p.x), min(lo.y, p.y));
+    hi = Point(max(hi.x, p.x), max(hi.y, p.y));
+  }
+  double extent = max(hi.x - lo.x, hi.y - lo.y) + h;
+  const double cells = (1 << 21) - 1;
+  for (auto& o : order) {
+    const Point& p = m.xy[o.second];
+    o.first = morton_code(uint64_t((p.x - lo.x) / extent * cells), uint64_t((p.y - lo.y) / extent * cells), 0);
+  }
+  sort(order.begin(), order.end());
+  Point c = (lo + hi) / 2;
+  int s0 = add_node(m, Point(c.x - 10 * extent, c.y - 10 * extent), c);
+  int s1 = add_node(m, Point(c.x + 10 * extent, c.y - 10 * extent), c);
+  int s2 = add_node(m, Point(c.x, c.y + 10 * extent), c);
+  int e = add_element(m, {s0, s1, s2, -1});
+  for (int k = 0; k < 3; k++) m.node_he[m.elem[e][k]] = 4 * e + k;
+  m.advancing = false;
+  for (const auto& o : order) {
+    int t = delaunay_insert(m, o.second, e);
+    if (t >= 0) {
+      e = t;
+    } else if (o.second < nodes) {
+      error = "boundary node coincides with another node in the parameter plane";
+      return false;
+    }
+  }
+  for (const array<int, 2>& b : edges) {
+    if (!recover_edge(m, b[0], b[1])) {
+      error = "boundary edge is not recovered in the background mesh";
+      return false;
+    }
+  }
+  // Треугольники по обе стороны ребер границы помечаются как внутренние и внешние, и пометки распространяются
+  // через остальные ребра; треугольник, достигнутый с обеими пометками, означает незамкнутую границу
+  pmr::vector<char> border(m.twin.size(), 0, memory);
+  pmr::vector<signed char> side(m.elem.size(), -1, memory);
+  pmr::vector<int> queue(memory);
+  queue.reserve(m.elem.size());
+  bool closed = true;
+  auto mark = [&](int t, signed char s) {
+    if (side[t] < 0) {
+      side[t] = s;
+      queue.push_back(t);
+    }
+    closed = closed && side[t] == s;
+  };
+  for (const array<int, 2>& b : edges) {
+    int g = find_half_edge(m, b[0], b[1]);
+    if (g < 0 || m.twin[g] < 0) {
+      error = "boundary edge is not recovered in the background mesh";
+      return false;
+    }
+    border[g] = border[m.twin[g]] = 1;
+    mark(g / 4, 1);
+    mark(m.twin[g] / 4, 0);
+  }
+  for (size_t i = 0; i < queue.size(); i++) {
+    int t = queue[i];
+    for (int k = 0; k < 3; k++) {
+      int g = m.twin[4 * t + k];
+      if (g >= 0 && !border[4 * t + k]) mark(g / 4, side[t]);
+    }
+  }
+  if (!closed) {
+    error = "face boundary is not closed";
+    return false;
+  }
+  // Удаляем внешние треугольники и заново назначаем узлам выходящие полуребра
+  int triangles = 0;
+  for (int t = 0; t < (int)m.elem.size(); t++) {
+    if (m.dead[t]) continue;
+    if (side[t] == 1) {
+      triangles++;
+      continue;
+    }
+    m.dead[t] = 1;
+    for (int k = 0; k < 4; k++) {
+      int g = m.twin[4 * t + k];
+      if (g >= 0) m.twin[g] = -1;
+      m.twin[4 * t + k] = -1;
+    }
+  }
+  fill(m.node_he.begin(), m.node_he.end(), -1);
+  for (int t = 0; t < (int)m.elem.size(); t++) {
+    if (m.dead[t]) continue;
+    for (int k = 0; k < 3; k++) m.node_he[m.elem[t][k]] = 4 * t + k;
+  }
+  for (int v = 0; v < nodes; v++) {
+    if (fixed[v] && m.node_he[v] < 0) {
+      error = "face node lies outside the face boundary";
+      return false;
+    }
+  }
+  m.advancing = true;
+  QM_STAT_ADD(background_triangles, triangles);
+  return true;
+}
+
+// Структура результата построения сетки одной грани алгоритмом Q-Morph
+struct QMorphResult {
+  bool ok = false; // Сетка построена; иначе грань сохраняет исходные четырехугольники
+  string error; // Причина, по которой сетка не построена
+  vector<array<int, 4>> quads; // Четырехугольники: индекс узла тела или -1 - k для нового узла k
+  vector<Point> nodes; // Новые узлы грани
+  vector<array<double, 2>> uv; // Параметры новых узлов на поверхности грани
+  vector<int> removed; // Узлы тела, которые больше не используются гранью
+};
+
+// Функция для построения сетки грани f алгоритмом Q-Morph по фоновой сетке треугольников
+// Фоновая сетка - триангуляция грани по узлам ее границы и точкам решеток (см. build_background). Фронт начинается с границы
+// грани и продвигается внутрь: на очередном ребре фронта строится четырехугольник из треугольников, ребра которого
+// входят во фронт следующего ряда; сходящиеся под малым углом ребра фронта закрываются швом. Оставшиеся
+// треугольники объединяются в четырехугольники. Узлы границы грани и узлы из locked не перемещаются и не удаляются,
+// поэтому грани обрабатываются независимо и остаются согласованными с соседями. Тело не изменяется; если сетку
+// построить не удалось, причина записывается в result.error. Построенная сетка принимается, только если наименьшее
+// и среднее качество ее четырехугольников не ниже, чем у исходных; иначе грань без предупреждения сохраняет исходную сетку
+void qmorph_face(const Body& body, int f, const vector<char>& locked, QMorphResult& result) {
+  QM_STAT_TIMER(qmorph_ns);
+  const Mesh& mesh = body.mesh;
+  const Face& face = body.faces[f];
+  result = QMorphResult();
+  if (face.count == 0) return;
+  // Все рабочие массивы грани размещаются в арене потока и освобождаются разом при выходе
+  ScratchScope scope;
+  pmr::memory_resource* scratch = &scope.arena;
+  // Узлы грани: индексы узлов тела по возрастанию, номер узла в грани - его позиция в массиве
+  pmr::vector<int> nodes(scratch);
+  nodes.reserve(4 * face.count);
+  for (int i = face.first; i < face.first + face.count; i++) nodes.insert(nodes.end(), mesh.quads[i].begin(), mesh.quads[i].end());
+  sort(nodes.begin(), nodes.end());
+  nodes.erase(unique(nodes.begin(), nodes.end()), nodes.end());
+  auto local = [&](int g) { return int(lower_bound(nodes.begin(), nodes.end(), g) - nodes.begin()); };
+  // Четырехугольники грани в номерах узлов грани
+  pmr::vector<array<int, 4>> quads(face.count, array<int, 4>(), scratch);
+  for (int i = 0; i < face.count; i++) {
+    for (int k = 0; k < 4; k++) quads[i][k] = local(mesh.quads[face.first + i][k]);
+  }
+  // Координаты на плоскости: параметры поверхности, умноженные на среднюю длину на единицу параметра, если параметры
+  // известны для всех узлов грани, иначе - проекция на плоскость, перпендикулярную средней нормали четырехугольников
+  // Узлы контура могут быть общими с соседними гранями, поэтому их параметры берутся из контура грани
+  bool param = face.surface >= 0 && !mesh.uv.empty();
+  pmr::vector<array<double, 2>> uv(scratch);
+  if (param) {
+    uv.reserve(nodes.size());
+    for (int g : nodes) uv.push_back(mesh.uv[g]);
+    for (size_t k = 0; k < face.contour_uv.size(); k++) uv[local(face.contour[k])] = face.contour_uv[k];
+  }
+  for (int i = 0; i < (int)uv.size() && param; i++) param = !isnan(uv[i][0]) && !isnan(uv[i][1]);
+  double su = 1, sv = 1;
+  Point center = mesh.nodes[nodes[0]];
+  Vector e1, e2;
+  if (param) {
+    double lu = 0, pu = 0, lv = 0, pv = 0;
+    for (const array<int, 4>& q : quads) {
+      for (int k = 0; k < 4; k++) {
+        int a = q[k], b = q[(k + 1) % 4];
+        const array<double, 2>& x = uv[a];
+        const array<double, 2>& y = uv[b];
+        double du = abs(y[0] - x[0]), dv = abs(y[1] - x[1]);
+        if (du + dv == 0) continue;
+        double l = Vector(mesh.nodes[nodes[b]] - mesh.nodes[nodes[a]]).length();
+        double w = du * du / (du * du + dv * dv); // Доля ребра вдоль первого параметра
+        lu += w * l;
+        pu += w * du;
+        lv += (1 - w) * l;
+        pv += (1 - w) * dv;
+      }
+    }
+    if (pu > 0 && lu > 0) su = lu / pu;
+    if (pv > 0 && lv > 0) sv = lv / pv;
+  } else {
+    Vector n;
+    for (int i = face.first; i < face.first + face.count; i++) {
+      const array<int, 4>& q = mesh.quads[i];
+      n = n + (Vector(mesh.nodes[q[2]] - mesh.nodes[q[0]]) ^ Vector(mesh.nodes[q[3]] - mesh.nodes[q[1]]));
+    }
+    n.normalize();
+    if (n.length() == 0) {
+      result.error = "face has no mean normal";
+      return;
+    }
+    e1 = (abs(n.x) < 0.9 ? Vector(1, 0, 0) : Vector(0, 1, 0)) ^ n;
+    e1.normalize();
+    e2 = n ^ e1;
+  }
+  QMorphMesh m(scratch);
+  m.reserve(nodes.size(), 0);
+  for (int i = 0; i < (int)nodes.size(); i++) {
+    int g = nodes[i];
+    const Point& p = mesh.nodes[g];
+    Point xy = param ? Point(su * uv[i][0], sv * uv[i][1]) : Point(Vector(p - center) * e1, Vector(p - center) * e2);
+    add_node(m, xy, p, g);
+    m.locked.back() = locked[g];
+  }
+  // Четырехугольники грани должны обходиться против часовой стрелки и на плоскости; иначе отражаем плоскость
+  double area = 0;
+  for (const array<int, 4>& q : quads) area += orient2d(m.xy[q[0]], m.xy[q[1]], m.xy[q[2]]) + orient2d(m.xy[q[0]], m.xy[q[2]], m.xy[q[3]]);
+  if (area == 0) {
+    result.error = "face has zero area in its parameter plane";
+    return;
+  }
+  if (area < 0) {
+    for (Point& p : m.xy) p.y = -p.y;
+    sv = -sv;
+  }
+  // Фоновая сетка треугольников строится по четырехугольникам грани
+  Adjacency adj = build_adjacency(mesh, face, scratch);
+  if (!build_background(m, quads, adj, result.error)) {
+    QM_STAT_ADD(qmorph_failures, 1);
+    return;
+  }
+  // Начальный фронт - граница грани
+  double boundary = 0;
+  int fronts = 0;
+  for (int h = 0; h < (int)m.twin.size(); h++) {
+    if (h % 4 == 3 || m.dead[h / 4] || m.twin[h] >= 0) continue;
+    m.locked[m.origin(h)] = m.locked[m.dest(h)] = 1;
+    m.level[m.origin(h)] = m.level[m.dest(h)] = 0;
+    boundary += Vector(m.xy[m.dest(h)] - m.xy[m.origin(h)]).length();
+    fronts++;
+  }
+  m.length = boundary / fronts;
+  for (int h = 0; h < (int)m.twin.size(); h++) {
+    if (h % 4 != 3 && !m.dead[h / 4] && m.twin[h] < 0) refresh_front(m, h);
+  }
+  // Продвигаем фронт; каждое ребро фронта обрабатывается не больше qmorph_attempts раз, а количество шагов ограничено на случай зацикливания
+  const double seam = M_PI / 6; // Наибольший угол шва
+  const double ratio = 2.5; // Наибольшее отношение длин ребер шва
+  long long steps = (long long)qmorph_steps * m.elem.size() + 1000;
+  while (!m.front.empty() && steps-- > 0) {
+    int h = m.front.pop();
+    int a = m.origin(h), b = m.dest(h);
+    int x = front_prev(m, h), y = front_next(m, h);
+    double ab = Vector(m.xy[b] - m.xy[a]).length();
+    if (x >= 0 && x != b) {
+      double xa = Vector(m.xy[a] - m.xy[x]).length();
+      if (angle_ccw(m.xy[b], m.xy[a], m.xy[x]) < seam && max(ab, xa) < ratio * min(ab, xa) && close_seam(m, a, x, b)) continue;
+    }
+    if (y >= 0 && y != a) {
+      double by = Vector(m.xy[y] - m.xy[b]).length();
+      if (angle_ccw(m.xy[y], m.xy[b], m.xy[a]) < seam && max(ab, by) < ratio * min(ab, by) && close_seam(m, b, a, y)) continue;
+    }
+    if (form_quad(m, a, b)) continue;
+    m.fails[edge_key(a, b)]++;
+    int g = find_half_edge(m, a, b);
+    if (g >= 0) refresh_front(m, g);
+  }
+  for (int iteration = 0; iteration < 3; iteration++) {
+    for (int v = 0; v < (int)m.xy.size(); v++) smooth_node(m, v);
+  }
+  if (!merge_triangles(m)) {
+    result.error = "triangles are left after merging";
+    QM_STAT_ADD(qmorph_failures, 1);
+    return;
+  }
+  // Сглаживаем узлы полученной сетки четырехугольников: узлы, где сошлись фронты, располагаются равномернее
+  for (int iteration = 0; iteration < 5; iteration++) {
+    for (int v = 0; v < (int)m.xy.size(); v++) smooth_node(m, v);
+  }
+  // Узлы результата: неизмененные узлы тела сохраняют индексы, новые и перемещенные узлы добавляются заново
+  const BSplineSurface* s = param ? &body.surfaces[face.surface] : nullptr;
+  pmr::vector<int> index(m.xy.size(), -1, scratch);
+  for (int v = 0; v < (int)m.xy.size(); v++) {
+    bool alive = m.node_he[v] >= 0;
+    if (m.global[v] >= 0 && (!alive || m.moved[v])) result.removed.push_back(m.global[v]);
+    if (!alive) continue;
+    if (m.global[v] >= 0 && !m.moved[v]) {
+      index[v] = m.global[v];
+      continue;
+    }
+    index[v] = -1 - (int)result.nodes.size();
+    if (s) {
+      // Новый узел грани с поверхностью лежит на ней: параметры получаются обратным масштабированием координат
+      int m1 = s->p.size(), m2 = s->p[0].size();
+      double u = max(s->u[s->k1], min(s->u[m1], m.xy[v].x / su));
+      double w = max(s->v[s->k2], min(s->v[m2], m.xy[v].y / sv));
+      result.uv.push_back({u, w});
+      result.nodes.push_back(evaluate_b_spline_surface(s->p, s->u, s->v, s->k1, s->k2, u, w));
+    } else {
+      result.nodes.push_back(m.pos[v]);
+    }
+  }
+  for (int e = 0; e < (int)m.elem.size(); e++) {
+    if (m.dead[e]) continue;
+    const array<int, 4>& q = m.elem[e];
+    result.quads.push_back({index[q[0]], index[q[1]], index[q[2]], index[q[3]]});
+  }
+  // Сравниваем качество новой и исходной сеток грани в пространстве
+  double old_min = 1, old_sum = 0, new_min = 1, new_sum = 0;
+  for (int i = face.first; i < face.first + face.count; i++) {
+    double q = quad_quality(mesh, mesh.quads[i]);
+    old_min = min(old_min, q);
+    old_sum += q;
+  }
+  auto node = [&](int v) -> const Point& { return v >= 0 ? mesh.nodes[v] : result.nodes[-1 - v]; };
+  for (const array<int, 4>& v : result.quads) {
+    const Point& p1 = node(v[0]);
+    const Point& p2 = node(v[1]);
+    const Point& p3 = node(v[2]);
+    const Point& p4 = node(v[3]);
+    double q = quality_from_cosines(corner_cosine(p4, p1, p2), corner_cosine(p1, p2, p3), corner_cosine(p2, p3, p4), corner_cosine(p3, p4, p1));
+    new_min = min(new_min, q);
+    new_sum += q;
+  }
+  if (new_min < old_min || new_sum / result.quads.size() < old_sum / face.count) {
+    QM_STAT_ADD(qmorph_rejected, 1);
+    result = QMorphResult();
+    return;
+  }
+  result.ok = true;
+}
+
+// Функция для построения сеток граней тела алгоритмом Q-Morph (см. qmorph_face)
+// Грани обрабатываются параллельно в threads потоках (0 - по числу ядер), начиная с самых больших. Затем новые узлы
+// добавляются в сетку тела, четырехугольники собираются заново в прежнем порядке граней, а узлы, которые больше
+// не используются, удаляются с сохранением порядка остальных. Грань, сетку которой построить не удалось, сохраняет
+// исходные четырехугольники, а причина записывается в warnings. Возвращает количество таких граней; грани, новая сетка
+// которых хуже исходной, также сохраняют исходные четырехугольники, но не считаются неудачными
+int qmorph_mesh(Body& body, vector<string>& warnings, int threads = 0) {
+  Mesh& mesh = body.mesh;
+  vector<char> locked(mesh.nodes.size(), 0);
+  for (const Face& face : body.faces) {
+    for (int n : face.contour) locked[n] = 1;
+  }
+  vector<QMorphResult> results(body.faces.size());
+  vector<long long> weight;
+  for (const Face& face : body.faces) weight.push_back(face.count);
+  run_work_stealing(weight, threads, [&](int f, int) { qmorph_face(body, f, locked, results[f]); });
+  // Новые массивы четырехугольников размещаются в том же источнике памяти, что и сетка
+  pmr::vector<array<int, 4>> quads(mesh.quads.get_allocator());
+  pmr::vector<int> owner(mesh.owner.get_allocator());
+  size_t total = 0;
+  for (int f = 0; f < (int)body.faces.size(); f++) total += results[f].ok ? results[f].quads.size() : body.faces[f].count;
+  quads.reserve(total);
+  owner.reserve(total);
+  vector<char> unused; // Узлы, удаленные из граней
+  int failed = 0;
+  for (int f = 0; f < (int)body.faces.size(); f++) {
+    Face& face = body.faces[f];
+    const QMorphResult& r = results[f];
+    int first = quads.size();
+    if (!r.error.empty()) {
+      warnings.push_back("advancing front failed on face " + to_string(f) + ": " + r.error + "; the face keeps its quadrilaterals");
+      failed++;
+    }
+    if (!r.ok) {
+      quads.insert(quads.end(), mesh.quads.begin() + face.first, mesh.quads.begin() + face.first + face.count);
+    } else {
+      int base = mesh.nodes.size();
+      for (size_t k = 0; k < r.nodes.size(); k++) {
+        add_node(mesh, r.nodes[k]);
+        if (!mesh.uv.empty() && k < r.uv.size()) mesh.uv.back() = r.uv[k];
+      }
+      for (array<int, 4> q : r.quads) {
+        for (int& v : q) {
+          if (v < 0) v = base - 1 - v;
+        }
+        quads.push_back(q);
+      }
+      if (!r.removed.empty()) unused.resize(mesh.nodes.size(), 0);
+      for (int v : r.removed) unused[v] = 1;
+    }
+    owner.resize(quads.size(), f);
+    face.first = first;
+    face.count = quads.size() - first;
+  }
+  mesh.quads.swap(quads);
+  mesh.owner.swap(owner);
+  if (unused.empty()) return failed;
+  unused.resize(mesh.nodes.size(), 0);
+  vector<int> index(mesh.nodes.size(), -1);
+  int n = 0;
+  for (int i = 0; i < (int)mesh.nodes.size(); i++) {
+    if (unused[i]) continue;
+    index[i] = n;
+    mesh.nodes[n] = mesh.nodes[i];
+    if (!mesh.uv.empty()) mesh.uv[n] = mesh.uv[i];
+    n++;
+  }
+  mesh.nodes.resize(n);
+  if (!mesh.uv.empty()) mesh.uv.resize(n);
+  for (array<int, 4>& q : mesh.quads) {
+    for (int& v : q) v = index[v];
+  }
+  for (Face& face : body.faces) {
+    for (int& v : face.contour) v = index[v];
+  }
+  return failed;
+}
+
+// Функция для построения сеток граней с выводом предупреждений о необработанных гранях в стандартный поток ошибок
+void qmorph_mesh(Body& body, int threads = 0) {
+  vector<string> warnings;
+  qmorph_mesh(body, warnings, threads);
+  for (const string& w : warnings) cerr << "Warning: " << w << endl;
+}
+
+// Структура для хранения параметров сглаживания узлов сетки
+struct SmoothingOptions {
+  bool angle_based = true; // Сглаживание по углам (Zhou, Shimada); иначе - по Лапласу
+  bool coloured = true; // Проходы Гаусса - Зейделя по цветам раскраски узлов; иначе - проходы Якоби
+  int sweeps = 10; // Наибольшее количество проходов
+  double tolerance = 1e-4; // Проходы прекращаются, когда среднее качество изменилось меньше чем на tolerance
+};
+
+// Структура для хранения углов четырехугольников при каждом узле сетки в сжатых строках
+struct NodeCorners {
+  vector<int> first; // Углы узла v занимают позиции first[v]..first[v + 1] - 1
+  vector<int> corners; // Углы 4 * i + k: узел является вершиной k четырехугольника i
+};
+
+// Функция для построения углов четырехугольников при узлах сетки
+NodeCorners build_node_corners(const Mesh& mesh) {
+  NodeCorners nc;
+  nc.first.assign(mesh.nodes.size() + 1, 0);
+  for (const array<int, 4>& q : mesh.quads) {
+    for (int v : q) nc.first[v + 1]++;
+  }
+  for (size_t v = 0; v < mesh.nodes.size(); v++) nc.first[v + 1] += nc.first[v];
+  nc.corners.resize(4 * mesh.quads.size());
+  vector<int> pos(nc.first.begin(), nc.first.end() - 1);
+  for (int i = 0; i < (int)mesh.quads.size(); i++) {
+    for (int k = 0; k < 4; k++) nc.corners[pos[mesh.quads[i][k]]++] = 4 * i + k;
+  }
+  return nc;
+}
+
+// Функция для жадной раскраски узлов nodes по порядку так, чтобы узлы одного цвета не были вершинами одного четырехугольника
+// Записывает в order узлы, упорядоченные по цветам, а в first - начала цветов в order (последний элемент - размер order)
+void colour_nodes(const Mesh& mesh, const NodeCorners& nc, const vector<int>& nodes, vector<int>& order, vector<int>& first) {
+  vector<int> colour(mesh.nodes.size(), -1);
+  vector<int> stamp; // stamp[c] = v, если цвет c занят соседом узла v
+  int colours = 0;
+  for (int v : nodes) {
+    for (int j = nc.first[v]; j < nc.first[v + 1]; j++) {
+      for (int u : mesh.quads[nc.corners[j] / 4]) {
+        if (colour[u] >= 0) stamp[colour[u]] = v;
+      }
+    }
+    int c = 0;
+    while (c < colours && stamp[c] == v) c++;
+    if (c == colours) {
+      colours++;
+      stamp.push_back(-1);
+    }
+    colour[v] = c;
+  }
+  first.assign(colours + 1, 0);
+  for (int v : nodes) first[colour[v] + 1]++;
+  for (int c = 0; c < colours; c++) first[c + 1] += first[c];
+  order.resize(nodes.size());
+  vector<int> pos(first.begin(), first.end() - 1);
+  for (int v : nodes) order[pos[colour[v]]++] = v;
+}
+
+// Функция для вычисления точки, в которую нужно перенести узел o, чтобы ребро p o делило пополам угол между ребрами p x и p y
+// Расстояние от p до узла сохраняется; точка берется со стороны узла o, n - нормаль к поверхности у узла o
+Point bisector_point(const Point& o, const Point& p, const Point& x, const Point& y, const Vector& n) {
+  Vector e1(x - p), e2(y - p);
+  e1.normalize();
+  e2.normalize();
+  Vector d = e1 + e2;
+  // При развернутом угле биссектриса перпендикулярна ребрам в касательной плоскости
+  if (d.length() < 0.1) d = n ^ (e2 + (-e1));
+  Vector r(o - p);
+  double l = d.length();
+  if (l == 0) return o;
+  if (d * r < 0) d = -d;
+  return p - d * (-r.length() / l);
+}
+
+// Функция для вычисления нового положения свободного узла v по соседним узлам без проверки его допустимости
+// По Лапласу узел переносится в среднее соседей по ребрам. При сглаживании по углам для каждого узла p многоугольника
+// вокруг v (соседи по ребрам и противоположные вершины четырехугольников) берется точка на биссектрисе угла многоугольника
+// при p, и узел переносится в среднее этих точек. Возвращает false, если у узла нет четырехугольников
+bool smoothed_position(const Mesh& mesh, const NodeCorners& nc, int v, bool angle_based, Point& p) {
+  int begin = nc.first[v], end = nc.first[v + 1];
+  if (begin == end) return false;
+  const Point& o = mesh.nodes[v];
+  Point sum;
+  if (!angle_based) {
+    // Каждый сосед по ребру входит в два четырехугольника при узле и учитывается дважды
+    for (int j = begin; j < end; j++) {
+      const array<int, 4>& q = mesh.quads[nc.corners[j] / 4];
+      int k = nc.corners[j] % 4;
+      sum = sum + mesh.nodes[q[(k + 1) % 4]] + mesh.nodes[q[(k + 3) % 4]];
+    }
+    p = sum / (2 * (end - begin));
+    return true;
+  }
+  // Нормаль к поверхности у узла - сумма нормалей его четырехугольников
+  Vector n;
+  for (int j = begin; j < end; j++) {
+    const array<int, 4>& q = mesh.quads[nc.corners[j] / 4];
+    int k = nc.corners[j] % 4;
+    n = n + (Vector(mesh.nodes[q[(k + 2) % 4]] - o) ^ Vector(mesh.nodes[q[(k + 3) % 4]] - mesh.nodes[q[(k + 1) % 4]]));
+  }
+  // Соседи многоугольника у соседа по ребру - противоположные вершины двух четырехугольников при этом ребре
+  const int limit = 16;
+  int nb[limit], side[limit][2], count[limit];
+  int m = 0, points = 0;
+  for (int j = begin; j < end; j++) {
+    const array<int, 4>& q = mesh.quads[nc.corners[j] / 4];
+    int k = nc.corners[j] % 4;
+    int a = q[(k + 1) % 4], c = q[(k + 2) % 4], b = q[(k + 3) % 4];
+    sum = sum + bisector_point(o, mesh.nodes[c], mesh.nodes[a], mesh.nodes[b], n);
+    points++;
+    for (int s : {a, b}) {
+      int t = 0;
+      while (t < m && nb[t] != s) t++;
+      if (t == limit) return smoothed_position(mesh, nc, v, false, p);
+      if (t == m) {
+        nb[m] = s;
+        count[m++] = 0;
+      }
+      if (count[t] < 2) side[t][count[t]] = c;
+      count[t]++;
+    }
+  }
+  for (int t = 0; t < m; t++) {
+    // Ребро на границе области узла или неманифолдное ребро: сосед сохраняет текущее расстояние и направление
+    if (count[t] != 2) {
+      sum = sum + o;
+    } else {
+      sum = sum + bisector_point(o, mesh.nodes[nb[t]], mesh.nodes[side[t][0]], mesh.nodes[side[t][1]], n);
+    }
+    points++;
+  }
+  p = sum / points;
+  return true;
+}
+
+// Функция для сглаживания свободного узла v сетки тела без ее изменения
+// Новое положение проецируется на поверхность грани (или проверяется по иерархии surface) и принимается, если наименьшее
+// качество четырехугольников при узле не уменьшилось (или исправлен вогнутый угол) и ни один их выпуклый угол не вывернулся
+// Возвращает true, если перемещение принято; p и uv - новое положение узла и его параметры
+bool smooth_body_node(const Body& body, const NodeCorners& nc, const SurfaceBvh& surface, int v, bool angle_based, Point& p, array<double, 2>& uv) {
+  const Mesh& mesh = body.mesh;
+  if (!smoothed_position(mesh, nc, v, angle_based, p)) return false;
+  // Свободный узел лежит внутри одной грани; ее поверхность определяется по любому четырехугольнику при узле
+  const Face& face = body.faces[mesh.owner[nc.corners[nc.first[v]] / 4]];
+  bool on_surface = face.surface >= 0 && !mesh.uv.empty() && !isnan(mesh.uv[v][0]) && !isnan(mesh.uv[v][1]);
+  if (on_surface) {
+    QM_STAT_TIMER(surface_ns);
+    QM_STAT_ADD(projections, 1);
+    uv = mesh.uv[v];
+    Point q; // Проекция сглаженного положения на поверхность
+    if (!project_to_surface(body.surfaces[face.surface], p, uv[0], uv[1], q)) {
+      QM_STAT_ADD(rejected_moves, 1);
+      return false;
+    }
+    p = q;
+  }
+  QM_STAT_ADD(quality_updates, nc.first[v + 1] - nc.first[v]);
+  double before = 1, after = 1;
+  int fixed = 0; // Вогнутые или вывернутые углы, которые стали выпуклыми
+  for (int j = nc.first[v]; j < nc.first[v + 1]; j++) {
+    const array<int, 4>& q = mesh.quads[nc.corners[j] / 4];
+    Point x[4];
+    for (int t = 0; t < 4; t++) x[t] = mesh.nodes[q[t]];
+    Vector normal = Vector(x[2] - x[0]) ^ Vector(x[3] - x[1]); // Нормаль четырехугольника до перемещения
+    auto corner = [&](int t) { return orientation(x[(t + 3) % 4], x[t], x[(t + 1) % 4], normal); };
+    int turned[4];
+    for (int t = 0; t < 4; t++) turned[t] = corner(t);
+    before = min(before, quality_from_cosines(corner_cosine(x[3], x[0], x[1]), corner_cosine(x[0], x[1], x[2]), corner_cosine(x[1], x[2], x[3]), corner_cosine(x[2], x[3], x[0])));
+    x[nc.corners[j] % 4] = p;
+    for (int t = 0; t < 4; t++) {
+      int o = corner(t);
+      if (turned[t] > 0 && o <= 0) {
+        QM_STAT_ADD(rejected_moves, 1);
+        return false;
+      }
+      fixed += turned[t] <= 0 && o > 0;
+    }
+    after = min(after, quality_from_cosines(corner_cosine(x[3], x[0], x[1]), corner_cosine(x[0], x[1], x[2]), corner_cosine(x[1], x[2], x[3]), corner_cosine(x[2], x[3], x[0])));
+  }
+  // Перемещение, исправляющее вогнутые углы, принимается и при меньшем качестве: метрика углов не отличает вогнутый угол
+  // от выпуклого с тем же косинусом. Положение узла без параметров проверяется по иерархии после более дешевых проверок
+  bool valid = fixed > 0 || after >= before;
+  if (valid && !on_surface) {
+    QM_STAT_TIMER(surface_ns);
+    QM_STAT_ADD(surface_checks, 1);
+    valid = surface.on_surface(p);
+  }
+  if (!valid) {
+    QM_STAT_ADD(rejected_moves, 1);
+    return false;
+  }
+  QM_STAT_ADD(smoothing_moves, 1);
+  return true;
+}
+
+// Функция для вычисления среднего качества четырехугольников сетки в threads потоках
+double mean_quality(const Mesh& mesh, int threads = 0) {
+  const int chunk = 4096;
+  int count = mesh.quads.size(), chunks = (count + chunk - 1) / chunk;
+  if (count == 0) return 1;
+  vector<double> sums(chunks);
+  run_work_stealing(vector<long long>(chunks, 1), threads, [&](int t, int) {
+    double q[chunk];
+    int first = t * chunk, n = min(chunk, count - first);
+    quality_kernel(mesh, first, n, nullptr, q);
+    sums[t] = accumulate(q, q + n, 0.0);
+  });
+  return accumulate(sums.begin(), sums.end(), 0.0) / count;
+}
+
+// Функция для сглаживания свободных узлов сетки тела проходами по всем узлам в threads потоках (0 - по числу ядер)
+// Узлы из locked не перемещаются. При проходах Гаусса - Зейделя узлы раскрашиваются так, что узлы одного цвета не имеют
+// общих четырехугольников; узлы одного цвета обрабатываются параллельно, и их новые положения сразу видны следующим цветам.
+// При проходах Якоби новые положения всех узлов вычисляются по прежним и применяются вместе. Каждое перемещение
+// проверяется в smooth_body_node по четырехугольникам при узле, поэтому проход не отменяется, даже если среднее качество
+// временно уменьшилось (так бывает на первом проходе после продвижения фронта). Проходы прекращаются, когда ни один узел
+// не перемещен или среднее качество изменилось меньше чем на tolerance
+// surface - иерархия исходной поверхности для граней без параметров (см. smooth_body_node)
+void smooth_mesh(Body& body, const vector<char>& locked, const SurfaceBvh& surface, int threads = 0, const SmoothingOptions& options = SmoothingOptions()) {
+  QM_STAT_TIMER(smoothing_ns);
+  Mesh& mesh = body.mesh;
+  NodeCorners nc = build_node_corners(mesh);
+  vector<int> nodes; // Свободные узлы сетки
+  for (int v = 0; v < (int)mesh.nodes.size(); v++) {
+    if (!locked[v] && nc.first[v] < nc.first[v + 1]) nodes.push_back(v);
+  }
+  if (nodes.empty()) return;
+  vector<int> order, first; // Узлы по цветам и начала цветов
+  if (options.coloured) {
+    colour_nodes(mesh, nc, nodes, order, first);
+  } else {
+    order = nodes;
+    first = {0, (int)nodes.size()};
+  }
+  const int chunk = 1024; // Количество узлов в одной задаче прохода
+  bool with_uv = !mesh.uv.empty();
+  vector<Point> pos(order.size()); // Новые положения узлов при проходе Якоби
+  vector<array<double, 2>> uv(with_uv ? order.size() : 0);
+  vector<char> moved(order.size());
+  double quality = mean_quality(mesh, threads);
+  for (int sweep = 0; sweep < options.sweeps; sweep++) {
+    for (int c = 0; c + 1 < (int)first.size(); c++) {
+      int chunks = (first[c + 1] - first[c] + chunk - 1) / chunk;
+      run_work_stealing(vector<long long>(chunks, 1), threads, [&](int task, int) {
+        int begin = first[c] + task * chunk, end = min(first[c + 1], begin + chunk);
+        for (int t = begin; t < end; t++) {
+          array<double, 2> w;
+          moved[t] = smooth_body_node(body, nc, surface, order[t], options.angle_based, pos[t], w);
+          if (with_uv && moved[t]) uv[t] = w;
+          // Узлы одного цвета не соседствуют, поэтому при проходе Гаусса - Зейделя узел перемещается сразу
+          if (options.coloured && moved[t]) {
+            mesh.nodes[order[t]] = pos[t];
+            if (with_uv) mesh.uv[order[t]] = uv[t];
+          }
+        }
+      });
+    }
+    if (!options.coloured) {
+      for (size_t t = 0; t < order.size(); t++) {
+        if (!moved[t]) continue;
+        mesh.nodes[order[t]] = pos[t];
+        if (with_uv) mesh.uv[order[t]] = uv[t];
+      }
+    }
+    QM_STAT_ADD(smoothing_sweeps, 1);
+    double q = mean_quality(mesh, threads);
+    bool converged = abs(q - quality) < options.tolerance || count(moved.begin(), moved.end(), 1) == 0;
+    quality = q;
+    if (converged) break;
+  }
+}
+
+// Функция для генерации неструктурированной поверхностной прямоугольной сетки при помощи алгоритма Q-Morph для трехмерного тела
+// Грани обрабатываются параллельно в threads потоках (0 - по числу ядер), начиная с самых больших;
+// threshold - порог качества, ниже которого четырехугольники перестраиваются; при advancing_front = false сетка граней
+// не перестраивается продвижением фронта, а только улучшается; smoothing - параметры сглаживания узлов
+// Грани, сетку которых не удалось перестроить продвижением фронта, перечисляются в warnings
+void generate_mesh(Body& body, vector<string>& warnings, int threads = 0, double threshold = 0.8, bool advancing_front = true,
+                   const SmoothingOptions& smoothing = SmoothingOptions()) {
+  // Алгоритм Q-Morph: https://www.researchgate.net/publication/220562461_Q-Morph_An_Indirect_Approach_to_Advancing_Front_Quad_Meshing
+  Mesh& mesh = body.mesh;
+  // Шаг 1: Создаем начальную сетку из четырехугольников, аппроксимирующих поверхность тела
+  // Этот шаг уже выполнен при чтении тела из файла формата IGES
+  // Перестраиваем сетку каждой грани продвижением фронта от ее границы по фоновым треугольникам начальной сетки
+  if (advancing_front) qmorph_mesh(body, warnings, threads);
+  // Закрепляем узлы на границах граней до начала обработки: соседние грани совпадают вдоль общих границ,
+  // а результат не зависит ни от порядка обработки граней, ни от количества потоков
+  vector<char> locked(mesh.nodes.size(), 0);
+  for (const Face& face : body.faces) {
+    for (int n : face.contour) locked[n] = 1;
+  }
+  // Сглаженные узлы граней с исходной поверхностью проецируются на нее; для остальных граней
+  // один раз строим иерархию исходной сетки тела, по которой проверяется положение сглаженных узлов
+  SurfaceBvh surface;
+  bool need_bvh = mesh.uv.empty();
+  for (const Face& face : body.faces) need_bvh = need_bvh || face.surface < 0;
+  if (need_bvh) surface = build_surface_bvh(mesh);
+  // Шаги 2-4 выполняются для каждой грани независимо, вес задачи - количество четырехугольников грани
+  vector<long long> weight;
+  for (const Face& face : body.faces) weight.push_back(face.count);
+  run_work_stealing(weight, threads, [&](int f, int) { improve_face(body, f, threshold); });
+  // Сглаживаем свободные узлы всего тела проходами по массиву узлов
+  smooth_mesh(body, locked, surface, threads, smoothing);
+}
+
+// Функция для генерации сетки с выводом предупреждений в стандартный поток ошибок
+void generate_mesh(Body& body, int threads = 0, double threshold = 0.8, bool advancing_front = true, const SmoothingOptions& smoothing = SmoothingOptions()) {
+  vector<string> warnings;
+  generate_mesh(body, warnings, threads, threshold, advancing_front, smoothing);
+  for (const string& w : warnings) cerr << "Warning: " << w << endl;
+}
+
+// Функция для сортировки массива a в threads потоках (0 - по числу ядер): части массива сортируются параллельно,
+// затем попарно сливаются. Порядок равных элементов не определен, поэтому элементы должны различаться
+template <class T>
+void parallel_sort(vector<T>& a, int threads = 0) {
+  const size_t chunk = 1 << 16; // Размер части, сортируемой одной задачей
+  size_t n = a.size(), chunks = (n + chunk - 1) / chunk;
+  run_work_stealing(vector<long long>(chunks, 1), threads, [&](int t, int) { sort(a.begin() + t * chunk, a.begin() + min(n, (t + 1) * chunk)); });
+  for (size_t width = chunk; width < n; width *= 2) {
+    size_t pairs = (n + 2 * width - 1) / (2 * width);
+    run_work_stealing(vector<long long>(pairs, 1), threads, [&](int t, int) {
+      size_t first = 2 * width * t, middle = min(n, first + width), last = min(n, first + 2 * width);
+      inplace_merge(a.begin() + first, a.begin() + middle, a.begin() + last);
+    });
+  }
+}
+
+// Функция для сварки близких узлов сетки тела: узлы на расстоянии не больше tolerance в долях диагонали параллелепипеда
+// узлов объединяются в узел с наименьшим индексом, а четырехугольники и контуры граней переводятся на него
+// Свариваются узлы контуров граней и все узлы граней без контура (например, прочитанных из NEU). В один узел никогда
+// не попадают вершины одного четырехугольника, поэтому четырехугольники не вырождаются, и узлы контура одной грани,
+// поэтому полюса и швы замкнутых поверхностей сохраняются; узлы разных граней свариваются, даже если грани уже связаны
+// общими сторонами (например, незамкнутый шов кольца поверхностей, стороны которого не удалось объединить при чтении). Узлы раскладываются по ячейкам размера допуска, упорядоченным по кодам Мортона, и пары ищутся
+// в соседних ячейках параллельно в threads потоках (0 - по числу ядер); пары объединяются в порядке индексов узлов,
+// поэтому результат не зависит от количества потоков. Возвращает количество удаленных узлов
+int weld_nodes(Body& body, double tolerance, int threads = 0) {
+  QM_STAT_TIMER(weld_ns);
+  Mesh& mesh = body.mesh;
+  int n = mesh.nodes.size();
+  if (n == 0 || !(tolerance > 0)) return 0;
+  // Узлы-кандидаты: узлы контуров граней и все узлы граней без контура
+  vector<char> candidate(n, 0);
+  for (const Face& face : body.faces) {
+    if (!face.contour.empty()) {
+      for (int v : face.contour) candidate[v] = 1;
+      continue;
+    }
+    for (int i = face.first; i < face.first + face.count; i++) {
+      for (int v : mesh.quads[i]) candidate[v] = 1;
+    }
+  }
+  vector<int> nodes;
+  for (int v = 0; v < n; v++) {
+    if (candidate[v]) nodes.push_back(v);
+  }
+  if (nodes.size() < 2) return 0;
+  // Грани, в контуры которых входит узел: грани узла v занимают позиции contour_first[v]..contour_first[v + 1] - 1
+  vector<int> contour_first(n + 1, 0), contour_faces;
+  for (const Face& face : body.faces) {
+    for (int v : face.contour) contour_first[v + 1]++;
+  }
+  for (int v = 0; v < n; v++) contour_first[v + 1] += contour_first[v];
+  contour_faces.resize(contour_first[n]);
+  vector<int> pos(contour_first.begin(), contour_first.end() - 1);
+  for (int f = 0; f < (int)body.faces.size(); f++) {
+    for (int v : body.faces[f].contour) {
+      // Замкнутый контур может проходить через узел дважды
+      if (pos[v] == contour_first[v] || contour_faces[pos[v] - 1] != f) contour_faces[pos[v]++] = f;
+    }
+  }
+  NodeCorners nc = build_node_corners(mesh);
+  // Функция для проверки, нельзя ли сваривать узлы a и b: они - вершины одного четырехугольника или лежат на контуре одной грани
+  auto related = [&](int a, int b) {
+    for (int c = nc.first[a]; c < nc.first[a + 1]; c++) {
+      const array<int, 4>& q = mesh.quads[nc.corners[c] / 4];
+      if (q[0] == b || q[1] == b || q[2] == b || q[3] == b) return true;
+    }
+    for (int i = contour_first[a]; i < pos[a]; i++) {
+      for (int j = contour_first[b]; j < pos[b]; j++) {
+        if (contour_faces[i] == contour_faces[j]) return true;
+      }
+    }
+    return false;
+  };
+  // Параллелепипед узлов и размер ячейки: несколько допусков, чтобы пары лежали в соседних ячейках, а соседние ячейки
+  // просматривались только для узлов у границы своей ячейки, и не меньше 2^-21 размера параллелепипеда, чтобы координаты
+  // ячеек помещались в код Мортона
+  const int chunk = 4096; // Количество узлов в одной задаче
+  int chunks = (nodes.size() + chunk - 1) / chunk;
+  vector<array<Point, 2>> boxes(chunks);
+  run_work_stealing(vector<long long>(chunks, 1), threads, [&](int t, int) {
+    Point lo(INFINITY, INFINITY, INFINITY), hi(-INFINITY, -INFINITY, -INFINITY);
+    for (int i = t * chunk; i < min<int>(nodes.size(), (t + 1) * chunk); i++) {
+      const Point& p = mesh.nodes[nodes[i]];
+      lo = Point(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+      hi = Point(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+    boxes[t] = {lo, hi};
+  });
+  Point lo = boxes[0][0], hi = boxes[0][1];
+  for (const array<Point, 2>& b : boxes) {
+    lo = Point(min(lo.x, b[0].x), min(lo.y, b[0].y), min(lo.z, b[0].z));
+    hi = Point(max(hi.x, b[1].x), max(hi.y, b[1].y), max(hi.z, b[1].z));
+  }
+  double tol = tolerance * sqrt(distance2(hi, lo));
+  if (!(tol > 0)) return 0;
+  const double cells = (1 << 21) - 3; // Наибольшее количество ячеек по одной оси с соседними ячейками
+  double h = max({8 * tol, (hi.x - lo.x) / cells, (hi.y - lo.y) / cells, (hi.z - lo.z) / cells});
+  // Координаты ячейки узла (с единицы, чтобы у ячеек были соседи с обеих сторон) и положение узла в ней в долях ячейки
+  auto coordinates = [&](const Point& p, uint64_t c[3], double f[3]) {
+    double x[3] = {(p.x - lo.x) / h, (p.y - lo.y) / h, (p.z - lo.z) / h};
+    for (int k = 0; k < 3; k++) {
+      c[k] = uint64_t(x[k]) + 1;
+      f[k] = x[k] - floor(x[k]);
+    }
+  };
+  // Узлы по возрастанию кодов ячеек: узлы одной ячейки идут подряд
+  vector<pair<uint64_t, int>> sorted(nodes.size());
+  run_work_stealing(vector<long long>(chunks, 1), threads, [&](int t, int) {
+    for (int i = t * chunk; i < min<int>(nodes.size(), (t + 1) * chunk); i++) {
+      uint64_t c[3];
+      double f[3];
+      coordinates(mesh.nodes[nodes[i]], c, f);
+      sorted[i] = {morton_code(c[0], c[1], c[2]), nodes[i]};
+    }
+  });
+  parallel_sort(sorted, threads);
+  // Хеш-таблица с открытой адресацией: код ячейки - начало ее узлов в sorted
+  vector<int> starts, cell_of(sorted.size()); // Начала ячеек и номер ячейки каждого узла в sorted
+  for (int i = 0; i < (int)sorted.size(); i++) {
+    if (i == 0 || sorted[i].first != sorted[i - 1].first) starts.push_back(i);
+    cell_of[i] = starts.size() - 1;
+  }
+  starts.push_back(sorted.size());
+  size_t size = 1;
+  while (size < 2 * starts.size()) size *= 2;
+  vector<int> table(size, -1); // Номер ячейки в starts или -1
+  auto slot = [&](uint64_t code) { return size_t((code * 0x9e3779b97f4a7c15ULL) >> 20) & (size - 1); };
+  for (int c = 0; c + 1 < (int)starts.size(); c++) {
+    size_t s = slot(sorted[starts[c]].first);
+    while (table[s] >= 0) s = (s + 1) & (size - 1);
+    table[s] = c;
+  }
+  auto find_cell = [&](uint64_t code) {
+    for (size_t s = slot(code); table[s] >= 0; s = (s + 1) & (size - 1)) {
+      if (sorted[starts[table[s]]].first == code) return table[s];
+    }
+    return -1;
+  };
+  // Пары близких узлов (a < b), которые можно сварить, ищутся в ячейке узла и в тех соседних ячейках, к границам
+  // которых узел ближе допуска
+  double near = tol / h;
+  vector<vector<pair<int, int>>> found(chunks);
+  run_work_stealing(vector<long long>(chunks, 1), threads, [&](int t, int) {
+    for (int i = t * chunk; i < min<int>(sorted.size(), (t + 1) * chunk); i++) {
+      int a = sorted[i].second;
+      const Point& p = mesh.nodes[a];
+      uint64_t c[3];
+      double f[3];
+      coordinates(p, c, f);
+      int lo_offset[3], hi_offset[3];
+      for (int k = 0; k < 3; k++) {
+        lo_offset[k] = f[k] < near ? -1 : 0;
+        hi_offset[k] = f[k] > 1 - near ? 1 : 0;
+      }
+      for (int dx = lo_offset[0]; dx <= hi_offset[0]; dx++) {
+        for (int dy = lo_offset[1]; dy <= hi_offset[1]; dy++) {
+          for (int dz = lo_offset[2]; dz <= hi_offset[2]; dz++) {
+            int cell = dx == 0 && dy == 0 && dz == 0 ? cell_of[i] : find_cell(morton_code(c[0] + dx, c[1] + dy, c[2] + dz));
+            if (cell < 0) continue;
+            for (int j = starts[cell]; j < starts[cell + 1]; j++) {
+              int b = sorted[j].second;
+              if (b > a && distance2(p, mesh.nodes[b]) <= tol * tol && !related(a, b)) found[t].push_back({a, b});
+            }
+          }
+        }
+      }
+    }
+  });
+  vector<pair<int, int>> pairs;
+  for (const vector<pair<int, int>>& f : found) pairs.insert(pairs.end(), f.begin(), f.end());
+  QM_STAT_ADD(weld_pairs, pairs.size());
+  if (pairs.empty()) return 0;
+  sort(pairs.begin(), pairs.end());
+  // Объединяем пары, если в получившемся узле не окажется двух узлов, которые нельзя сваривать
+  // Узлы каждого объединенного узла связаны в кольцевой список next
+  vector<int> parent(n), next(n);
+  iota(parent.begin(), parent.end(), 0);
+  iota(next.begin(), next.end(), 0);
+  for (const pair<int, int>& e : pairs) {
+    int a = find_root(parent, e.first), b = find_root(parent, e.second);
+    if (a == b) continue;
+    bool disjoint = true;
+    for (int x = a; disjoint; x = next[x]) {
+      for (int y = b; disjoint; y = next[y]) {
+        disjoint = !related(x, y);
+        if (next[y] == b) break;
+      }
+      if (next[x] == a) break;
+    }
+    if (!disjoint) continue;
+    unite(parent, a, b);
+    swap(next[a], next[b]);
+  }
+  int removed = remove_merged_nodes(mesh, body.faces, parent);
+  QM_STAT_ADD(welded_nodes, removed);
+  return removed;
+}
+
+// Структура для хранения параметров построения сетки
+struct MeshOptions {
+  int threads = 0; // Количество потоков (0 - по числу ядер)
+  SizeField size; // Размеры элементов при разбиении поверхностей IGES
+  double quality_threshold = 0.8; // Четырехугольники с качеством ниже порога улучшаются перестройкой
+  SmoothingOptions smoothing; // Параметры сглаживания узлов
+  double weld_tolerance = 1e-6; // Допуск сварки близких узлов перед построением сетки в долях размера тела, 0 - узлы не свариваются
+  bool write_quality = false; // Признак записи массива качества в файл QMB
+  bool advancing_front = true; // Сетка граней перестраивается продвижением фронта по фоновым треугольникам (Q-Morph), если новая сетка не хуже исходной
+};
+
+// Структура сеанса построения сеток для многократного использования в одном процессе
+// Сеанс хранит тело текущего задания в своей арене; при загрузке следующего задания арена откатывается к началу,
+// и ее блоки используются повторно. Функции возвращают false при ошибке и записывают ее описание в error, не завершая процесс,
+// а сообщения о пропущенных при чтении сущностях и элементах и о гранях, сетку которых не удалось перестроить, собираются в warnings
+// Тело передается между этапами и наружу перемещением, без копирования граней и сетки
+struct MeshSession {
+  MeshOptions options; // Параметры построения сетки
+  string error; // Описание последней ошибки
+  vector<string> warnings; // Предупреждения при загрузке и построении сетки текущего задания
+  shared_ptr<Arena> arena = make_shared<Arena>(); // Арена заданий сеанса
+  optional<Body> body; // Тело текущего задания или пусто, если задание не загружено
+
+  MeshSession(const MeshOptions& options = MeshOptions()) : options(options) {}
+  MeshSession(const MeshSession&) = delete;
+  MeshSession& operator=(const MeshSession&) = delete;
+
+  // Функция для создания пустого тела нового задания в арене сеанса
+  // Если тело прошлого задания было забрано функцией take, арена принадлежит ему, и сеанс заводит новую
+  Body& start() {
+    body.reset();
+    error.clear();
+    warnings.clear();
+    if (arena.use_count() > 1) arena = make_shared<Arena>();
+    else arena->reset();
+    return body.emplace(arena);
+  }
+
+  // Функция для завершения загрузки: при ошибке тело задания удаляется
+  bool loaded(bool ok) {
+    if (!ok) body.reset();
+    return ok;
+  }
+  // Функции для загрузки тела нового задания из файлов IGES, NEU и QMB
+  bool load_iges(const string& filename) {
+    return loaded(read_iges(filename, start(), error, warnings, options.threads, options.size));
+  }
+  bool load_neu(const string& filename) {
+    return loaded(read_neu(filename, start(), error, warnings));
+  }
+  bool load_mesh_file(const string& filename) {
+    return loaded(read_mesh_file(filename, start(), error));
+  }
+  // Функция для передачи сеансу тела, построенного вне его
+  void load(Body&& b) {
+    start();
+    body.emplace(move(b));
+  }
+
+  // Функция для проверки, что задание загружено
+  bool ready() {
+    if (body) return true;
+    error = "no body loaded";
+    return false;
+  }
+  // Функция для построения сетки текущего задания после сварки близких узлов
+  bool generate() {
+    if (!ready()) return false;
+    weld_nodes(*body, options.weld_tolerance, options.threads);
+    generate_mesh(*body, warnings, options.threads, options.quality_threshold, options.advancing_front, options.smoothing);
+    return true;
+  }
+  // Функции для записи сетки текущего задания в файлы NEU и QMB
+  bool save_neu(const string& filename) {
+    return ready() && write_neu(filename, *body, error, options.threads);
+  }
+  bool save_mesh_file(const string& filename) {
+    return ready() && write_mesh_file(filename, *body, error, options.write_quality);
+  }
+
+  // Функция для получения тела текущего задания перемещением; после нее задание не загружено
+  // Если задание не загружено, возвращает пустое значение и записывает ошибку в error
+  optional<Body> take() {
+    if (!ready()) return nullopt;
+    optional<Body> b(move(*body));
+    body.reset();
+    return b;
+  }
+};
+
+// Структура задания пакетной обработки
+struct BatchJob {
+  string input; // Входной файл IGES
+  string output; // Выходной файл NEU
+};
+
+// Структура результата пакетной обработки одного файла
+struct BatchResult {
+  bool ok = false; // Признак успешной обработки
+  string error; // Описание ошибки
+  vector<string> warnings; // Предупреждения при чтении файла
+  size_t nodes = 0, quads = 0; // Размер построенной сетки
+  double parse_seconds = 0, mesh_seconds = 0, write_seconds = 0; // Время этапов
+};
+
+// Функция для чтения списка заданий: в каждой строке путь к файлу IGES и путь к файлу NEU через пробел
+// Пустые строки и строки, начинающиеся с #, пропускаются; возвращает false и описание ошибки в error
+bool read_manifest(const string& filename, vector<BatchJob>& jobs, string& error) {
+  ifstream fin(filename);
+  if (!fin) {
+    error = "cannot open file " + filename;
+    return false;
+  }
+  string line;
+  for (int n = 1; getline(fin, line); n++) {
+    const char* spaces = " \t\r";
+    size_t a = line.find_first_not_of(spaces); // Начало пути к входному файлу
+    if (a == string::npos || line[a] == '#') continue;
+    size_t b = line.find_first_of(spaces, a); // Конец пути к входному файлу
+    size_t c = b == string::npos ? b : line.find_first_not_of(spaces, b); // Начало пути к выходному файлу
+    if (c == string::npos) {
+      error = filename + ":" + to_string(n) + ": missing output file";
+      return false;
+    }
+    size_t d = line.find_first_of(spaces, c); // Конец пути к выходному файлу
+    jobs.push_back({line.substr(a, b - a), line.substr(c, d == string::npos ? d : d - c)});
+  }
+  return true;
+}
+
+// Функция для пакетной обработки заданий в одном процессе
+// Чтение, построение сетки и запись разных файлов выполняются одновременно общими потоками options.threads (0 - по числу ядер),
+// каждый файл на каждом этапе обрабатывается одним потоком. Освободившийся поток берет самый поздний из готовых этапов
+// (запись, затем построение сетки, затем чтение нового файла), поэтому тела не накапливаются между этапами, а одновременно
+// в памяти находится не больше in_flight тел (0 - вдвое больше количества потоков). Тела живут в сеансах из общего пула,
+// и арены сеансов используются повторно для следующих файлов. done вызывается для каждого обработанного файла
+vector<BatchResult> run_batch(const vector<BatchJob>& jobs,
+                              const MeshOptions& options = MeshOptions(),
+                              int in_flight = 0,
+                              const function<void(int, const BatchResult&)>& done = nullptr) {
+  int n = jobs.size(); // Количество заданий
+  vector<BatchResult> results(n);
+  if (n == 0) return results;
+  int threads = worker_count(options.threads, n);
+  if (in_flight <= 0) in_flight = 2 * threads;
+  in_flight = min(in_flight, n);
+  // Пул сеансов: каждое тело от чтения до записи принадлежит одному сеансу
+  vector<MeshSession> sessions(in_flight);
+  vector<int> idle; // Свободные сеансы
+  for (int i = 0; i < in_flight; i++) {
+    sessions[i].options = options;
+    sessions[i].options.threads = 1;
+    idle.push_back(i);
+  }
+  // Очереди готовых этапов: пары (номер задания, номер сеанса)
+  deque<pair<int, int>> to_mesh, to_write;
+  int next = 0; // Следующее задание для чтения
+  int finished = 0; // Количество завершенных заданий
+  mutex lock;
+  condition_variable changed;
+  auto worker = [&]() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+      changed.wait(guard, [&] { return !to_write.empty() || !to_mesh.empty() || (next < n && !idle.empty()) || finished == n; });
+      int stage, job, slot; // Этап (0 - чтение, 1 - построение сетки, 2 - запись), задание и сеанс
+      if (!to_write.empty()) {
+        stage = 2;
+        tie(job, slot) = to_write.front();
+        to_write.pop_front();
+      } else if (!to_mesh.empty()) {
+        stage = 1;
+        tie(job, slot) = to_mesh.front();
+        to_mesh.pop_front();
+      } else if (next < n && !idle.empty()) {
+        stage = 0;
+        job = next++;
+        slot = idle.back();
+        idle.pop_back();
+      } else {
+        break;
+      }
+      guard.unlock();
+      // Выполняем этап вне блокировки
+      MeshSession& session = sessions[slot];
+      BatchResult& r = results[job];
+      auto start = chrono::steady_clock::now();
+      bool ok;
+      if (stage == 0) {
+        ok = session.load_iges(jobs[job].input);
+        r.warnings = session.warnings;
+        r.parse_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      } else if (stage == 1) {
+        ok = session.generate();
+        r.warnings = session.warnings;
+        r.mesh_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        r.nodes = session.body->mesh.nodes.size();
+        r.quads = session.body->mesh.quads.size();
+      } else {
+        ok = session.save_neu(jobs[job].output);
+        r.write_seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      }
+      bool last = !ok || stage == 2; // Задание завершено
+      if (last) {
+        r.ok = ok;
+        if (!ok) r.error = session.error;
+        session.body.reset();
+      }
+      guard.lock();
+      if (last) {
+        idle.push_back(slot);
+        finished++;
+        if (done) done(job, r);
+      } else {
+        (stage == 0 ? to_mesh : to_write).push_back({job, slot});
+      }
+      changed.notify_all();
+    }
+  };
+  vector<thread> pool;
+  for (int t = 0; t < threads; t++) pool.emplace_back(worker);
+  for (thread& th : pool) th.join();
+  return results;
+}
+
+// Функция для записи строки в виде строкового значения JSON
+string json_string(const string& s) {
+  string json = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      json += '\\';
+      json += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+      json += buffer;
+    } else {
+      json += c;
+    }
+  }
+  return json + "\"";
+}
+
+// Функция для записи результата обработки одного файла в виде объекта JSON
+string batch_result_json(const BatchJob& job, const BatchResult& r) {
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), ", \"nodes\": %zu, \"quads\": %zu, \"parse_seconds\": %.6f, \"mesh_seconds\": %.6f, \"write_seconds\": %.6f}",
+           r.nodes, r.quads, r.parse_seconds, r.mesh_seconds, r.write_seconds);
+  string warnings;
+  for (const string& w : r.warnings) warnings += (warnings.empty() ? "" : ", ") + json_string(w);
+  return "{\"input\": " + json_string(job.input) + ", \"output\": " + json_string(job.output) + ", \"ok\": " + (r.ok ? "true" : "false") +
+         ", \"error\": " + json_string(r.error) + ", \"warnings\": [" + warnings + "]" + buffer;
+}
+
+// Функция для записи итогов пакетной обработки за seconds секунд в виде объекта JSON:
+// количество файлов, ошибок и четырехугольников, пропускная способность и наибольший объем занятой памяти процесса
+// Четырехугольники считаются только у успешных заданий: у задания, не записавшего результат, сетка не получена
+string batch_summary_json(const vector<BatchResult>& results, double seconds) {
+  int failed = 0;
+  size_t quads = 0;
+  for (const BatchResult& r : results) {
+    if (!r.ok) {
+      failed++;
+    } else {
+      quads += r.quads;
+    }
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "{\"files\": %zu, \"failed\": %d, \"quads\": %zu, \"seconds\": %.6f, \"files_per_second\": %.6g, \"quads_per_second\": %.6g, "
+           "\"peak_rss_kb\": %ld}",
+           results.size(), failed, quads, seconds, seconds > 0 ? results.size() / seconds : 0.0, seconds > 0 ? quads / seconds : 0.0,
+           usage.ru_maxrss);
+  return buffer;
+}
+
+// Функция для записи B-spline поверхностей в файл формата IGES (сущности типа 128)
+// Параметры записываются в кратчайшем виде, который читается обратно без потери точности
+// Возвращает false и описание ошибки в error, если файл не удалось записать
+bool write_iges(const string& filename, const vector<BSplineSurface>& surfaces, string& error) {
+  // Функция для записи строки IGES: данные в колонках 1-72, буква секции в колонке 73 и номер строки в колонках 74-80
+  auto record = [](string& out, const string& data, char section, int seq) {
+    char line[82];
+    memset(line, ' ', 80);
+    memcpy(line, data.data(), min<size_t>(data.size(), 72));
+    line[72] = section;
+    put_int(line + 73, seq, 7);
+    line[80] = '\n';
+    out.append(line, 81);
+  };
+  // Функция для записи числа в кратчайшем виде
+  auto number = [](double x) {
+    char buffer[32];
+    return string(buffer, to_chars(buffer, buffer + sizeof(buffer), x).ptr);
+  };
+  string s_section, g_section, d_section, p_section;
+  record(s_section, "Synthetic B-spline surfaces", 'S', 1);
+  // Секция глобальных параметров: разделители, имена, единицы измерения и точность
+  string global = "1H,,1H;,2HQM,7Hqm.iges,2HQM,2HQM,32,308,15,308,15,2HQM,1.0,2,2HMM,1,1.0,15H20260101.000000,1.0E-6,1.0E6,2HQM,2HQM,11,0,"
+                  "15H20260101.000000;";
+  int g = 0;
+  for (size_t i = 0; i < global.size(); i += 72) record(g_section, global.substr(i, 72), 'G', ++g);
+  int p = 0; // Количество строк секции параметров
+  for (int e = 0; e < (int)surfaces.size(); e++) {
+    const BSplineSurface& s = surfaces[e];
+    int de = 2 * e + 1; // Указатель DE записи
+    int m1 = s.p.size(), m2 = s.p[0].size();
+    // Собираем параметры сущности в порядке, который ожидает IgesFile::read_b_spline_surface
+    vector<string> params = {"128", to_string(m1 - 1), to_string(m2 - 1), to_string(s.k1), to_string(s.k2), "0", "0", "1", "0", "0"};
+    for (double x : s.u) params.push_back(number(x));
+    for (double x : s.v) params.push_back(number(x));
+    for (int i = 0; i < m1 * m2; i++) params.push_back("1.0");
+    for (int j = 0; j < m2; j++) {
+      for (int i = 0; i < m1; i++) {
+        params.push_back(number(s.p[i][j].x));
+        params.push_back(number(s.p[i][j].y));
+        params.push_back(number(s.p[i][j].z));
+      }
+    }
+    for (double x : {s.u0, s.u1, s.v0, s.v1}) params.push_back(number(x));
+    // Раскладываем параметры по строкам: данные в колонках 1-64, указатель DE в колонках 65-72; лексема не переносится
+    int first = p + 1;
+    string line;
+    char pointer[9];
+    put_int(pointer, de, 8);
+    for (int i = 0; i < (int)params.size(); i++) {
+      string token = params[i] + (i + 1 < (int)params.size() ? ',' : ';');
+      if (line.size() + token.size() > 64) {
+        record(p_section, line + string(64 - line.size(), ' ') + string(pointer, 8), 'P', ++p);
+        line.clear();
+      }
+      line += token;
+    }
+    record(p_section, line + string(64 - line.size(), ' ') + string(pointer, 8), 'P', ++p);
+    // Запись каталога: две строки по девять полей шириной 8 символов
+    char d[73];
+    memset(d, ' ', 72);
+    d[72] = 0;
+    char* o = d;
+    for (int x : {128, first, 0, 0, 0, 0, 0, 0}) o = put_int(o, x, 8);
+    put_string(o, "00000000", 8);
+    record(d_section, d, 'D', de);
+    memset(d, ' ', 72);
+    o = d;
+    for (int x : {128, 0, 0, p - first + 1, 0}) o = put_int(o, x, 8);
+    record(d_section, d, 'D', de + 1);
+  }
+  // Секция завершения содержит количество строк остальных секций
+  char t[64];
+  snprintf(t, sizeof(t), "S%07dG%07dD%07dP%07d", 1, g, 2 * (int)surfaces.size(), p);
+  string t_section;
+  record(t_section, t, 'T', 1);
+  // Записываем файл
+  BlockWriter fout;
+  fout.fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fout.fd < 0) {
+    error = "cannot open file " + filename;
+    return false;
+  }
+  vector<string> blocks = {s_section, g_section, d_section, p_section, t_section};
+  fout.write(blocks);
+  if (close(fout.fd) != 0 || fout.failed) {
+    error = "cannot write file " + filename;
+    return false;
+  }
+  return true;
+}
+
+// Функция для записи B-spline поверхностей в файл формата IGES; при ошибке программа завершается
+void write_iges(const string& filename, const vector<BSplineSurface>& surfaces) {
+  string error;
+  if (!write_iges(filename, surfaces, error)) {
+    cerr << "Error: " << error << endl;
+    exit(1);
+  }
+}
+
+// Функция для построения B-spline поверхности степени k1 x k2 с сеткой m1 x m2 контрольных точек на области [0, 1] x [0, 1]
+// Узловые векторы равномерные с кратными концами, а контрольные точки берутся с формы shape в узлах равномерной сетки
+BSplineSurface make_b_spline_surface(int k1, int k2, int m1, int m2, const function<Point(double, double)>& shape) {
+  BSplineSurface s;
+  s.k1 = k1;
+  s.k2 = k2;
+  // Функция для построения узлового вектора для m контрольных точек степени k
+  auto knots = [](int m, int k) {
+    pmr::vector<double> t(m + k + 1);
+    for (int i = 0; i < (int)t.size(); i++) t[i] = min(1.0, max(0.0, double(i - k) / (m - k)));
+    return t;
+  };
+  s.u = knots(m1, k1);
+  s.v = knots(m2, k2);
+  s.p.assign(m1, pmr::vector<Point>(m2));
+  for (int i = 0; i < m1; i++) {
+    for (int j = 0; j < m2; j++) s.p[i][j] = shape(double(i) / (m1 - 1), double(j) / (m2 - 1));
+  }
+  s.u0 = s.v0 = 0;
+  s.u1 = s.v1 = 1;
+  return s;
+}
+
+// Функция для построения плоской поверхности a x b со смещением (x, y)
+BSplineSurface make_plane_surface(int k1, int k2, int m1, int m2, double a, double b, double x = 0, double y = 0) {
+  return make_b_spline_surface(k1, k2, m1, m2, [=](double s, double t) { return Point(x + a * s, y + b * t, 0); });
+}
+
+// Функция для построения части цилиндра радиуса r и высоты h с углом раствора angle
+BSplineSurface make_cylinder_surface(int k1, int k2, int m1, int m2, double r, double h, double angle) {
+  return make_b_spline_surface(k1, k2, m1, m2, [=](double s, double t) { return Point(r * cos(angle * s), r * sin(angle * s), h * t); });
+}
+
+// Функция для построения поверхности двоякой кривизны (волна амплитуды amp и периода a / waves) размером a x a со смещением (x, y)
+BSplineSurface make_wave_surface(int k1, int k2, int m1, int m2, double a, double amp, int waves, double x = 0, double y = 0) {
+  return make_b_spline_surface(k1, k2, m1, m2, [=](double s, double t) {
+    return Point(x + a * s, y + a * t, amp * sin(2 * M_PI * waves * s) * cos(2 * M_PI * waves * t));
+  });
+}
+
+#ifdef QM_BENCHMARK
+// Набор тестов производительности на синтетических моделях (сборка с -DQM_BENCHMARK)
+// Для каждой модели записывается файл IGES и по отдельности измеряются чтение read_iges, сварка узлов weld_nodes, вычисление точек поверхностей
+// на сетке параметров и пакетами, построение сетки qmorph_mesh, генерация сетки generate_mesh и запись write_neu. Каждое измерение выводится строкой JSON:
+// {"case": ..., "stage": ..., "seconds": ..., "throughput": ..., "unit": ..., "peak_rss_kb": ...}
+// При сборке с -DQM_STATS после каждой модели дополнительно выводится строка {"case": ..., "stats": {...}}
+// Аргументы: каталог для временных файлов (по умолчанию /tmp) и количество потоков (0 - по числу ядер)
+int main(int argc, char* argv[]) {
+  string dir = argc > 1 ? argv[1] : "/tmp";
+  int threads = argc > 2 ? atoi(argv[2]) : 0;
+  // Синтетические модели: имя, поверхности и количество четырехугольников по каждому направлению поверхности
+  struct Case {
+    string name;
+    vector<BSplineSurface> surfaces;
+    int divisions;
+  };
+  vector<Case> cases;
+  cases.push_back({"plane_1x1_2x2", {make_plane_surface(1, 1, 2, 2, 100, 100)}, 400});
+  // Одна грань из миллиона четырехугольников: сетка грани строится алгоритмом Q-Morph в одном потоке
+  cases.push_back({"plane_1x1_2x2_1M", {make_plane_surface(1, 1, 2, 2, 100, 100)}, 1000});
+  cases.push_back({"cylinder_3x1_16x2", {make_cylinder_surface(3, 1, 16, 2, 50, 100, M_PI)}, 400});
+  cases.push_back({"wave_2x2_8x8", {make_wave_surface(2, 2, 8, 8, 100, 10, 1)}, 400});
+  cases.push_back({"wave_3x3_64x64", {make_wave_surface(3, 3, 64, 64, 100, 10, 4)}, 400});
+  cases.push_back({"wave_5x5_128x128", {make_wave_surface(5, 5, 128, 128, 100, 10, 8)}, 400});
+  vector<BSplineSurface> assembly; // Сборка из 20 x 20 волнистых граней
+  for (int i = 0; i < 20; i++) {
+    for (int j = 0; j < 20; j++) assembly.push_back(make_wave_surface(3, 3, 10, 10, 10, 1, 1, 10 * i, 10 * j));
+  }
+  cases.push_back({"assembly_400x_3x3_10x10", assembly, 20});
+  // Функция для вывода результата измерения
+  auto report = [](const string& name, const char* stage, double seconds, double amount, const char* unit) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("{\"case\": \"%s\", \"stage\": \"%s\", \"seconds\": %.6f, \"throughput\": %.6g, \"unit\": \"%s\", \"peak_rss_kb\": %ld}\n",
+           name.c_str(), stage, seconds, seconds > 0 ? amount / seconds : 0.0, unit, usage.ru_maxrss);
+    fflush(stdout);
+  };
+  // Функция для измерения времени выполнения
+  auto timed = [](const function<void()>& f) {
+    auto start = chrono::steady_clock::now();
+    f();
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  };
+  for (const Case& c : cases) {
+    string iges = dir + "/qm_bench_" + c.name + ".igs";
+    string neu = dir + "/qm_bench_" + c.name + ".neu";
+    write_iges(iges, c.surfaces);
+    reset_mesh_stats();
+    struct stat st;
+    stat(iges.c_str(), &st);
+    // Чтение и разбиение поверхностей
+    SizeField size;
+    size.divisions = c.divisions;
+    // Тело создается перемещением, чтобы сетка осталась в арене задания
+    optional<Body> read;
+    double t = timed([&] { read.emplace(read_iges(iges, threads, size)); });
+    Body& body = *read;
+    report(c.name, "read_iges", t, st.st_size / 1e6, "MB/s");
+    // Сварка близких узлов
+    long long nodes = body.mesh.nodes.size();
+    t = timed([&] { weld_nodes(body, 1e-6, threads); });
+    report(c.name, "weld_nodes", t, nodes, "nodes/s");
+    // Вычисление точек поверхностей на сетке 256 x 256 параметров
+    long long points = 0;
+    t = timed([&] {
+      for (const BSplineSurface& s : body.surfaces) {
+        pmr::vector<double> us, vs;
+        size.divisions = 255;
+        surface_parameters(s, size, 0, us, vs);
+        pmr::vector<Point> out;
+        evaluate_b_spline_grid(s.p, s.u, s.v, s.k1, s.k2, us, vs, out);
+        points += out.size();
+      }
+    });
+    report(c.name, "evaluate_b_spline_grid", t, points, "points/s");
+    // Пакетное вычисление точек и производных в 4096 случайных парах параметров каждой поверхности
+    points = 0;
+    t = timed([&] {
+      mt19937 random(1);
+      for (const BSplineSurface& s : body.surfaces) {
+        SurfaceSoA soa(s.p, s.u, s.v, s.k1, s.k2);
+        uniform_real_distribution<double> u(s.u[s.k1], s.u[s.p.size()]), v(s.v[s.k2], s.v[s.p[0].size()]);
+        vector<double> us(1 << 12), vs(1 << 12);
+        for (size_t i = 0; i < us.size(); i++) {
+          us[i] = u(random);
+          vs[i] = v(random);
+        }
+        SurfaceSamples out;
+        evaluate_b_spline_batch(soa, us.data(), vs.data(), us.size(), out);
+        points += us.size();
+      }
+    });
+    report(c.name, "evaluate_b_spline_batch", t, points, "points/s");
+    // Построение сетки продвижением фронта
+    long long quads = body.mesh.quads.size();
+    t = timed([&] { qmorph_mesh(body, threads); });
+    report(c.name, "qmorph_mesh", t, quads, "quads/s");
+    // Улучшение сетки
+    t = timed([&] { generate_mesh(body, threads, 0.8, false); });
+    report(c.name, "generate_mesh", t, body.mesh.quads.size(), "quads/s");
+    // Запись сетки
+    t = timed([&] { write_neu(neu, body, threads); });
+    stat(neu.c_str(), &st);
+    report(c.name, "write_neu", t, st.st_size / 1e6, "MB/s");
+    MeshStats stats = mesh_stats();
+    if (stats.enabled) printf("{\"case\": \"%s\", \"stats\": %s}\n", c.name.c_str(), mesh_stats_json(stats).c_str());
+    unlink(iges.c_str());
+    unlink(neu.c_str());
+  }
+  return 0;
+}
+#endif
+
+#if defined(QM_BATCH) && !defined(QM_BENCHMARK)
+// Пакетная обработка (сборка с -DQM_BATCH)
+// Аргументы: файл со списком заданий (строки "вход.igs выход.neu"), количество потоков (0 - по числу ядер),
+// наибольшее количество одновременно обрабатываемых файлов (0 - вдвое больше потоков) и количество четырехугольников
+// по каждому направлению поверхности. Для каждого файла по мере готовности выводится строка JSON с результатом,
+// в конце - строка с итогами; код возврата 1, если хотя бы один файл не обработан
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    cerr << "Usage: " << argv[0] << " manifest [threads] [in_flight] [divisions]" << endl;
+    return 2;
+  }
+  vector<BatchJob> jobs;
+  string error;
+  if (!read_manifest(argv[1], jobs, error)) {
+    cerr << "Error: " << error << endl;
+    return 2;
+  }
+  MeshOptions options;
+  options.threads = argc > 2 ? atoi(argv[2]) : 0;
+  int in_flight = argc > 3 ? atoi(argv[3]) : 0;
+  if (argc > 4) options.size.divisions = atoi(argv[4]);
+  auto start = chrono::steady_clock::now();
+  vector<BatchResult> results = run_batch(jobs, options, in_flight, [&](int i, const BatchResult& r) {
+    printf("%s\n", batch_result_json(jobs[i], r).c_str());
+    fflush(stdout);
+  });
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  printf("%s\n", batch_summary_json(results, seconds).c_str());
+  for (const BatchResult& r : results) {
+    if (!r.ok) return 1;
+  }
+  return 0;
+}
+#endif